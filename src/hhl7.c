@@ -21,13 +21,31 @@ You should have received a copy of the GNU General Public License along with hhl
 #include <syslog.h>
 #include <signal.h>
 #include <json.h>
+#include <openssl/ssl.h>
 #include "hhl7extern.h"
 #include "hhl7utils.h"
 #include "hhl7json.h"
 #include "hhl7net.h"
+#include "hhl7capture.h"
+#include "hhl7dedup.h"
+#include "hhl7queue.h"
+#include "hhl7corpus.h"
+#include "hhl7stats.h"
+#include "hhl7tls.h"
+#include "hhl7batch.h"
+#include "hhl7uring.h"
+#include "hhl7ack.h"
+#include "hhl7ingest.h"
+#include "hhl7journal.h"
 #include "hhl7web.h"
 
 
+// Long only command line options
+enum longOpts { OPT_WINDOW = 256, OPT_RATE, OPT_RAMP, OPT_CAPTURE, OPT_REPLAY, OPT_SPEED,
+                OPT_GROUP, OPT_QUEUE, OPT_DRAIN, OPT_CORPUS, OPT_BLAST,
+                OPT_TLS, OPT_BATCH, OPT_IO, OPT_ACK,
+                OPT_INGEST, OPT_JOURNAL, OPT_DEDUP };
+
 // Global variables
 struct globalConfigInfo *globalConfig;
 int isDaemon = 0;
@@ -44,7 +62,7 @@ static void showVersion() {
 static void showHelp(int exCode) {
   printf("Usage:\n");
   printf("  hhl7 [-s <IP>] [-L <IP] [-p <port>] [-P <port>] [-o]\n");
-  printf("       {-D|-f|-F|-t|-T|-g|-G|-l|-r|-a|-A|-n|-N} [options] [argument ...]\n\n");
+  printf("       {-D|-f|-F|-t|-T|-g|-G|-l|-r|-a|-A|-n|-N|--replay|--drain|--blast} [options] [argument ...]\n\n");
   printf("Help Options:\n");
   printf("  -h, --help               Show help page and exit\n");
   printf("  -v, --version            Show version information and exit\n\n");
@@ -52,9 +70,11 @@ static void showHelp(int exCode) {
   printf("  -s <ip>                  Target IP/hostname to send messages to\n");
   printf("  -L <ip>                  IP address to bind when listening/responding\n");
   printf("  -p <port>                Target port number to send messages to\n");
-  printf("  -P <port>                Target port number to use for listening/responding\n\n");
+  printf("  -P <port>                Target port number to use for listening/responding\n");
+  printf("  --tls                    Use MLLP over TLS for sending and listening\n");
+  printf("  --io <epoll|uring>       Socket I/O backend, uring falls back to epoll if unsupported\n\n");
   printf("Functional Options:\n");
-  printf("  -f <fileName>            Send contents of a file\n");
+  printf("  -f <fileName>            Send each message in a file (plain or MLLP framed)\n");
   printf("  -F                       Send ./file.txt (shorthand for \"-f ./file.txt\")\n");
   printf("  -t <temp> [args ...]     Generate a message from a JSON template and send it\n");
   printf("  -T <temp> [args ...]     Same as -t, but also print message to STDOUT\n");
@@ -64,11 +84,30 @@ static void showHelp(int exCode) {
   printf("  -l                       Listen for incoming messages\n");
   printf("  -a                       Send random ACK codes back to the sending server\n");
   printf("  -A <code,...>            Same as -a, but accepts a comma list of codes, e.g: \"AA,AR\"\n");
+  printf("  --ack <temp>             Reply to received messages with ACKs built from a template\n");
+  printf("  --ingest <size>          Messages queued between the listener and processing, 0 disables\n");
   printf("  -r <temps ...>           Respond to incoming messages if they match template\n");
   printf("  -k <integer>             ACK response timeout, range: 1-60, default: 4 seconds\n");
   printf("  -K                       Print out incomming ACK responses.\n");
   printf("  -n <integer>             Send template multiple times, intended for stress testing only\n");
-  printf("  -N <integer>             Delay between sending multiple messages with -n in microseconds\n\n");
+  printf("  -N <integer>             Delay between sending multiple messages with -n in microseconds\n");
+  printf("  -j <integer>             Number of worker threads sharing the -n send count, or\n");
+  printf("                           listening with -l or -r\n");
+  printf("  --window <integer>       Send up to N messages before waiting for ACKs (pipelining)\n");
+  printf("  --rate <rate>            Send -n messages on a fixed schedule, e.g: 500/s, 300/m\n");
+  printf("  --ramp <rate>:<time>     Ramp --rate up/down to <rate> over <time>, e.g: 2000/s:10m\n");
+  printf("  --capture <fileName>     Save messages received by -l or -r with their receive times\n");
+  printf("  --journal <dir>          Journal messages received by -l or -r with an index to them\n");
+  printf("  --dedup <mode>           Detect duplicate messages received by -l or -r, off, count,\n");
+  printf("                           flag (log and process) or ack (ACK AA, don't process)\n");
+  printf("  --replay <fileName>      Re-send a --capture file or journal keeping the message gaps\n");
+  printf("  --speed <factor>         Replay speed, e.g: 10x (10 times faster), or max, default: 1x\n");
+  printf("  --group <name>           Send each message to every server in a servers.hhl7 group\n");
+  printf("  --queue <dir>            Journal messages in <dir> and retry them if a server is down\n");
+  printf("  --drain                  Send all messages left in the --queue journals and exit\n");
+  printf("  --corpus <fileName>      Save the -n messages generated by -t to a file for --blast\n");
+  printf("  --blast <fileName>       Send every message in a --corpus file as fast as possible\n");
+  printf("  --batch <integer>        Send messages in HL7 batches (FHS/BHS) of up to N messages\n\n");
 
   printf("Other Options:\n");
   printf("  -D <socket>              Run as a daemon, for systemd.socket use ONLY\n");
@@ -171,11 +210,131 @@ static int popGlobalConfig() {
   if (confItem != NULL)
     globalConfig->ackTimeout = json_object_get_int(confItem);
 
+  globalConfig->connTimeout = -1;
+  confItem = json_object_object_get(confObj, "connTimeout");
+  if (confItem != NULL)
+    globalConfig->connTimeout = json_object_get_int(confItem);
+
+  globalConfig->writeTimeout = -1;
+  confItem = json_object_object_get(confObj, "writeTimeout");
+  if (confItem != NULL)
+    globalConfig->writeTimeout = json_object_get_int(confItem);
+
   globalConfig->webTimeout = -1;
   confItem = json_object_object_get(confObj, "webTimeout");
   if (confItem != NULL)
     globalConfig->webTimeout = json_object_get_int(confItem);
 
+  globalConfig->connIdle = -1;
+  confItem = json_object_object_get(confObj, "connIdle");
+  if (confItem != NULL)
+    globalConfig->connIdle = json_object_get_int(confItem);
+
+  globalConfig->addrTTL = -1;
+  confItem = json_object_object_get(confObj, "addrTTL");
+  if (confItem != NULL)
+    globalConfig->addrTTL = json_object_get_int(confItem);
+
+  globalConfig->addrNegTTL = -1;
+  confItem = json_object_object_get(confObj, "addrNegTTL");
+  if (confItem != NULL)
+    globalConfig->addrNegTTL = json_object_get_int(confItem);
+
+  globalConfig->ioBackend[0] = '\0';
+  confItem = json_object_object_get(confObj, "ioBackend");
+  if (confItem != NULL)
+    snprintf(globalConfig->ioBackend, 6, "%s", json_object_get_string(confItem));
+
+  globalConfig->ackTemplate[0] = '\0';
+  confItem = json_object_object_get(confObj, "ackTemplate");
+  if (confItem != NULL)
+    snprintf(globalConfig->ackTemplate, 256, "%s", json_object_get_string(confItem));
+
+  globalConfig->journalSize = -1;
+  confItem = json_object_object_get(confObj, "journalSize");
+  if (confItem != NULL)
+    globalConfig->journalSize = json_object_get_int(confItem);
+
+  globalConfig->journalAge = -1;
+  confItem = json_object_object_get(confObj, "journalAge");
+  if (confItem != NULL)
+    globalConfig->journalAge = json_object_get_int(confItem);
+
+  globalConfig->journalSync = -1;
+  confItem = json_object_object_get(confObj, "journalSync");
+  if (confItem != NULL)
+    globalConfig->journalSync = json_object_get_int(confItem);
+
+  globalConfig->ingestSize = -1;
+  confItem = json_object_object_get(confObj, "ingestSize");
+  if (confItem != NULL)
+    globalConfig->ingestSize = json_object_get_int(confItem);
+
+  globalConfig->ingestWorkers = -1;
+  confItem = json_object_object_get(confObj, "ingestWorkers");
+  if (confItem != NULL)
+    globalConfig->ingestWorkers = json_object_get_int(confItem);
+
+  globalConfig->ingestPolicy[0] = '\0';
+  confItem = json_object_object_get(confObj, "ingestPolicy");
+  if (confItem != NULL)
+    snprintf(globalConfig->ingestPolicy, 6, "%s", json_object_get_string(confItem));
+
+  globalConfig->dedupMode[0] = '\0';
+  confItem = json_object_object_get(confObj, "dedupMode");
+  if (confItem != NULL)
+    snprintf(globalConfig->dedupMode, 6, "%s", json_object_get_string(confItem));
+
+  globalConfig->dedupWindow = -1;
+  confItem = json_object_object_get(confObj, "dedupWindow");
+  if (confItem != NULL)
+    globalConfig->dedupWindow = json_object_get_int(confItem);
+
+  globalConfig->dedupSize = -1;
+  confItem = json_object_object_get(confObj, "dedupSize");
+  if (confItem != NULL)
+    globalConfig->dedupSize = json_object_get_int(confItem);
+
+  globalConfig->queueDir[0] = '\0';
+  confItem = json_object_object_get(confObj, "queueDir");
+  if (confItem != NULL)
+    snprintf(globalConfig->queueDir, 256, "%s", json_object_get_string(confItem));
+
+  globalConfig->queueSync = -1;
+  confItem = json_object_object_get(confObj, "queueSync");
+  if (confItem != NULL)
+    globalConfig->queueSync = json_object_get_int(confItem);
+
+  globalConfig->queueRetryMax = -1;
+  confItem = json_object_object_get(confObj, "queueRetryMax");
+  if (confItem != NULL)
+    globalConfig->queueRetryMax = json_object_get_int(confItem);
+
+  globalConfig->queueNak[0] = '\0';
+  confItem = json_object_object_get(confObj, "queueNak");
+  if (confItem != NULL)
+    snprintf(globalConfig->queueNak, 6, "%s", json_object_get_string(confItem));
+
+  globalConfig->tlsKey[0] = '\0';
+  confItem = json_object_object_get(confObj, "tlsKey");
+  if (confItem != NULL)
+    snprintf(globalConfig->tlsKey, 256, "%s", json_object_get_string(confItem));
+
+  globalConfig->tlsCrt[0] = '\0';
+  confItem = json_object_object_get(confObj, "tlsCrt");
+  if (confItem != NULL)
+    snprintf(globalConfig->tlsCrt, 256, "%s", json_object_get_string(confItem));
+
+  globalConfig->tlsCA[0] = '\0';
+  confItem = json_object_object_get(confObj, "tlsCA");
+  if (confItem != NULL)
+    snprintf(globalConfig->tlsCA, 256, "%s", json_object_get_string(confItem));
+
+  globalConfig->tlsVerify = -1;
+  confItem = json_object_object_get(confObj, "tlsVerify");
+  if (confItem != NULL)
+    globalConfig->tlsVerify = json_object_get_int(confItem);
+
   // Log which config file is being used
   sprintf(errStr, "Using config file: %s", confFile);
   writeLog(LOG_INFO, errStr, 1);
@@ -185,7 +344,56 @@ static int popGlobalConfig() {
 }
 
 
-// Clean shutdown
+// Parse a send rate, e.g: "500", "500/s", "300/m" or "1000/h", returns msg/s or -1
+static double parseRate(char *rateStr) {
+  char *unit = NULL;
+  double rate = strtod(rateStr, &unit);
+
+  if (unit == rateStr || rate <= 0) return(-1);
+  if (*unit == '\0' || strcmp(unit, "/s") == 0) return(rate);
+  if (strcmp(unit, "/m") == 0) return(rate / 60);
+  if (strcmp(unit, "/h") == 0) return(rate / 3600);
+  return(-1);
+}
+
+
+// Parse a replay speed, e.g: "10", "10x", "0.5x" or "max" (returns 0), returns -1 if invalid
+static double parseSpeed(char *speedStr) {
+  char *unit = NULL;
+  double speed = 0;
+
+  if (strcmp(speedStr, "max") == 0) return(0);
+
+  speed = strtod(speedStr, &unit);
+  if (unit == speedStr || speed <= 0) return(-1);
+  if (*unit == '\0' || strcmp(unit, "x") == 0) return(speed);
+  return(-1);
+}
+
+
+// Parse a duration, e.g: "90", "90s", "10m" or "1h", returns seconds or -1
+static double parseDuration(char *durStr) {
+  char *unit = NULL;
+  double dur = strtod(durStr, &unit);
+
+  if (unit == durStr || dur <= 0) return(-1);
+  if (*unit == '\0' || strcmp(unit, "s") == 0) return(dur);
+  if (strcmp(unit, "m") == 0) return(dur * 60);
+  if (strcmp(unit, "h") == 0) return(dur * 3600);
+  return(-1);
+}
+
+
+// SIGINT/SIGTERM handler, the loops see the stop request and return to main for a clean
+// shutdown. A second signal exits straight away
+static void onSignal(int sig) {
+  (void) sig;
+  if (stopRequested() == 1) _exit(1);
+  requestStop();
+}
+
+
+// Clean shutdown, once the listener or web interface has stopped
 static void cleanShutdown() {
   if (getppid() > 1) {
     writeLog(LOG_INFO, "Listener child process shutting down", 0);
@@ -193,6 +401,12 @@ static void cleanShutdown() {
     writeLog(LOG_INFO, "Received signal, politely shutting down", 1);
   }
   if (webRunning == 1) cleanAllSessions();
+  waitServiceThreads();
+  if (webRunning == 0) printRecvStats();
+  closeConnPool();
+  closeCapture();
+  closeRecvJournal();
+  closeQueues();
   exit(0);
 }
 
@@ -205,7 +419,12 @@ int main(int argc, char *argv[]) {
   int daemonSock = 0, opt, option_index = 0;
   int fSend = 0, fListen = 0, fRespond = 0, fSendTemplate = 0, fShowTemplate = 0;
   int noSend = 0, fWeb = 0, sc = 0, sCount = 1, sSleep = 500, rv = -1, resType = 0;
-  int aTout = 0, pACK = 0;
+  int aTout = 0, pACK = 0, sWindow = -1, workers = 1, fReplay = 0, fDrain = 0;
+  int fBlast = 0, fTLS = 0, bSize = 0;
+  double sRate = 0, rampRate = 0, rampSecs = 0, rSpeed = 1;
+  long fCount = 0;
+  char *rampDur = NULL;
+  struct timespec sStart, sEnd;
   FILE *fp;
 
   long unsigned int maxNameL = 255;
@@ -215,6 +434,15 @@ int main(int argc, char *argv[]) {
   char lPort[6] = "22022";
   char tName[51] = "";
   char fileName[256] = "file.txt";
+  char capName[256] = "";
+  char jnlDir[256] = "";
+  char gName[256] = "";
+  char qDir[256] = "";
+  char ioName[6] = "";
+  char ackTemp[256] = "";
+  long int iSize = -1;
+  char dedup[6] = "";
+  char corpName[256] = "";
   char errStr[28] = "";
   char *ackList = NULL;
 
@@ -227,7 +455,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Catch signals for clean shutdown
-  struct sigaction sa = { .sa_handler = cleanShutdown };
+  struct sigaction sa = { .sa_handler = onSignal };
   sigaction(SIGINT, &sa, NULL);
   sigaction(SIGTERM, &sa, NULL);
 
@@ -237,15 +465,34 @@ int main(int argc, char *argv[]) {
     handleError(LOG_CRIT, "Failed to obtain system timestamp", 1, 1, 1);
   }
   srand((uint64_t) ts.tv_nsec);
+  seedRand((unsigned int) ts.tv_nsec);
 
   // Parse command line options
   static struct option long_options[] = {
     {"version", no_argument, 0, 'v'},
     {"help",    no_argument, 0, 'h'},
+    {"window",  required_argument, 0, OPT_WINDOW},
+    {"rate",    required_argument, 0, OPT_RATE},
+    {"ramp",    required_argument, 0, OPT_RAMP},
+    {"capture", required_argument, 0, OPT_CAPTURE},
+    {"replay",  required_argument, 0, OPT_REPLAY},
+    {"speed",   required_argument, 0, OPT_SPEED},
+    {"group",   required_argument, 0, OPT_GROUP},
+    {"queue",   required_argument, 0, OPT_QUEUE},
+    {"drain",   no_argument,       0, OPT_DRAIN},
+    {"corpus",  required_argument, 0, OPT_CORPUS},
+    {"blast",   required_argument, 0, OPT_BLAST},
+    {"tls",     no_argument,       0, OPT_TLS},
+    {"batch",   required_argument, 0, OPT_BATCH},
+    {"io",      required_argument, 0, OPT_IO},
+    {"ack",     required_argument, 0, OPT_ACK},
+    {"ingest",  required_argument, 0, OPT_INGEST},
+    {"journal", required_argument, 0, OPT_JOURNAL},
+    {"dedup",   required_argument, 0, OPT_DEDUP},
     {0, 0, 0, 0}
   };
 
-  while((opt = getopt_long(argc, argv, ":0vhD:f:FlA:art:T:g:G:n:N:ows:L:p:P:k:K", long_options, &option_index)) != -1) {
+  while((opt = getopt_long(argc, argv, ":0vhD:f:FlA:art:T:g:G:n:N:j:ows:L:p:P:k:K", long_options, &option_index)) != -1) {
     switch(opt) {
       case 0:
         exit(1);
@@ -354,6 +601,147 @@ int main(int argc, char *argv[]) {
         if (optarg) sSleep = atoi(optarg);
         break;
 
+      case 'j':
+        if (*argv[optind - 1] == '-')
+          handleError(LOG_ERR, "Option -j requires a value", 1, 1, 1);
+
+        if (optarg) workers = atoi(optarg);
+        if (workers < 1 || workers > 1024)
+          handleError(LOG_ERR, "Option -j out of range (1 - 1024)", 1, 1, 1);
+
+        break;
+
+      case OPT_WINDOW:
+        if (optarg) sWindow = atoi(optarg);
+        if (sWindow < 1 || sWindow > 10000)
+          handleError(LOG_ERR, "Option --window out of range (1 - 10000)", 1, 1, 1);
+
+        setSendWindow(sWindow);
+        break;
+
+      case OPT_RATE:
+        if (optarg) sRate = parseRate(optarg);
+        if (sRate <= 0)
+          handleError(LOG_ERR, "Invalid value for --rate (e.g: 500/s, 300/m or 1000/h)", 1, 1, 1);
+
+        break;
+
+      case OPT_RAMP:
+        if (optarg) rampDur = strchr(optarg, ':');
+        if (rampDur == NULL)
+          handleError(LOG_ERR, "Invalid value for --ramp (e.g: 2000/s:10m)", 1, 1, 1);
+
+        *rampDur = '\0';
+        rampRate = parseRate(optarg);
+        rampSecs = parseDuration(rampDur + 1);
+        if (rampRate <= 0 || rampSecs <= 0)
+          handleError(LOG_ERR, "Invalid value for --ramp (e.g: 2000/s:10m)", 1, 1, 1);
+
+        break;
+
+      case OPT_CAPTURE:
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --capture (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(capName, optarg);
+        break;
+
+      case OPT_JOURNAL:
+        if (validStr(optarg, 1, 200, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --journal (1-200 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(jnlDir, optarg);
+        break;
+
+      case OPT_DEDUP:
+        if (strcmp(optarg, "off") != 0 && strcmp(optarg, "count") != 0 &&
+            strcmp(optarg, "flag") != 0 && strcmp(optarg, "ack") != 0)
+          handleError(LOG_ERR, "Option --dedup must be off, count, flag or ack", 1, 1, 1);
+
+        strcpy(dedup, optarg);
+        break;
+
+      case OPT_REPLAY:
+        fReplay = 1;
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --replay (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(fileName, optarg);
+        break;
+
+      case OPT_SPEED:
+        if (optarg) rSpeed = parseSpeed(optarg);
+        if (rSpeed < 0)
+          handleError(LOG_ERR, "Invalid value for --speed (e.g: 10x, 0.5x or max)", 1, 1, 1);
+
+        break;
+
+      case OPT_GROUP:
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --group (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(gName, optarg);
+        break;
+
+      case OPT_QUEUE:
+        if (validStr(optarg, 1, 200, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --queue (1-200 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(qDir, optarg);
+        break;
+
+      case OPT_DRAIN:
+        fDrain = 1;
+        break;
+
+      case OPT_CORPUS:
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --corpus (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(corpName, optarg);
+        break;
+
+      case OPT_BLAST:
+        fBlast = 1;
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --blast (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(fileName, optarg);
+        break;
+
+      case OPT_TLS:
+        fTLS = 1;
+        break;
+
+      case OPT_BATCH:
+        if (optarg) bSize = atoi(optarg);
+        if (bSize < 2 || bSize > 100000)
+          handleError(LOG_ERR, "Option --batch out of range (2 - 100000)", 1, 1, 1);
+
+        setBatchSize(bSize);
+        break;
+
+      case OPT_IO:
+        if (validStr(optarg, 1, 5, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --io (epoll or uring)", 1, 1, 1);
+
+        strcpy(ioName, optarg);
+        break;
+
+      case OPT_ACK:
+        if (validStr(optarg, 1, maxNameL, 1) > 0)
+          handleError(LOG_ERR, "Invalid value for --ack (1-255 chars, ASCII only)", 1, 1, 1);
+
+        strcpy(ackTemp, optarg);
+        break;
+
+      case OPT_INGEST:
+        if (optarg) iSize = atol(optarg);
+        if (iSize < 0 || iSize > 1048576)
+          handleError(LOG_ERR, "Option --ingest out of range (0 - 1048576)", 1, 1, 1);
+
+        break;
+
       case 'a':
         resType = 1;
         break;
@@ -420,7 +808,7 @@ int main(int argc, char *argv[]) {
 
   if (isDaemon == 1) {
     // Check for valid options when running as Daemon
-    if (fSend + fListen + fSendTemplate + fWeb > 0)
+    if (fSend + fListen + fSendTemplate + fReplay + fDrain + fBlast + fWeb > 0)
       handleError(LOG_ERR, "-D can only be used on it's own, no other functional flags", 1, 1, 1);
 
     // Open the syslog file
@@ -434,42 +822,216 @@ int main(int argc, char *argv[]) {
 
 
   // Check we've got at least one action flag
-  if (fSend + fListen + fRespond + fSendTemplate + fWeb + isDaemon == 0)
-    handleError(LOG_ERR, "One functional flag is required (-f, -F, -t, -T, -l, -r, -D or -w)", 1, 1, 1);
+  if (fSend + fListen + fRespond + fSendTemplate + fReplay + fDrain + fBlast + fWeb + isDaemon == 0)
+    handleError(LOG_ERR, "One functional flag is required (-f, -F, -t, -T, -l, -r, -D, -w, --replay, --drain or --blast)", 1, 1, 1);
 
   // Check we're only using 1 of listen, send, template or web option
-  if (fSend + fListen + fRespond + fSendTemplate + fWeb + isDaemon > 1)
-    handleError(LOG_ERR, "Only one functional flag may be used at a time (-f, -F, -t, -T, -l, -r, -D or -w)", 1, 1, 1);
+  if (fSend + fListen + fRespond + fSendTemplate + fReplay + fDrain + fBlast + fWeb + isDaemon > 1)
+    handleError(LOG_ERR, "Only one functional flag may be used at a time (-f, -F, -t, -T, -l, -r, -D, -w, --replay, --drain or --blast)", 1, 1, 1);
+
+  // Wrap MLLP connections in TLS, listeners use the TLS (or web) key/cert files
+  if (fTLS == 1) {
+    if (setTLS(1, fListen + fRespond > 0) != 0) exit(1);
+  }
+
+  // Use io_uring for socket I/O if asked and the kernel supports it
+  if (strlen(ioName) == 0 && globalConfig && strlen(globalConfig->ioBackend) > 0)
+    sprintf(ioName, "%s", globalConfig->ioBackend);
+
+  if (strlen(ioName) > 0) {
+    if (setIOBackend(ioName) != 0) exit(1);
+  }
+
+  // ACKs are built from a template compiled once at startup
+  if (strlen(ackTemp) > 0) {
+    if (fListen + fRespond == 0)
+      handleError(LOG_ERR, "Option --ack can only be used when listening (-l or -r)", 1, 1, 1);
+
+    if (setACKTemplate(ackTemp) != 0) exit(1);
+  }
+
+  // Listeners ACK and queue each message for processing threads through an ingest ring
+  if (iSize >= 0 && fListen + fRespond == 0)
+    handleError(LOG_ERR, "Option --ingest can only be used when listening (-l or -r)", 1, 1, 1);
+
+  if (globalConfig) {
+    setIngest(globalConfig->ingestSize, globalConfig->ingestWorkers, globalConfig->ingestPolicy);
+  }
+  setIngest(iSize, 0, NULL);
+
+  // Detect messages received again (same sending facility and control ID) in a window
+  if (strlen(dedup) > 0 && fListen + fRespond == 0)
+    handleError(LOG_ERR, "Option --dedup can only be used when listening (-l or -r)", 1, 1, 1);
+
+  if (globalConfig) {
+    setDedup(globalConfig->dedupMode, globalConfig->dedupWindow, globalConfig->dedupSize);
+  }
+  if (strlen(dedup) > 0) setDedup(dedup, -1, -1);
+  if (openDedup() != 0) exit(1);
+
+  // Listeners unpack any batch they receive, batching only applies to sending
+  if (bSize > 0 && fListen + fRespond + fWeb + isDaemon > 0)
+    handleError(LOG_ERR, "Option --batch can only be used when sending messages", 1, 1, 1);
+
+  // Journal outgoing messages and retry them while a server is unavailable
+  if (strlen(qDir) == 0 && globalConfig && strlen(globalConfig->queueDir) > 0)
+    sprintf(qDir, "%s", globalConfig->queueDir);
+
+  if (strlen(qDir) > 0) {
+    if (setQueueDir(qDir) != 0) exit(1);
+  } else if (fDrain == 1) {
+    handleError(LOG_ERR, "Option --drain requires --queue or queueDir in the config file", 1, 1, 1);
+  }
+
+  if (fDrain == 1) {
+    // Retry every queued message until they've all been delivered
+    openQueues();
+    while (flushQueues(aTout, pACK) > 0 && stopRequested() == 0) sleep(1);
+    if (stopRequested() == 0) writeLog(LOG_NOTICE, "All queued messages delivered", 1);
+  }
+
+  // Send every message to all servers in the group instead of -s/-p
+  if (strlen(gName) > 0) {
+    if (setFanOut(gName, sPort) != 0) exit(1);
+  }
 
   if (fSend == 1) {
     // Open File
     fp = openFile(fileName, "r");
 
-    // If we've managed to open the file, connect to server & send it
+    // If we've managed to open the file, connect to server & stream it's messages
     if (fp != NULL) {
-      sendFile(sIP, sPort, fp, getFileSize(fileName), aTout, pACK);
+      clock_gettime(CLOCK_MONOTONIC, &sStart);
+      fCount = sendFile(sIP, sPort, fp, getFileSize(fileName), aTout, pACK);
+      flushACKs(aTout, pACK);
+      mergeSendStats();
+
+      clock_gettime(CLOCK_MONOTONIC, &sEnd);
+      if (fCount > 1) {
+        printSendStats((sEnd.tv_sec - sStart.tv_sec) +
+                       (sEnd.tv_nsec - sStart.tv_nsec) / 1000000000.0, 0);
+      }
     }
   } 
 
 
+  if (fReplay == 1) {
+    // Replays follow the captures schedule, don't let waiting for ACKs hold it up,
+    // unless --window was given
+    if (sWindow == -1) {
+      writeLog(LOG_INFO, "Using a send window of 1000 for --replay, set --window to change", 1);
+      setSendWindow(1000);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &sStart);
+    fCount = replayCapture(sIP, sPort, fileName, rSpeed, aTout, pACK);
+    flushACKs(aTout, pACK);
+    mergeSendStats();
+
+    clock_gettime(CLOCK_MONOTONIC, &sEnd);
+    if (fCount > 0) {
+      printSendStats((sEnd.tv_sec - sStart.tv_sec) +
+                     (sEnd.tv_nsec - sStart.tv_nsec) / 1000000000.0, rSpeed > 0);
+    }
+  }
+
+
+  if (fBlast == 1) {
+    // Blasts are limited by the network, don't let waiting for ACKs hold them up,
+    // unless --window was given
+    if (sWindow == -1) {
+      writeLog(LOG_INFO, "Using a send window of 1000 for --blast, set --window to change", 1);
+      setSendWindow(1000);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &sStart);
+    fCount = blastCorpus(sIP, sPort, fileName, aTout, pACK, workers);
+
+    clock_gettime(CLOCK_MONOTONIC, &sEnd);
+    if (fCount > 0) {
+      printSendStats((sEnd.tv_sec - sStart.tv_sec) +
+                     (sEnd.tv_nsec - sStart.tv_nsec) / 1000000000.0, 0);
+    }
+  }
+
+
+  // Save received messages for a later --replay
+  if (strlen(capName) > 0) {
+    if (fListen + fRespond == 0)
+      handleError(LOG_ERR, "Option --capture can only be used with -l or -r", 1, 1, 1);
+
+    if (openCapture(capName) != 0) exit(1);
+  }
+
+  // Journal received messages with an index to find them by
+  if (strlen(jnlDir) > 0) {
+    if (fListen + fRespond == 0)
+      handleError(LOG_ERR, "Option --journal can only be used with -l or -r", 1, 1, 1);
+
+    if (openRecvJournal(jnlDir) != 0) exit(1);
+  }
+
+
+  // Share incoming connections between -j listener workers
+  if (fListen + fRespond > 0) setListenWorkers(workers);
+
   if (fListen == 1) {
     // Listen for incoming messages
     startMsgListener(lIP, lPort, NULL, NULL, -1, 0, NULL, resType, ackList, aTout);
+    cleanShutdown();
   }
 
 
   if (fRespond == 1) {
     // Listen for incoming messages & respond using template
     startMsgListener(lIP, lPort, sIP, sPort, argc, optind, argv, 0, NULL, aTout);
+    cleanShutdown();
   }
 
 
+  if (rampRate > 0 && sRate <= 0)
+    handleError(LOG_ERR, "Option --ramp requires a starting --rate", 1, 1, 1);
+
+  // Rated sends are open loop, don't let waiting for ACKs hold up the schedule, unless
+  // --window was given
+  if (sRate > 0 && sWindow == -1) {
+    writeLog(LOG_INFO, "Using a send window of 1000 for --rate, set --window to change", 1);
+    setSendWindow(1000);
+  }
+
+  // Generate the messages to a corpus file for --blast instead of sending them
+  if (strlen(corpName) > 0) {
+    if (fSendTemplate == 0)
+      handleError(LOG_ERR, "Option --corpus can only be used with -t or -T", 1, 1, 1);
+
+    if (writeCorpus(corpName, tName, optind, argc, argv, sCount, workers) < 0) exit(1);
+    fSendTemplate = 0;
+  }
+
   if (fSendTemplate == 1) {
-    // Send a message based on the given JSON template & arguments, repeat N times
-    for (sc = 0; sc < sCount; sc++) {
-      sendTemp(sIP, sPort, tName, noSend, fShowTemplate, optind, argc, argv,
-               NULL, aTout, pACK);
-      usleep(sSleep);
+    clock_gettime(CLOCK_MONOTONIC, &sStart);
+
+    if (workers > 1 || sRate > 0) {
+      // Share the N sends between worker threads, each with it's own connection
+      sendTempWorkers(sIP, sPort, tName, noSend, fShowTemplate, optind, argc, argv,
+                      aTout, pACK, sCount, sSleep, workers, sRate, rampRate, rampSecs);
+
+    } else {
+      // Send a message based on the given JSON template & arguments, repeat N times
+      for (sc = 0; sc < sCount && stopRequested() == 0; sc++) {
+        sendTemp(sIP, sPort, tName, noSend, fShowTemplate, optind, argc, argv,
+                 NULL, aTout, pACK);
+        usleep(sSleep);
+      }
+      flushACKs(aTout, pACK);
+      mergeSendStats();
+    }
+
+    // Print the run report for repeated sends
+    clock_gettime(CLOCK_MONOTONIC, &sEnd);
+    if (noSend == 0 && (sCount > 1 || workers > 1)) {
+      printSendStats((sEnd.tv_sec - sStart.tv_sec) +
+                     (sEnd.tv_nsec - sStart.tv_nsec) / 1000000000.0, sRate > 0);
     }
   }
 
@@ -477,17 +1039,26 @@ int main(int argc, char *argv[]) {
   if (fWeb == 1) {
     writeLog(LOG_INFO, "Local web process starting...", 1);
     listenWeb(daemonSock);
+    cleanShutdown();
   }
 
   if (isDaemon == 1) {
     writeLog(LOG_INFO, "Daemon starting...", 0);
     listenWeb(daemonSock);
+    cleanShutdown();
   }
 
   if (fWeb == 1) {
     writeLog(LOG_INFO, "Local web process starting...", 1);
     listenWeb(daemonSock);
+    cleanShutdown();
   }
 
+  // Wait for any pipelined ACKs and close pooled connections left open by the sends above
+  flushACKs(aTout, pACK);
+  if (queueEnabled() == 1) flushQueues(aTout, pACK);
+  if (strlen(gName) > 0) printFanOutStats();
+  closeConnPool();
+  closeQueues();
   return(0);
 }
@@ -0,0 +1,391 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <json.h>
+#include "hhl7extern.h"
+#include "hhl7ack.h"
+#include "hhl7json.h"
+#include "hhl7utils.h"
+
+// ACK templates are JSON templates (segments of field id/value pairs, as for -t) that are
+// compiled once in to a list of parts, literal text and values taken from the received
+// message, so building an ACK is a single pass over the parts with no parsing or allocation.
+// Values may use:
+//   $NOW     current time (YYYYMMDDHHMMSS)          $CID  control ID of the message (MSH-10)
+//   $ACK     ACK code (AA, AE, AR, CA, CE or CR)    $TXT  OK, Error or Rejected for the code
+//   $MSHn    field n of the received MSH, $MSHn.c for component c of it
+// Segments with "onError":true are only included when the message isn't accepted
+
+#define ACK_PARTS  128
+#define ACK_TEXTS  4096
+#define ACK_FIELDS 26
+
+// Part types of a compiled ACK template
+enum ackPartType { ACK_TEXT, ACK_NOW, ACK_CID, ACK_CODE, ACK_CTXT, ACK_FIELD };
+
+// A part of the compiled template, text is held in ackText at off
+struct ACKPart {
+  int type;
+  int off;
+  int len;
+  int field;
+  int comp;
+  int onError;
+};
+
+// The compiled ACK template, shared by all listening threads and read only once compiled
+static struct ACKPart ackParts[ACK_PARTS];
+static int ackPartCount = 0;
+static char ackText[ACK_TEXTS];
+static int ackTextL = 0;
+
+// Built in template, MSH-3..6 echoed swapped (we reply as the receiving application),
+// the version echoed and an ERR segment if the message isn't accepted
+static char *defACK[3] = {
+  "MSH|^~\\&|$MSH5|$MSH6|$MSH3|$MSH4|$NOW||ACK|$CID|P|$MSH12\r",
+  "MSA|$ACK|$CID|$TXT\r",
+  "ERR|||207^Application internal error^HL70357|E\r"
+};
+
+// Timestamp for $NOW, refreshed once a second by each thread
+static __thread time_t nowSec = 0;
+static __thread char nowStr[26] = "";
+
+
+// Add a part to the compiled template, ret 0 or -1 if the template is too large
+static int addPart(int type, char *text, int textL, int field, int comp, int onError) {
+  struct ACKPart *part = NULL;
+
+  if (ackPartCount == ACK_PARTS || ackTextL + textL > ACK_TEXTS) {
+    handleError(LOG_ERR, "ACK template is too large", -1, 0, 1);
+    return(-1);
+  }
+
+  // Join literal text to the text before it
+  if (type == ACK_TEXT && ackPartCount > 0) {
+    part = &ackParts[ackPartCount - 1];
+    if (part->type == ACK_TEXT && part->onError == onError) {
+      memcpy(ackText + ackTextL, text, textL);
+      ackTextL += textL;
+      part->len += textL;
+      return(0);
+    }
+  }
+
+  part = &ackParts[ackPartCount++];
+  part->type = type;
+  part->off = ackTextL;
+  part->len = textL;
+  part->field = field;
+  part->comp = comp;
+  part->onError = onError;
+  if (textL > 0) memcpy(ackText + ackTextL, text, textL);
+  ackTextL += textL;
+  return(0);
+}
+
+
+// Compile a line of template text, splitting out the $ values
+static int compileText(char *text, int onError) {
+  char *pos = text, *var = NULL, *end = NULL;
+  int rv = 0, field = 0, comp = 0;
+
+  while (rv == 0 && (var = strchr(pos, '$')) != NULL) {
+    if (var > pos) rv = addPart(ACK_TEXT, pos, var - pos, 0, 0, onError);
+    if (rv != 0) break;
+    pos = var + 4;
+
+    if (strncmp(var, "$NOW", 4) == 0) {
+      rv = addPart(ACK_NOW, NULL, 0, 0, 0, onError);
+    } else if (strncmp(var, "$CID", 4) == 0) {
+      rv = addPart(ACK_CID, NULL, 0, 0, 0, onError);
+    } else if (strncmp(var, "$ACK", 4) == 0) {
+      rv = addPart(ACK_CODE, NULL, 0, 0, 0, onError);
+    } else if (strncmp(var, "$TXT", 4) == 0) {
+      rv = addPart(ACK_CTXT, NULL, 0, 0, 0, onError);
+
+    } else if (strncmp(var, "$MSH", 4) == 0 && var[4] >= '0' && var[4] <= '9') {
+      field = strtol(var + 4, &end, 10);
+      comp = 0;
+      if (*end == '.' && end[1] >= '1' && end[1] <= '9') comp = strtol(end + 1, &end, 10);
+      if (field < 3 || field >= ACK_FIELDS) {
+        handleError(LOG_ERR, "ACK template $MSH field out of range (3 - 25)", -1, 0, 1);
+        return(-1);
+      }
+      rv = addPart(ACK_FIELD, NULL, 0, field, comp, onError);
+      pos = end;
+
+    } else {
+      // Not a value, keep the $ as text
+      rv = addPart(ACK_TEXT, var, 1, 0, 0, onError);
+      pos = var + 1;
+    }
+  }
+
+  if (rv == 0 && *pos != '\0') rv = addPart(ACK_TEXT, pos, strlen(pos), 0, 0, onError);
+  return(rv);
+}
+
+
+// Compile a JSON ACK template, each segment is built as text then compiled
+static int compileJSON(char *jsonMsg) {
+  struct json_object *rootObj = NULL, *segsObj = NULL, *segObj = NULL, *valObj = NULL;
+  struct json_object *fieldsObj = NULL, *fieldObj = NULL;
+  char segStr[1024] = "", *vStr = NULL;
+  int segCount = 0, fieldCount = 0, s = 0, f = 0, fid = 0, lastFid = 0, segL = 0;
+  int onError = 0, rv = 0;
+
+  rootObj = json_tokener_parse(jsonMsg);
+  json_object_object_get_ex(rootObj, "segments", &segsObj);
+  if (segsObj == NULL) {
+    handleError(LOG_ERR, "Could not find any segment sections in the ACK template", -1, 0, 1);
+    json_object_put(rootObj);
+    return(-1);
+  }
+
+  segCount = json_object_array_length(segsObj);
+  for (s = 0; s < segCount && rv == 0; s++) {
+    segObj = json_object_array_get_idx(segsObj, s);
+
+    json_object_object_get_ex(segObj, "name", &valObj);
+    if (json_object_get_type(valObj) != json_type_string) {
+      handleError(LOG_ERR, "Could not read string name for segment from ACK template", -1, 0, 1);
+      rv = -1;
+      break;
+    }
+    segL = snprintf(segStr, sizeof(segStr), "%s", json_object_get_string(valObj));
+
+    valObj = NULL;
+    json_object_object_get_ex(segObj, "onError", &valObj);
+    onError = (valObj != NULL && json_object_get_boolean(valObj));
+
+    // Fields are separated up to their id, MSH ids count the separator as field 1
+    lastFid = (strcmp(segStr, "MSH") == 0) ? 1 : 0;
+    json_object_object_get_ex(segObj, "fields", &fieldsObj);
+    fieldCount = (fieldsObj == NULL) ? 0 : json_object_array_length(fieldsObj);
+
+    for (f = 0; f < fieldCount; f++) {
+      fieldObj = json_object_array_get_idx(fieldsObj, f);
+      json_object_object_get_ex(fieldObj, "id", &valObj);
+      fid = json_object_get_int(valObj);
+      json_object_object_get_ex(fieldObj, "value", &valObj);
+      vStr = (char *) json_object_get_string(valObj);
+
+      while (lastFid < fid && segL < (int) sizeof(segStr) - 1) {
+        segStr[segL++] = '|';
+        lastFid++;
+      }
+      if (vStr != NULL && fid == lastFid)
+        segL += snprintf(segStr + segL, sizeof(segStr) - segL, "%s", vStr);
+      if (segL >= (int) sizeof(segStr) - 2) break;
+    }
+
+    if (segL >= (int) sizeof(segStr) - 2) {
+      handleError(LOG_ERR, "ACK template segment is too large", -1, 0, 1);
+      rv = -1;
+      break;
+    }
+    segStr[segL++] = '\r';
+    segStr[segL] = '\0';
+    rv = compileText(segStr, onError);
+  }
+
+  json_object_put(rootObj);
+  return(rv);
+}
+
+
+// Compile the ACK template tName from the templates directory, or the built in template
+// if tName is empty, ret 0 or -1 on error
+int setACKTemplate(char *tName) {
+  FILE *tFP = NULL;
+  char tFile[256] = "", errStr[300] = "", *jsonMsg = NULL;
+  int fSize = 0, rv = 0, s = 0;
+
+  ackPartCount = 0;
+  ackTextL = 0;
+
+  if (tName == NULL || strlen(tName) == 0) {
+    for (s = 0; s < 3 && rv == 0; s++) rv = compileText(defACK[s], s == 2);
+    return(rv);
+  }
+
+  tFP = findTemplate(tFile, tName, 0);
+  fSize = getFileSize(tFile);
+  jsonMsg = malloc(fSize + 1);
+  if (jsonMsg == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for the ACK template", -1, 0, 1);
+    fclose(tFP);
+    return(-1);
+  }
+  readJSONFile(tFP, fSize, jsonMsg);
+  jsonMsg[fSize] = '\0';
+  fclose(tFP);
+
+  rv = compileJSON(jsonMsg);
+  free(jsonMsg);
+
+  if (rv != 0) {
+    sprintf(errStr, "Failed to compile ACK template: %.200s", tName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    ackPartCount = 0;
+    return(-1);
+  }
+
+  sprintf(errStr, "Using ACK template: %.200s", tName);
+  writeLog(LOG_INFO, errStr, 1);
+  return(0);
+}
+
+
+// Compile the ACK template from the config file, or the built in template, unless one
+// has already been set, ret 0 or -1 on error
+int initACK() {
+  if (ackPartCount > 0) return(0);
+  if (globalConfig) return(setACKTemplate(globalConfig->ackTemplate));
+  return(setACKTemplate(NULL));
+}
+
+
+// Get the current time for ACKs, only formatted when the second changes
+char *ackTime() {
+  time_t now = time(NULL);
+
+  if (now != nowSec) {
+    timeNow(nowStr, 0);
+    nowSec = now;
+  }
+  return(nowStr);
+}
+
+
+// Find the start of each field in a message's MSH segment, ret the number found
+static int mshFields(char *hl7Msg, char *fields[ACK_FIELDS + 1]) {
+  char *pos = hl7Msg, sep = '|';
+  int f = 2;
+
+  if (strncmp(hl7Msg, "MSH", 3) != 0) pos = strstr(hl7Msg, "MSH");
+  if (pos == NULL || pos[3] == '\0') return(0);
+
+  // MSH-1 is the field separator, MSH-2 starts after it
+  sep = pos[3];
+  fields[1] = pos + 3;
+  fields[2] = pos + 4;
+  for (pos = pos + 4; *pos != '\0' && *pos != '\r' && *pos != '\n'; pos++) {
+    if (*pos == sep) {
+      if (f == ACK_FIELDS - 1) break;
+      fields[++f] = pos + 1;
+    }
+  }
+
+  // The end of the last field, each field ends one before the start of the next
+  fields[f + 1] = pos + 1;
+  return(f);
+}
+
+
+// Copy field (or component) f from the MSH fields, ret the number of chars copied or -1
+// if it doesn't fit in bufS
+static int copyField(char *fields[ACK_FIELDS + 1], int fCount, int f, int comp, char *buf,
+                     int bufS) {
+
+  char *start = NULL, *end = NULL;
+  int c = 1, len = 0;
+
+  if (f > fCount) return(0);
+  start = fields[f];
+  end = fields[f + 1] - 1;
+
+  // Components are separated by the first encoding character
+  if (comp > 0) {
+    for (end = start; end < fields[f + 1] - 1; end++) {
+      if (*end == fields[2][0]) {
+        if (c == comp) break;
+        c++;
+        start = end + 1;
+      }
+    }
+    if (c < comp) return(0);
+  }
+
+  len = end - start;
+  if (len >= bufS) return(-1);
+  memcpy(buf, start, len);
+  return(len);
+}
+
+
+// Build the ACK for a message with the ACK code resCode in to buf, and copy the message's
+// control ID to cid (201 chars). Ret the ACK's length or -1 if it doesn't fit in bufS
+int ackBuild(char *hl7Msg, char *resCode, char *cid, char *buf, int bufS) {
+  char *fields[ACK_FIELDS + 1], *txt = "OK";
+  int fCount = mshFields(hl7Msg, fields), isErr = (resCode[1] != 'A');
+  int p = 0, bufL = 0, len = 0, cidL = 0;
+  struct ACKPart *part = NULL;
+
+  if (ackPartCount == 0 && initACK() != 0) return(-1);
+
+  cidL = copyField(fields, fCount, 10, 0, cid, 201);
+  if (cidL < 0) cidL = 0;
+  cid[cidL] = '\0';
+
+  if (resCode[1] == 'E') txt = "Error";
+  if (resCode[1] == 'R') txt = "Rejected";
+
+  for (p = 0; p < ackPartCount; p++) {
+    part = &ackParts[p];
+    if (part->onError == 1 && isErr == 0) continue;
+
+    len = 0;
+    switch (part->type) {
+      case ACK_TEXT:
+        len = part->len;
+        if (bufL + len < bufS) memcpy(buf + bufL, ackText + part->off, len);
+        break;
+
+      case ACK_NOW:
+        len = 14;
+        if (bufL + len < bufS) memcpy(buf + bufL, ackTime(), len);
+        break;
+
+      case ACK_CID:
+        len = cidL;
+        if (bufL + len < bufS) memcpy(buf + bufL, cid, len);
+        break;
+
+      case ACK_CODE:
+        len = 2;
+        if (bufL + len < bufS) memcpy(buf + bufL, resCode, len);
+        break;
+
+      case ACK_CTXT:
+        len = strlen(txt);
+        if (bufL + len < bufS) memcpy(buf + bufL, txt, len);
+        break;
+
+      case ACK_FIELD:
+        len = copyField(fields, fCount, part->field, part->comp, buf + bufL, bufS - bufL);
+        break;
+    }
+
+    if (len < 0 || bufL + len >= bufS) return(-1);
+    bufL += len;
+  }
+
+  buf[bufL] = '\0';
+  return(bufL);
+}
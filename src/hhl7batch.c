@@ -0,0 +1,243 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include "hhl7batch.h"
+#include "hhl7utils.h"
+
+// HL7 batches wrap many messages in one frame:
+//   FHS (file header), BHS (batch header), MSH ... MSH ..., BTS (batch trailer), FTS (file trailer)
+// FHS-11/BHS-11 are the file/batch control IDs, an ACK refers to them in FHS-12/BHS-12
+
+// Number of messages to send in each batch, 0 if not batching (--batch)
+static int bSize = 0;
+
+// Batch being built by this thread and the server it's for
+struct BatchBuf {
+  char *buf;
+  long int len;
+  long int size;
+  int count;
+  char sIP[256];
+  char sPort[6];
+};
+
+static __thread struct BatchBuf batch;
+
+
+// Set the number of messages sent in each batch
+void setBatchSize(int size) {
+  if (size > 1) bSize = size;
+}
+
+
+// Get the number of messages sent in each batch, 0 if not batching
+int batchSize() {
+  return(bSize);
+}
+
+
+// Check if a message is a batch (ret 1 if it starts with FHS or BHS)
+int isBatch(char *hl7Msg) {
+  return(strncmp(hl7Msg, "FHS|", 4) == 0 || strncmp(hl7Msg, "BHS|", 4) == 0);
+}
+
+
+// Check if a message for sIP:sPort can be added to this threads batch (ret 1 if it can)
+int batchMatch(char *sIP, char *sPort) {
+  if (batch.count == 0) return(1);
+  return(strcmp(batch.sIP, sIP) == 0 && strcmp(batch.sPort, sPort) == 0);
+}
+
+
+// Create a unique file (F) or batch (B) control ID, up to 16 chars
+void batchID(char *id, char prefix) {
+  static long int idCount = 0;
+
+  sprintf(id, "%c%ld%05ld", prefix, (long) time(NULL),
+          __atomic_add_fetch(&idCount, 1, __ATOMIC_RELAXED) % 100000);
+}
+
+
+// Add a message to this threads batch, starting a new batch if it's empty, ret the
+// number of messages in the batch or -1 on error
+int batchAdd(char *sIP, char *sPort, char *hl7Msg) {
+  char dt[26] = "", fid[17] = "", bid[17] = "", *newBuf = NULL;
+  long int msgL = strlen(hl7Msg);
+
+  // Grow the buffer to fit the message and the trailers
+  if (batch.len + msgL + 256 > batch.size) {
+    newBuf = realloc(batch.buf, (batch.len + msgL + 256) * 2);
+    if (newBuf == NULL) {
+      handleError(LOG_ERR, "Could not allocate memory for a message batch", -1, 0, 1);
+      return(-1);
+    }
+    batch.buf = newBuf;
+    batch.size = (batch.len + msgL + 256) * 2;
+  }
+
+  if (batch.count == 0) {
+    snprintf(batch.sIP, sizeof(batch.sIP), "%s", sIP);
+    snprintf(batch.sPort, sizeof(batch.sPort), "%s", sPort);
+    timeNow(dt, 0);
+    batchID(fid, 'F');
+    batchID(bid, 'B');
+    batch.len = sprintf(batch.buf, "FHS|^~\\&|HHL7||||%s||||%s\rBHS|^~\\&|HHL7||||%s||||%s\r",
+                        dt, fid, dt, bid);
+  }
+
+  memcpy(batch.buf + batch.len, hl7Msg, msgL);
+  batch.len = batch.len + msgL;
+  if (msgL > 0 && hl7Msg[msgL - 1] != '\r') batch.buf[batch.len++] = '\r';
+  batch.buf[batch.len] = '\0';
+
+  batch.count++;
+  return(batch.count);
+}
+
+
+// Close this threads batch with it's trailers, ret the batch (valid until the next
+// batchAdd()) and the server it's for, or NULL if there's no batch waiting
+char *batchTake(char **sIP, char **sPort, int *msgCount) {
+  if (batch.count == 0) return(NULL);
+
+  batch.len += sprintf(batch.buf + batch.len, "BTS|%d\rFTS|1\r", batch.count);
+  *sIP = batch.sIP;
+  *sPort = batch.sPort;
+  *msgCount = batch.count;
+
+  batch.count = 0;
+  batch.len = 0;
+  return(batch.buf);
+}
+
+
+// Find a segment at the start of a line in buf, ret a pointer to it or NULL
+static char *findSeg(char *buf, long int bufL, char *seg) {
+  char *pos = buf, *end = buf + bufL;
+
+  while ((pos = memmem(pos, end - pos, seg, 4)) != NULL) {
+    if (pos == buf || pos[-1] == '\r' || pos[-1] == '\n') return(pos);
+    pos++;
+  }
+  return(NULL);
+}
+
+
+// Copy a field from the segment at seg, for header segments (MSH, FHS, BHS) the
+// field separator is field 1
+static void segField(char *seg, char *end, int field, char *res, int resS) {
+  int f = 0, r = 0, isHdr = 0;
+  char *pos = NULL;
+
+  isHdr = (strncmp(seg, "MSH|", 4) == 0 || strncmp(seg, "FHS|", 4) == 0 ||
+           strncmp(seg, "BHS|", 4) == 0);
+  if (isHdr == 1) field--;
+
+  res[0] = '\0';
+  for (pos = seg + 3; pos < end && *pos != '\r' && *pos != '\n' && *pos != 28; pos++) {
+    if (*pos == '|') {
+      f++;
+    } else if (f == field && r < resS - 1) {
+      res[r++] = *pos;
+      res[r] = '\0';
+    } else if (f > field) {
+      break;
+    }
+  }
+}
+
+
+// Copy a field from the first seg segment in a batch (or message), res is empty if
+// the segment or field is not found
+void batchField(char *batch, char *seg, int field, char *res, int resS) {
+  long int batchL = strlen(batch);
+  char *segPos = findSeg(batch, batchL, seg);
+
+  res[0] = '\0';
+  if (segPos != NULL) segField(segPos, batch + batchL, field, res, resS);
+}
+
+
+// Find the next message in a batch from pos, ret a pointer to it's MSH segment and
+// set msgEnd to the end of it's last segment, or NULL if there are no more messages
+char *batchNext(char *pos, char **msgEnd) {
+  char *msg = pos, *end = NULL;
+
+  // Only scan as far as the next message, the batch may be large
+  while ((msg = strstr(msg, "MSH|")) != NULL) {
+    if (msg == pos || msg[-1] == '\r' || msg[-1] == '\n') break;
+    msg++;
+  }
+  if (msg == NULL) return(NULL);
+
+  // The message ends at the next header or trailer segment
+  for (end = msg + 4; *end != '\0'; end++) {
+    if ((*end == '\r' || *end == '\n') &&
+        (strncmp(end + 1, "MSH|", 4) == 0 || strncmp(end + 1, "BTS|", 4) == 0 ||
+         strncmp(end + 1, "FTS|", 4) == 0 || strncmp(end + 1, "BHS|", 4) == 0)) {
+      end++;
+      break;
+    }
+  }
+  *msgEnd = end;
+  return(msg);
+}
+
+
+// Count the messages in a batch and copy it's control ID (BHS-11) to cid
+int batchCount(char *batch, char *cid) {
+  char *pos = batch, *msgEnd = NULL;
+  int count = 0;
+
+  batchField(batch, "BHS|", 11, cid, 201);
+  if (cid[0] == '\0') batchField(batch, "FHS|", 11, cid, 201);
+
+  while ((pos = batchNext(pos, &msgEnd)) != NULL) {
+    count++;
+    pos = msgEnd;
+  }
+  return(count);
+}
+
+
+// Get the results from a batch ACK (a batch of ACK messages for any that weren't
+// accepted), ret 0 if ack isn't a batch. cid is the acknowledged batch (BHS-12),
+// aCode is AA or the first rejected messages code
+int batchACKFields(char *ack, int ackL, char *aCode, char *cid, int *rejected) {
+  char *end = ack + ackL, *seg = NULL, code[3] = "";
+
+  aCode[0] = '\0';
+  cid[0] = '\0';
+  *rejected = 0;
+
+  seg = findSeg(ack, ackL, "BHS|");
+  if (seg == NULL) return(0);
+  segField(seg, end, 12, cid, 201);
+
+  // Any MSA that isn't an accept (AA or CA) is a rejected message
+  while ((seg = findSeg(seg + 4, end - seg - 4, "MSA|")) != NULL) {
+    segField(seg, end, 1, code, 3);
+    if (code[1] != 'A') {
+      (*rejected)++;
+      if (aCode[0] == '\0') sprintf(aCode, "%s", code);
+    }
+  }
+  if (aCode[0] == '\0') sprintf(aCode, "%s", "AA");
+  return(1);
+}
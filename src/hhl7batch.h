@@ -0,0 +1,24 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Function Prototypes
+void setBatchSize(int size);
+int batchSize();
+int isBatch(char *hl7Msg);
+int batchMatch(char *sIP, char *sPort);
+int batchAdd(char *sIP, char *sPort, char *hl7Msg);
+char *batchTake(char **sIP, char **sPort, int *msgCount);
+char *batchNext(char *pos, char **msgEnd);
+void batchField(char *batch, char *seg, int field, char *res, int resS);
+int batchCount(char *batch, char *cid);
+int batchACKFields(char *ack, int ackL, char *aCode, char *cid, int *rejected);
+void batchID(char *id, char prefix);
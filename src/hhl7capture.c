@@ -0,0 +1,298 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>. 
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hhl7capture.h"
+#include "hhl7journal.h"
+#include "hhl7net.h"
+#include "hhl7stats.h"
+#include "hhl7utils.h"
+
+// Capture files hold one record per received message:
+//   #HHL7 <receive time, epoch secs.nsecs> <message length>\n<message>\n
+// The message is stored exactly as received (less the MLLP wrapper), so may contain \r
+
+// Records are buffered and written out once CAP_FLUSHSIZE bytes are waiting, once the
+// oldest has waited CAP_FLUSHMS (checked by the listener at least once a second) and
+// when the file is closed
+#define CAP_FLUSHSIZE 1048576
+#define CAP_FLUSHMS   1000
+
+// Capture file the listener is writing to, NULL if not capturing. Once a write fails
+// capFailed is set and nothing more is written, the file is only closed at shutdown
+// as other listener workers may be waiting to write to it
+static FILE *capFP = NULL;
+static int capFailed = 0;
+static pthread_mutex_t capLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Bytes buffered since the last flush, and when the first of them was written
+static long int capPending = 0;
+static struct timespec capSince;
+
+
+// Open (append to) a capture file for received messages
+int openCapture(char *fileName) {
+  char errStr[300] = "";
+
+  capFP = fopen(fileName, "a");
+  if (capFP == NULL) {
+    sprintf(errStr, "Cannot open capture file: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(-1);
+  }
+  setvbuf(capFP, NULL, _IOFBF, CAP_FLUSHSIZE);
+
+  sprintf(errStr, "Capturing received messages to: %s", fileName);
+  writeLog(LOG_INFO, errStr, 1);
+  return(0);
+}
+
+
+// Write out the buffered records, stopping capture if it fails (capLock held)
+static void flushCapture() {
+  if (capPending == 0 || capFailed == 1) return;
+
+  capPending = 0;
+  if (fflush(capFP) != 0) {
+    capFailed = 1;
+    handleError(LOG_ERR, "Failed to write to capture file, capture stopped", -1, 0, 1);
+  }
+}
+
+
+// Get the ms since the first buffered record was written
+static long int capAge() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return((now.tv_sec - capSince.tv_sec) * 1000 + (now.tv_nsec - capSince.tv_nsec) / 1000000);
+}
+
+
+// Write a received message and it's receive time to the capture file
+void writeCapture(char *msg, long int msgL, struct timespec *recvT) {
+  struct timespec now;
+  int hdrL = 0;
+
+  if (capFP == NULL) return;
+
+  if (recvT == NULL) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    recvT = &now;
+  }
+
+  // Listener workers share the file, keep each record together
+  pthread_mutex_lock(&capLock);
+  if (capFP == NULL || capFailed == 1) {
+    pthread_mutex_unlock(&capLock);
+    return;
+  }
+
+  hdrL = fprintf(capFP, "#HHL7 %ld.%09ld %ld\n", (long) recvT->tv_sec, recvT->tv_nsec, msgL);
+  if (hdrL < 0 ||
+      (long int) fwrite(msg, 1, msgL, capFP) != msgL || fputc('\n', capFP) == EOF) {
+
+    capFailed = 1;
+    pthread_mutex_unlock(&capLock);
+    handleError(LOG_ERR, "Failed to write to capture file, capture stopped", -1, 0, 1);
+    return;
+  }
+
+  if (capPending == 0) clock_gettime(CLOCK_MONOTONIC, &capSince);
+  capPending = capPending + hdrL + msgL + 1;
+  if (capPending >= CAP_FLUSHSIZE || capAge() >= CAP_FLUSHMS) flushCapture();
+  pthread_mutex_unlock(&capLock);
+}
+
+
+// Write out the buffered records if the oldest has waited CAP_FLUSHMS, so a quiet
+// listener's capture doesn't lag behind
+void syncCapture() {
+  if (capFP == NULL) return;
+
+  pthread_mutex_lock(&capLock);
+  if (capFP != NULL && capPending > 0 && capAge() >= CAP_FLUSHMS) flushCapture();
+  pthread_mutex_unlock(&capLock);
+}
+
+
+// Write out any buffered records and close the capture file
+void closeCapture() {
+  pthread_mutex_lock(&capLock);
+  if (capFP != NULL) {
+    flushCapture();
+    fclose(capFP);
+    capFP = NULL;
+  }
+  pthread_mutex_unlock(&capLock);
+}
+
+
+// Read the next capture record header at pos, ret a pointer to the message or NULL
+static char *readCapRecord(char *pos, char *end, double *recvT, long int *msgL) {
+  char hdr[64] = "", *eol = NULL;
+  long int sec = 0, nsec = 0;
+
+  if (end - pos < 7 || strncmp(pos, "#HHL7 ", 6) != 0) return(NULL);
+
+  eol = memchr(pos, '\n', end - pos < 63 ? end - pos : 63);
+  if (eol == NULL) return(NULL);
+
+  memcpy(hdr, pos, eol - pos);
+  hdr[eol - pos] = '\0';
+  if (sscanf(hdr, "#HHL7 %ld.%ld %ld", &sec, &nsec, msgL) != 3) return(NULL);
+  if (*msgL < 0 || *msgL > end - eol - 1) return(NULL);
+
+  *recvT = sec + nsec / 1000000000.0;
+  return(eol + 1);
+}
+
+
+// Sleep until dueT seconds after start, record and warn (once a second) if we're late
+static void waitReplay(struct timespec *start, double dueT, long int msgCount, int pACK,
+                       time_t *lastWarn) {
+  struct timespec due, now;
+  double lag = 0;
+  char errStr[80] = "";
+
+  due.tv_sec = start->tv_sec + (time_t) dueT;
+  due.tv_nsec = start->tv_nsec + (long) ((dueT - (time_t) dueT) * 1000000000);
+  if (due.tv_nsec >= 1000000000) {
+    due.tv_sec++;
+    due.tv_nsec = due.tv_nsec - 1000000000;
+  }
+
+  waitACKsUntil(&due, pACK);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lag = (now.tv_sec - due.tv_sec) * 1000.0 + (now.tv_nsec - due.tv_nsec) / 1000000.0;
+  statsLag(lag);
+
+  if (lag > 1 && now.tv_sec != *lastWarn) {
+    *lastWarn = now.tv_sec;
+    sprintf(errStr, "Falling behind capture, message %ld is %.3f ms late", msgCount, lag);
+    writeLog(LOG_WARNING, errStr, 1);
+  }
+}
+
+
+// Re-send the messages in a capture file, or a receive journal segment, with their
+// original gaps divided by speed, speed 0 sends as fast as possible, ret the number
+// of messages sent
+long int replayCapture(char *sIP, char *sPort, char *fileName, double speed,
+                       int aTimeout, int pACK) {
+
+  struct timespec start;
+  struct stat st;
+  char *capData = NULL, *pos = NULL, *end = NULL, *msg = NULL, *msgBuf = NULL;
+  char *next = NULL;
+  char resStr[3] = "", errStr[300] = "";
+  long int msgL = 0, msgBufS = 0, msgCount = 0, dropped = 0, doneL = 0;
+  long int pageS = sysconf(_SC_PAGESIZE);
+  double recvT = 0, firstT = -1;
+  time_t lastProg = time(NULL), lastWarn = 0;
+  int capFD = -1, isJournal = 0;
+
+  capFD = open(fileName, O_RDONLY);
+  if (capFD == -1 || fstat(capFD, &st) == -1 || st.st_size == 0) {
+    sprintf(errStr, "Cannot open capture file or it is empty: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    if (capFD != -1) close(capFD);
+    return(0);
+  }
+
+  capData = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, capFD, 0);
+  close(capFD);
+  if (capData == MAP_FAILED) {
+    handleError(LOG_ERR, "Could not map capture file to replay", -1, 0, 1);
+    return(0);
+  }
+  madvise(capData, st.st_size, MADV_SEQUENTIAL);
+
+  pos = capData;
+  end = capData + st.st_size;
+  if ((next = recvJournalStart(capData, st.st_size)) != NULL) {
+    isJournal = 1;
+    pos = next;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (pos < end && stopRequested() == 0) {
+    if (isJournal == 1) {
+      // A journal ends at the first record without it's magic, e.g: one still being written
+      msg = recvJournalNext(pos, end, &recvT, &msgL, &next);
+      if (msg == NULL) break;
+      pos = next;
+
+    } else {
+      msg = readCapRecord(pos, end, &recvT, &msgL);
+      if (msg == NULL) {
+        sprintf(errStr, "Invalid capture record at offset %ld, stopping replay",
+                (long) (pos - capData));
+        handleError(LOG_WARNING, errStr, -1, 0, 1);
+        break;
+      }
+      pos = msg + msgL + 1;
+    }
+
+    // Grow the message buffer to fit the largest message seen so far
+    if (msgL + 1 > msgBufS) {
+      msgBufS = msgL + 1;
+      free(msgBuf);
+      msgBuf = malloc(msgBufS);
+      if (msgBuf == NULL) {
+        handleError(LOG_ERR, "Could not allocate memory for a captured message", -1, 0, 1);
+        break;
+      }
+    }
+    memcpy(msgBuf, msg, msgL);
+    msgBuf[msgL] = '\0';
+
+    // Keep the gap since the first captured message, scaled by speed
+    if (firstT < 0) firstT = recvT;
+    msgCount++;
+    if (speed > 0) waitReplay(&start, (recvT - firstT) / speed, msgCount, pACK, &lastWarn);
+
+    sendPacket(sIP, sPort, msgBuf, resStr, msgCount, 0, 0, aTimeout, pACK);
+
+    // Release pages that have been sent, a page at a time in 16MB steps
+    doneL = ((pos - capData) / pageS) * pageS;
+    if (doneL - dropped >= 16777216) {
+      madvise(capData + dropped, doneL - dropped, MADV_DONTNEED);
+      dropped = doneL;
+    }
+
+    // Report progress once a second
+    if (time(NULL) != lastProg) {
+      lastProg = time(NULL);
+      sprintf(errStr, "Replayed %ld messages, %.1f s of capture, %.1f of %.1f MB (%.0f%%)",
+              msgCount, recvT - firstT, (pos - capData) / 1048576.0,
+              st.st_size / 1048576.0, 100.0 * (pos - capData) / st.st_size);
+      writeLog(LOG_NOTICE, errStr, 1);
+    }
+  }
+
+  free(msgBuf);
+  munmap(capData, st.st_size);
+  return(msgCount);
+}
@@ -0,0 +1,355 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hhl7corpus.h"
+#include "hhl7json.h"
+#include "hhl7net.h"
+#include "hhl7stats.h"
+#include "hhl7utils.h"
+
+// Corpus files hold messages pre-generated from a template so they can be sent
+// without the cost of building them, a 16 byte header followed by one record per message:
+//   "HHL7CRP1" <message count, uint64>
+//   <message length, uint32> <message> \0
+// The \0 lets messages be sent straight from the mapped file
+
+#define CORPUS_MAGIC "HHL7CRP1"
+#define CORPUS_HDRS  16
+
+// Size of each generator thread's write buffer
+#define CORPUS_BUFS  1048576
+
+// Shared state for generating a corpus between worker threads
+struct GenJob {
+  char *jsonMsg;
+  int optind;
+  int argc;
+  char **argv;
+  int sCount;
+  int nextGen;
+  unsigned int seed;
+  FILE *fp;
+  pthread_mutex_t lock;
+  long int msgCount;
+  int failed;
+};
+
+// Shared state for sending a corpus between worker threads
+struct BlastJob {
+  char *sIP;
+  char *sPort;
+  int aTimeout;
+  int pACK;
+  char *data;
+  char **slices;
+  int workers;
+  int nextWorker;
+  long int msgCount;
+  long int sent;
+};
+
+
+// Write a generator thread's buffered records to the corpus file
+static void flushGenBuf(struct GenJob *job, char *outBuf, long int *outL, long int *outCount) {
+  pthread_mutex_lock(&job->lock);
+  if ((long int) fwrite(outBuf, 1, *outL, job->fp) != *outL) {
+    if (__atomic_exchange_n(&job->failed, 1, __ATOMIC_RELAXED) == 0)
+      handleError(LOG_ERR, "Failed to write to corpus file", -1, 0, 1);
+  }
+  job->msgCount += *outCount;
+  pthread_mutex_unlock(&job->lock);
+
+  *outL = 0;
+  *outCount = 0;
+}
+
+
+// Generator worker thread, builds messages until the shared count is reached
+static void *genWorker(void *arg) {
+  struct GenJob *job = arg;
+  char *hl7Msg = NULL, *outBuf = NULL, *cur = NULL, *next = NULL;
+  int hl7MsgS = 1024;
+  long int outBufS = CORPUS_BUFS, outL = 0, outCount = 0, msgL = 0;
+  uint32_t recL = 0;
+
+  seedRand(__atomic_add_fetch(&job->seed, 7919, __ATOMIC_RELAXED));
+
+  hl7Msg = calloc(1, hl7MsgS + 1);
+  outBuf = malloc(outBufS);
+  if (hl7Msg == NULL || outBuf == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory to generate corpus messages", -1, 0, 1);
+    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+  }
+
+  // Another worker may fail, so it's checked atomically before each message
+  while (__atomic_load_n(&job->failed, __ATOMIC_RELAXED) == 0 && stopRequested() == 0 &&
+         __atomic_fetch_add(&job->nextGen, 1, __ATOMIC_RELAXED) < job->sCount) {
+
+    hl7Msg[0] = '\0';
+    if (parseJSONTemp(job->jsonMsg, &hl7Msg, &hl7MsgS, NULL, NULL,
+                      job->argc - job->optind, job->argv + job->optind, 0) > 0) {
+      __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+      break;
+    }
+
+    // Store each message in the template as it's own record, as splitPacket() sends them
+    for (cur = hl7Msg; cur != NULL && *cur != '\0'; cur = next) {
+      next = strstr(cur + 1, "MSH|^");
+      msgL = (next == NULL) ? (long int) strlen(cur) : next - cur;
+
+      if (outL + msgL + 5 > outBufS) {
+        flushGenBuf(job, outBuf, &outL, &outCount);
+
+        // Grow the buffer for messages larger than it
+        if (msgL + 5 > outBufS) {
+          outBufS = msgL + 5;
+          free(outBuf);
+          outBuf = malloc(outBufS);
+          if (outBuf == NULL) {
+            handleError(LOG_ERR, "Could not allocate memory to generate corpus messages", -1, 0, 1);
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+          }
+        }
+      }
+
+      recL = msgL;
+      memcpy(outBuf + outL, &recL, 4);
+      memcpy(outBuf + outL + 4, cur, msgL);
+      outBuf[outL + 4 + msgL] = '\0';
+      outL += msgL + 5;
+      outCount++;
+    }
+  }
+
+  if (outBuf != NULL && outL > 0) flushGenBuf(job, outBuf, &outL, &outCount);
+  free(outBuf);
+  free(hl7Msg);
+  return(NULL);
+}
+
+
+// Generate sCount copies of a template to a corpus file, shared between worker
+// threads, ret the number of messages written or -1 on error
+long int writeCorpus(char *fileName, char *tName, int optind, int argc, char *argv[],
+                     int sCount, int workers) {
+
+  struct GenJob job = { NULL, optind, argc, argv, sCount, 0, (unsigned int) time(NULL),
+                        NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0 };
+  FILE *tFP = NULL;
+  pthread_t threads[workers];
+  uint64_t count = 0;
+  char tFile[256] = "", errStr[320] = "";
+  int w = 0, started = 0, fSize = 0;
+
+  // Read the template once, every generator parses the same JSON
+  tFP = findTemplate(tFile, tName, 0);
+  fSize = getFileSize(tFile);
+  job.jsonMsg = malloc(fSize + 1);
+  if (job.jsonMsg == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for the JSON template", -1, 0, 1);
+    fclose(tFP);
+    return(-1);
+  }
+  readJSONFile(tFP, fSize, job.jsonMsg);
+  fclose(tFP);
+
+  job.fp = fopen(fileName, "w");
+  if (job.fp == NULL) {
+    sprintf(errStr, "Cannot open corpus file: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    free(job.jsonMsg);
+    return(-1);
+  }
+
+  // Write the header, the message count is filled in once they've all been generated
+  fwrite(CORPUS_MAGIC, 1, 8, job.fp);
+  fwrite(&count, 1, 8, job.fp);
+
+  for (w = 0; w < workers; w++) {
+    if (pthread_create(&threads[w], NULL, genWorker, &job) != 0) {
+      sprintf(errStr, "Failed to start corpus generator %d", w + 1);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      break;
+    }
+    started++;
+  }
+
+  // Fall back to generating from this thread if no workers could be started
+  if (started == 0) genWorker(&job);
+
+  for (w = 0; w < started; w++) pthread_join(threads[w], NULL);
+
+  count = job.msgCount;
+  if (fseek(job.fp, 8, SEEK_SET) != 0 || fwrite(&count, 1, 8, job.fp) != 8) job.failed = 1;
+  if (fclose(job.fp) != 0) job.failed = 1;
+  free(job.jsonMsg);
+
+  if (job.failed == 1) {
+    sprintf(errStr, "Failed to generate corpus file: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(-1);
+  }
+
+  sprintf(errStr, "Generated %ld messages from template %s in corpus file: %s",
+          job.msgCount, tName, fileName);
+  writeLog(LOG_NOTICE, errStr, 1);
+  return(job.msgCount);
+}
+
+
+// Blast worker thread, sends the messages in it's slice of the corpus over it's own
+// pooled connection, messages are sent straight from the mapped file
+static void *blastWorker(void *arg) {
+  struct BlastJob *job = arg;
+  int w = __atomic_fetch_add(&job->nextWorker, 1, __ATOMIC_RELAXED);
+  char *pos = job->slices[w], *end = job->slices[w + 1], *msg = NULL;
+  char resStr[3] = "", errStr[100] = "";
+  long int sent = 0;
+  uint32_t msgL = 0;
+  time_t lastProg = time(NULL);
+
+  // The records were checked when the corpus was split
+  while (stopRequested() == 0 && pos < end) {
+    memcpy(&msgL, pos, 4);
+    msg = pos + 4;
+    pos = msg + msgL + 1;
+
+    sent = __atomic_add_fetch(&job->sent, 1, __ATOMIC_RELAXED);
+    sendPacket(job->sIP, job->sPort, msg, resStr, sent, 0, 0, job->aTimeout, job->pACK);
+
+    // Report progress once a second
+    if (w == 0 && time(NULL) != lastProg) {
+      lastProg = time(NULL);
+      sprintf(errStr, "Sent %ld of %ld messages (%.0f%%)", sent, job->msgCount,
+              job->msgCount > 0 ? 100.0 * sent / job->msgCount : 0.0);
+      writeLog(LOG_NOTICE, errStr, 1);
+    }
+  }
+
+  // Collect outstanding ACKs, add this workers stats to the totals & close it's pool
+  flushACKs(job->aTimeout, job->pACK);
+  mergeSendStats();
+  closeConnPool();
+  return(NULL);
+}
+
+
+// Check every record in a corpus and split it in to a slice of about the same size for
+// each worker, ret the slice boundaries (workers + 1 of them) or NULL on error. The
+// corpus ends at the first invalid record
+static char **sliceCorpus(char *data, long int dataL, int workers) {
+  char **slices = NULL, *pos = data + CORPUS_HDRS, *end = data + dataL, *msg = NULL;
+  char errStr[100] = "";
+  uint32_t msgL = 0;
+  int w = 1;
+
+  slices = malloc((workers + 1) * sizeof(char *));
+  if (slices == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory to split the corpus", -1, 0, 1);
+    return(NULL);
+  }
+  slices[0] = pos;
+
+  while (end - pos >= 4) {
+    memcpy(&msgL, pos, 4);
+    msg = pos + 4;
+    if ((long int) msgL >= end - msg || msg[msgL] != '\0') {
+      sprintf(errStr, "Invalid corpus record at offset %ld, stopping", (long) (pos - data));
+      handleError(LOG_WARNING, errStr, -1, 0, 1);
+      break;
+    }
+    pos = msg + msgL + 1;
+
+    while (w < workers && pos - data >= CORPUS_HDRS + (dataL - CORPUS_HDRS) * w / workers)
+      slices[w++] = pos;
+  }
+  while (w <= workers) slices[w++] = pos;
+
+  return(slices);
+}
+
+
+// Send every message in a corpus file as fast as the connections allow, shared
+// between worker threads, ret the number of messages sent
+long int blastCorpus(char *sIP, char *sPort, char *fileName, int aTimeout, int pACK,
+                     int workers) {
+
+  struct BlastJob job = { sIP, sPort, aTimeout, pACK, NULL, NULL, workers, 0, 0, 0 };
+  struct stat st;
+  pthread_t threads[workers];
+  uint64_t count = 0;
+  char errStr[300] = "";
+  int crpFD = -1, w = 0, started = 0;
+
+  crpFD = open(fileName, O_RDONLY);
+  if (crpFD == -1 || fstat(crpFD, &st) == -1 || st.st_size < CORPUS_HDRS) {
+    sprintf(errStr, "Cannot open corpus file or it is empty: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    if (crpFD != -1) close(crpFD);
+    return(0);
+  }
+
+  job.data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, crpFD, 0);
+  close(crpFD);
+  if (job.data == MAP_FAILED) {
+    handleError(LOG_ERR, "Could not map corpus file to send", -1, 0, 1);
+    return(0);
+  }
+
+  if (memcmp(job.data, CORPUS_MAGIC, 8) != 0) {
+    sprintf(errStr, "Not a corpus file: %s", fileName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    munmap(job.data, st.st_size);
+    return(0);
+  }
+
+  // Fault the whole corpus in up front so page faults don't slow the sends
+  madvise(job.data, st.st_size, MADV_WILLNEED);
+  memcpy(&count, job.data + 8, 8);
+  job.msgCount = count;
+
+  job.slices = sliceCorpus(job.data, st.st_size, workers);
+  if (job.slices == NULL) {
+    munmap(job.data, st.st_size);
+    return(0);
+  }
+
+  for (w = 0; w < workers; w++) {
+    if (pthread_create(&threads[w], NULL, blastWorker, &job) != 0) {
+      sprintf(errStr, "Failed to start send worker %d", w + 1);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      break;
+    }
+    started++;
+  }
+
+  // Send the share of any workers that couldn't be started from this thread
+  for (w = started; w < workers; w++) blastWorker(&job);
+
+  for (w = 0; w < started; w++) pthread_join(threads[w], NULL);
+
+  free(job.slices);
+  munmap(job.data, st.st_size);
+  return(job.sent);
+}
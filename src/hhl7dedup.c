@@ -0,0 +1,277 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include "hhl7dedup.h"
+#include "hhl7batch.h"
+#include "hhl7stats.h"
+#include "hhl7utils.h"
+
+// Recently received messages are kept in a cuckoo hash table keyed by a 64 bit hash of
+// the listener, sending facility (MSH-4) and control ID (MSH-10). Each key may be in one
+// of two buckets, so a lookup reads at most two buckets. Adding a key to two full
+// buckets moves an entry to it's other bucket, and so on up to DEDUP_KICKS times, then
+// the entry left over is evicted, so memory is bounded and the window only shortens if
+// the table is too small for the rate. Entries older than the window are free to reuse.
+// Each entry also holds a copy of the full key, a hash match is only a duplicate if the
+// keys are the same, so two messages whose hashes collide are never mistaken for one.
+#define DEDUP_SHARDS 16
+#define DEDUP_SLOTS  4
+#define DEDUP_KICKS  64
+
+// Mode, window (seconds) and table size (entries, rounded up to a power of 2)
+static int dMode = DEDUP_OFF;
+static int dWindow = 300;
+static long int dSize = 1048576;
+
+static struct DedupShard *shards = NULL;
+
+// Entries are timed in seconds since the table was opened on the monotonic clock, so
+// the window isn't moved by the wall clock being stepped
+static time_t dStart = 0;
+
+
+// Set what's done with duplicates (count, flag or ack), the window they're detected in
+// and the table size. Values of -1 or NULL keep the current setting
+void setDedup(char *mode, int window, long int size) {
+  if (mode != NULL && strcmp(mode, "off") == 0) dMode = DEDUP_OFF;
+  if (mode != NULL && strcmp(mode, "count") == 0) dMode = DEDUP_COUNT;
+  if (mode != NULL && strcmp(mode, "flag") == 0) dMode = DEDUP_FLAG;
+  if (mode != NULL && strcmp(mode, "ack") == 0) dMode = DEDUP_ACK;
+  if (window > 0) dWindow = window;
+  if (size > 0) dSize = size;
+}
+
+
+// Get what's done with duplicates, DEDUP_OFF if they're not detected
+int dedupMode() {
+  if (shards == NULL) return(DEDUP_OFF);
+  return(dMode);
+}
+
+
+// Get the monotonic clock's seconds
+static time_t dedupClock() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec);
+}
+
+
+// Allocate the table if duplicates are detected, ret 0 or -1 on error
+int openDedup() {
+  unsigned long buckets = 2;
+  int s = 0;
+
+  if (dMode == DEDUP_OFF || shards != NULL) return(0);
+
+  // At least 2 buckets, so each shard's slots are a whole number of cache lines
+  while ((long int) (buckets * DEDUP_SHARDS * DEDUP_SLOTS) < dSize) buckets = buckets * 2;
+
+  shards = aligned_alloc(64, DEDUP_SHARDS * sizeof(struct DedupShard));
+  if (shards != NULL) memset(shards, 0, DEDUP_SHARDS * sizeof(struct DedupShard));
+
+  for (s = 0; shards != NULL && s < DEDUP_SHARDS; s++) {
+    shards[s].slots = aligned_alloc(64, buckets * DEDUP_SLOTS * sizeof(struct DedupSlot));
+    if (shards[s].slots == NULL) break;
+    memset(shards[s].slots, 0, buckets * DEDUP_SLOTS * sizeof(struct DedupSlot));
+    shards[s].mask = buckets - 1;
+    pthread_mutex_init(&shards[s].lock, NULL);
+  }
+
+  if (shards == NULL || s < DEDUP_SHARDS) {
+    handleError(LOG_ERR, "Could not allocate memory for duplicate detection", -1, 0, 1);
+    while (shards != NULL && s > 0) free(shards[--s].slots);
+    free(shards);
+    shards = NULL;
+    return(-1);
+  }
+
+  dStart = dedupClock();
+  return(0);
+}
+
+
+// Mix the bits of a hash so every bit of the result depends on every bit of h
+static uint64_t mixHash(uint64_t h) {
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return(h ^ (h >> 31));
+}
+
+
+// Add len bytes to an FNV-1a hash
+static uint64_t addHash(uint64_t h, char *data, int len) {
+  int i = 0;
+
+  for (i = 0; i < len; i++) h = (h ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+  return(h);
+}
+
+
+// Hash the listener, MSH-4 and MSH-10 of a message and copy MSH-10 to cid. The full
+// key is allocated in to full, ret the hash or 0 if the message has no control ID (or
+// the key couldn't be allocated)
+static uint64_t dedupKey(char *msg, int scope, char *cid, int cidS, char **full,
+                         uint32_t *fullL) {
+  char *pos = msg, *fac = NULL, *ctl = NULL, sep = '|';
+  int f = 2, facL = 0, ctlL = 0;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  if (strncmp(msg, "MSH", 3) != 0) pos = strstr(msg, "MSH");
+  if (pos == NULL || pos[3] == '\0') return(0);
+
+  // MSH-1 is the field separator, MSH-2 starts after it
+  sep = pos[3];
+  for (pos = pos + 4; *pos != '\0' && *pos != '\r' && *pos != '\n'; pos++) {
+    if (*pos == sep) {
+      f++;
+      if (f == 4) fac = pos + 1;
+      if (f == 5) facL = pos - fac;
+      if (f == 10) ctl = pos + 1;
+      if (f == 11) break;
+    }
+  }
+  if (ctl == NULL) return(0);
+  ctlL = pos - ctl;
+  if (ctlL == 0) return(0);
+
+  snprintf(cid, cidS, "%.*s", ctlL, ctl);
+
+  // The key is the listener, MSH-4, the field separator then MSH-10
+  *fullL = sizeof(scope) + facL + 1 + ctlL;
+  *full = malloc(*fullL);
+  if (*full == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for duplicate detection", -1, 0, 1);
+    return(0);
+  }
+  memcpy(*full, &scope, sizeof(scope));
+  memcpy(*full + sizeof(scope), fac, facL);
+  (*full)[sizeof(scope) + facL] = sep;
+  memcpy(*full + sizeof(scope) + facL + 1, ctl, ctlL);
+
+  h = addHash(h, (char *) &scope, sizeof(scope));
+  h = addHash(h, fac, facL);
+  h = addHash(h, &sep, 1);
+  h = addHash(h, ctl, ctlL);
+
+  // 0 marks an empty slot
+  h = mixHash(h);
+  return((h == 0) ? 1 : h);
+}
+
+
+// Get a key's other bucket, from the bucket it's in
+static unsigned long altBucket(struct DedupShard *shard, uint64_t key, unsigned long b) {
+  unsigned long b1 = key & shard->mask, b2 = mixHash(key) & shard->mask;
+
+  return((b == b1) ? b2 : b1);
+}
+
+
+// Check if a slot holds a key, the hash is compared first so the full key is rarely read
+static int sameKey(struct DedupSlot *slot, uint64_t key, char *full, uint32_t fullL) {
+  return(slot->key == key && slot->fullL == fullL && memcmp(slot->full, full, fullL) == 0);
+}
+
+
+// Find a free (empty or expired) slot in a bucket, ret it or NULL if it's full
+static struct DedupSlot *freeSlot(struct DedupShard *shard, unsigned long b, uint32_t now) {
+  struct DedupSlot *slot = &shard->slots[b * DEDUP_SLOTS];
+  int s = 0;
+
+  for (s = 0; s < DEDUP_SLOTS; s++) {
+    if (slot[s].key == 0 || now - slot[s].seen > (uint32_t) dWindow) return(&slot[s]);
+  }
+  return(NULL);
+}
+
+
+// Check if a message was received in the window, and add it to the table. scope keeps
+// listeners apart, cid is set to the message's control ID. Ret 1 if it's a duplicate,
+// 0 if it's not or can't be checked (a batch or no control ID)
+int dedupCheck(char *msg, int scope, char *cid, int cidS) {
+  struct DedupShard *shard = NULL;
+  struct DedupSlot *slot = NULL, tmp, moved;
+  uint64_t key = 0;
+  uint32_t now = 0, fullL = 0;
+  char *full = NULL;
+  unsigned long b1 = 0, b2 = 0, b = 0;
+  int s = 0, k = 0;
+
+  cid[0] = '\0';
+  if (shards == NULL || isBatch(msg) == 1) return(0);
+
+  key = dedupKey(msg, scope, cid, cidS, &full, &fullL);
+  if (key == 0) return(0);
+
+  now = dedupClock() - dStart;
+  shard = &shards[key >> 60];
+  b1 = key & shard->mask;
+  b2 = altBucket(shard, key, b1);
+
+  pthread_mutex_lock(&shard->lock);
+
+  // A duplicate's time is updated, so a sender retrying for longer than the window is
+  // still caught
+  for (s = 0; s < DEDUP_SLOTS * 2; s++) {
+    b = (s < DEDUP_SLOTS) ? b1 : b2;
+    slot = &shard->slots[b * DEDUP_SLOTS + s % DEDUP_SLOTS];
+    if (sameKey(slot, key, full, fullL) == 1 && now - slot->seen <= (uint32_t) dWindow) {
+      slot->seen = now;
+      pthread_mutex_unlock(&shard->lock);
+      free(full);
+      statsDuplicate(0);
+      return(1);
+    }
+  }
+
+  tmp.key = key;
+  tmp.seen = now;
+  tmp.fullL = fullL;
+  tmp.full = full;
+  b = b1;
+  slot = freeSlot(shard, b1, now);
+  if (slot == NULL) slot = freeSlot(shard, b2, now);
+
+  // Both buckets are full, move entries to their other bucket to make space
+  for (k = 0; slot == NULL && k < DEDUP_KICKS; k++) {
+    slot = &shard->slots[b * DEDUP_SLOTS + (shard->kick++ % DEDUP_SLOTS)];
+    moved = *slot;
+    *slot = tmp;
+    tmp = moved;
+    b = altBucket(shard, tmp.key, b);
+    slot = freeSlot(shard, b, now);
+  }
+
+  // An expired entry's key is freed as it's slot is reused
+  if (slot != NULL) {
+    free(slot->full);
+    *slot = tmp;
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  // The entry still being moved is dropped from the table
+  if (slot == NULL) {
+    free(tmp.full);
+    statsDuplicate(1);
+  }
+  return(0);
+}
@@ -0,0 +1,41 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// What's done with a duplicate message (--dedup)
+#define DEDUP_OFF   0
+#define DEDUP_COUNT 1
+#define DEDUP_FLAG  2
+#define DEDUP_ACK   3
+
+// Table entries, 4 to a bucket, seen is seconds since the table opened. key is the hash
+// of the full key, which is kept in full
+struct DedupSlot {
+  uint64_t key;
+  uint32_t seen;
+  uint32_t fullL;
+  char *full;
+};
+
+// The table is split in to shards each with their own lock, chosen by the key's top bits
+struct DedupShard {
+  pthread_mutex_t lock __attribute__((aligned(64)));
+  struct DedupSlot *slots;
+  unsigned long mask;
+  unsigned int kick;
+};
+
+// Function Prototypes
+void setDedup(char *mode, int window, long int size);
+int dedupMode();
+int openDedup();
+int dedupCheck(char *msg, int scope, char *cid, int cidS);
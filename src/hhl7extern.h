@@ -33,7 +33,35 @@ struct globalConfigInfo {
   char lIP[256];
   char lPort[6];
   int ackTimeout;
+  int connTimeout;
+  int writeTimeout;
   int webTimeout;
+  int connIdle;
+  int addrTTL;
+  int addrNegTTL;
+  char ioBackend[6];
+  char ackTemplate[256];
+  int journalSize;
+  int journalAge;
+  int journalSync;
+  long int ingestSize;
+  int ingestWorkers;
+  char ingestPolicy[6];
+  char dedupMode[6];
+  int dedupWindow;
+  long int dedupSize;
+
+  // MLLP over TLS settings
+  char tlsKey[256];
+  char tlsCrt[256];
+  char tlsCA[256];
+  int tlsVerify;
+
+  // Store and forward queue
+  char queueDir[256];
+  int queueSync;
+  int queueRetryMax;
+  char queueNak[6];
 };
 
 extern struct globalConfigInfo *globalConfig;
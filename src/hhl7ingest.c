@@ -0,0 +1,219 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include "hhl7ingest.h"
+#include "hhl7stats.h"
+#include "hhl7utils.h"
+
+// The ingest ring lets a listener ACK a message and move straight on to the next, the
+// processing (capture, responders, printing) is done by other threads taking from it.
+// Each slot's seq says whose turn it is, for the slot at position pos in the ring:
+//   seq == pos             empty, the listener may fill it
+//   seq == pos + 1         filled, a processing thread may take it
+//   seq == pos + size      taken and done with, empty for the next lap
+// Processing threads claim slots by moving head with a compare and swap, only the
+// listener moves tail, so neither side takes a lock unless a processing thread sleeps
+
+// Ring size (0 processes messages in the listener), processing threads and overflow policy
+static long int ringSize = 4096;
+static int ringWorkers = 1;
+static int ringPolicy = INGEST_BLOCK;
+
+
+// Set the ring size (rounded up to a power of 2, 0 disables), processing threads and
+// the policy when it's full, block (wait for space) or drop (discard the message)
+void setIngest(long int size, int workers, char *policy) {
+  if (size >= 0) ringSize = size;
+  if (workers > 0) ringWorkers = workers;
+  if (policy != NULL && strcmp(policy, "drop") == 0) ringPolicy = INGEST_DROP;
+  if (policy != NULL && strcmp(policy, "block") == 0) ringPolicy = INGEST_BLOCK;
+}
+
+
+// Get the ring size, 0 if messages are processed by the listener
+long int ingestSize() {
+  return(ringSize);
+}
+
+
+// Get the number of processing threads for each ring
+int ingestWorkers() {
+  return(ringWorkers);
+}
+
+
+// Create a ring for a listener, ret the ring or NULL on error
+struct IngestRing *ingestCreate() {
+  struct IngestRing *ring = NULL;
+  unsigned long size = 2, s = 0;
+
+  while ((long int) size < ringSize) size = size * 2;
+
+  ring = aligned_alloc(64, sizeof(struct IngestRing));
+  if (ring != NULL) {
+    memset(ring, 0, sizeof(struct IngestRing));
+    ring->slots = calloc(size, sizeof(struct IngestSlot));
+  }
+  if (ring == NULL || ring->slots == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for the ingest ring", -1, 0, 1);
+    free(ring);
+    return(NULL);
+  }
+
+  ring->size = size;
+  ring->mask = size - 1;
+  for (s = 0; s < size; s++) ring->slots[s].seq = s;
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->wake, NULL);
+  return(ring);
+}
+
+
+// Add a message to the ring, only called by the ring's listener. If it's full wait for
+// a processing thread to free a slot, or with the drop policy discard the message.
+// Ret 0 or -1 if the message was dropped
+int ingestPut(struct IngestRing *ring, char *msg, long int msgL) {
+  struct timespec pause = { 0, 20000 };
+  unsigned long pos = ring->tail;
+  struct IngestSlot *slot = &ring->slots[pos & ring->mask];
+  char *newBuf = NULL;
+  long int newS = 0;
+
+  while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos) {
+    if (ringPolicy == INGEST_DROP) {
+      statsIngest(ring->size, 1);
+      return(-1);
+    }
+    nanosleep(&pause, NULL);
+  }
+
+  // Slot buffers only grow, once warmed up filling a slot is just the copy
+  if (msgL + 1 > slot->msgS) {
+    newS = (msgL + 1 < 4096) ? 4096 : (msgL + 1) * 2;
+    newBuf = realloc(slot->msg, newS);
+    if (newBuf == NULL) {
+      handleError(LOG_ERR, "Could not allocate memory for a received message", -1, 0, 1);
+      statsIngest(0, 1);
+      return(-1);
+    }
+    slot->msg = newBuf;
+    slot->msgS = newS;
+  }
+  memcpy(slot->msg, msg, msgL);
+  slot->msg[msgL] = '\0';
+  slot->msgL = msgL;
+  clock_gettime(CLOCK_REALTIME, &slot->recvT);
+  clock_gettime(CLOCK_MONOTONIC, &slot->queued);
+
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  ring->tail = pos + 1;
+  statsIngest(pos + 1 - __atomic_load_n(&ring->head, __ATOMIC_RELAXED), 0);
+
+  // Wake a sleeping processing thread, the fence orders the publish before the check
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ring->sleepers, __ATOMIC_RELAXED) > 0) {
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->wake);
+    pthread_mutex_unlock(&ring->lock);
+  }
+  return(0);
+}
+
+
+// Take the oldest message from the ring, waiting up to waitMs if it's empty. Ret the
+// slot, to be given back with ingestDone() once processed, or NULL if none arrived
+struct IngestSlot *ingestTake(struct IngestRing *ring, int waitMs) {
+  struct IngestSlot *slot = NULL;
+  struct timespec end;
+  unsigned long pos = 0, seq = 0;
+  int slept = 0;
+
+  while (1) {
+    pos = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    slot = &ring->slots[pos & ring->mask];
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+    // Counted as active before it's claimed, so the ring is never seen as idle with
+    // a message between head moving and it being processed
+    if (seq == pos + 1) {
+      __atomic_add_fetch(&ring->active, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_RELAXED)) {
+        slot->pos = pos;
+        statsIngestWait(&slot->queued);
+        return(slot);
+      }
+      __atomic_sub_fetch(&ring->active, 1, __ATOMIC_SEQ_CST);
+      continue;
+    }
+
+    // Another thread took this slot first, try the next
+    if ((long) (seq - (pos + 1)) > 0) continue;
+
+    // Empty, sleep until the listener adds a message
+    if (slept == 1 || waitMs == 0) return(NULL);
+    clock_gettime(CLOCK_REALTIME, &end);
+    end.tv_sec = end.tv_sec + waitMs / 1000;
+    end.tv_nsec = end.tv_nsec + (waitMs % 1000) * 1000000L;
+    if (end.tv_nsec >= 1000000000L) {
+      end.tv_sec++;
+      end.tv_nsec = end.tv_nsec - 1000000000L;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    __atomic_add_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1 &&
+        __atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) == 0)
+      pthread_cond_timedwait(&ring->wake, &ring->lock, &end);
+    __atomic_sub_fetch(&ring->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&ring->lock);
+    slept = 1;
+  }
+}
+
+
+// Give a processed slot back to the listener
+void ingestDone(struct IngestRing *ring, struct IngestSlot *slot) {
+  __atomic_store_n(&slot->seq, slot->pos + ring->size, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&ring->active, 1, __ATOMIC_SEQ_CST);
+}
+
+
+// Get the number of messages waiting in a ring
+long int ingestQueued(struct IngestRing *ring) {
+  return(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+         __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE));
+}
+
+
+// Mark the ring closed once it's listener has stopped, processing threads waiting for a
+// message are woken to finish what's left in it
+void ingestClose(struct IngestRing *ring) {
+  pthread_mutex_lock(&ring->lock);
+  __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+  pthread_cond_broadcast(&ring->wake);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+
+// Ret 1 if the ring's been closed and every message in it has been taken
+int ingestClosed(struct IngestRing *ring) {
+  if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST) == 0) return(0);
+  return(ingestQueued(ring) == 0);
+}
@@ -0,0 +1,52 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Overflow policies when the ingest ring is full
+#define INGEST_BLOCK 0
+#define INGEST_DROP  1
+
+// A received message waiting to be processed, the buffer is kept for the slot's next use
+struct IngestSlot {
+  unsigned long seq;
+  unsigned long pos;
+  char *msg;
+  long int msgL;
+  long int msgS;
+  struct timespec recvT;
+  struct timespec queued;
+};
+
+// Bounded ring between a listener (the only producer) and it's processing threads
+struct IngestRing {
+  struct IngestSlot *slots;
+  unsigned long size;
+  unsigned long mask;
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+  int sleepers __attribute__((aligned(64)));
+  int active;
+  int closed;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+// Function Prototypes
+void setIngest(long int size, int workers, char *policy);
+long int ingestSize();
+int ingestWorkers();
+struct IngestRing *ingestCreate();
+int ingestPut(struct IngestRing *ring, char *msg, long int msgL);
+struct IngestSlot *ingestTake(struct IngestRing *ring, int waitMs);
+long int ingestQueued(struct IngestRing *ring);
+void ingestDone(struct IngestRing *ring, struct IngestSlot *slot);
+void ingestClose(struct IngestRing *ring);
+int ingestClosed(struct IngestRing *ring);
@@ -0,0 +1,520 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hhl7extern.h"
+#include "hhl7journal.h"
+#include "hhl7batch.h"
+#include "hhl7utils.h"
+
+// The receive journal keeps every message a listener ACKs in append only segments,
+// recv-<seq>.jnl, each with a side index, recv-<seq>.idx:
+//   jnl: 64 byte header (struct RJnlHdr) then records (struct RJnlRec + message + \0),
+//        each record padded to 8 bytes
+//   idx: 64 byte header (struct RIdxHdr) then one fixed size entry (struct RJnlIdx)
+//        per record, so record n's entry is at 64 + n * 128
+// A records magic is written last, readers stop at the first record without it.
+// Segments are mapped at their full size up front and the files grown in to the
+// mapping, a segment is closed and a new one started once it's full or too old.
+#define RJNL_MAGIC  "HHL7RCV1"
+#define RIDX_MAGIC  "HHL7IDX1"
+#define RJNL_RMAGIC 0x52374848
+#define RJNL_HDRS   64
+#define RIDX_HDRS   64
+#define RJNL_MINS   1048576
+
+struct RJnlHdr {
+  char magic[8];
+  int64_t created;
+  uint64_t records;
+  uint64_t length;
+};
+
+struct RJnlRec {
+  uint32_t magic;
+  uint32_t len;
+  int64_t sec;
+  uint32_t nsec;
+  char ack[4];
+  char peer[32];
+};
+
+struct RIdxHdr {
+  char magic[8];
+  uint32_t entryS;
+  uint32_t pad;
+  uint64_t records;
+};
+
+struct RJnlIdx {
+  uint64_t off;
+  int64_t sec;
+  uint32_t nsec;
+  uint32_t len;
+  char ack[4];
+  char type[20];
+  char cid[40];
+  char pid[40];
+};
+
+// Segment being written, map is NULL if journalling has stopped
+struct RecvSeg {
+  long int seq;
+  int fd;
+  int idxFD;
+  char *map;
+  char *idxMap;
+  long int mapS;
+  long int idxMapS;
+  long int fileS;
+  long int idxFileS;
+  long int len;
+  uint64_t records;
+  time_t created;
+
+  // Synced up to, by the sync thread or when the segment is closed
+  long int synced;
+  long int idxSynced;
+};
+
+static struct RecvSeg seg = { 0, -1, -1, NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static char jnlDir[256] = "";
+static pthread_mutex_t jnlLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jnlSynced = PTHREAD_COND_INITIALIZER;
+static int jnlSyncing = 0;
+
+
+// Get the segment size the journal rotates at (bytes)
+static long int journalSize() {
+  long int segS = 64;
+
+  if (globalConfig) {
+    if (globalConfig->journalSize > 0) segS = globalConfig->journalSize;
+  }
+  return(segS * 1048576);
+}
+
+
+// Get the age a segment is rotated at (seconds, 0 only rotates by size)
+static int journalAge() {
+  int age = 3600;
+
+  if (globalConfig) {
+    if (globalConfig->journalAge >= 0) age = globalConfig->journalAge;
+  }
+  return(age);
+}
+
+
+// Get the group commit interval for journal syncs (ms)
+static int journalSyncTime() {
+  int syncT = 1000;
+
+  if (globalConfig) {
+    if (globalConfig->journalSync >= 0) syncT = globalConfig->journalSync;
+  }
+  return(syncT);
+}
+
+
+// Size a segment file, allocating it's blocks so a full disk fails here rather than
+// as a SIGBUS writing to the mapping. Falls back to a sparse file if unsupported
+static int sizeFile(int fd, long int size) {
+  if (fallocate(fd, 0, 0, size) == 0) return(0);
+  if (errno != EOPNOTSUPP) return(-1);
+  return(ftruncate(fd, size));
+}
+
+
+// Grow a segment file to fit need bytes, doubling up to it's mapped size
+static int growFile(int fd, long int *fileS, long int need, long int mapS) {
+  long int newS = *fileS;
+
+  while (newS < need) newS = newS * 2;
+  if (newS > mapS) newS = mapS;
+  if (newS < need || sizeFile(fd, newS) == -1) return(-1);
+
+  *fileS = newS;
+  return(0);
+}
+
+
+// Create and map a segment file of mapS bytes, ret the mapping or NULL on error
+static char *mapSegFile(char *fName, int *fd, long int *fileS, long int mapS) {
+  char *map = NULL, errStr[320] = "";
+
+  *fd = open(fName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  *fileS = (mapS < RJNL_MINS) ? mapS : RJNL_MINS;
+  if (*fd == -1 || sizeFile(*fd, *fileS) == -1) {
+    sprintf(errStr, "Cannot create receive journal: %s", fName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    if (*fd != -1) close(*fd);
+    *fd = -1;
+    return(NULL);
+  }
+
+  map = mmap(NULL, mapS, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (map == MAP_FAILED) {
+    sprintf(errStr, "Cannot map receive journal: %s", fName);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    close(*fd);
+    *fd = -1;
+    return(NULL);
+  }
+  return(map);
+}
+
+
+// Start the next segment, large enough for a record of recS bytes, ret 0 on success
+static int openSegment(long int recS) {
+  struct RJnlHdr *hdr = NULL;
+  struct RIdxHdr *idxHdr = NULL;
+  char fName[300] = "", errStr[320] = "";
+
+  seg.seq++;
+  seg.mapS = journalSize();
+  if (seg.mapS < RJNL_HDRS + recS) seg.mapS = RJNL_HDRS + recS;
+
+  // Every record is at least a header and 8 bytes, the index can't need more entries
+  seg.idxMapS = RIDX_HDRS + (seg.mapS / (sizeof(struct RJnlRec) + 8) + 1) *
+                            sizeof(struct RJnlIdx);
+
+  sprintf(fName, "%s/recv-%06ld.idx", jnlDir, seg.seq);
+  seg.idxMap = mapSegFile(fName, &seg.idxFD, &seg.idxFileS, seg.idxMapS);
+  if (seg.idxMap == NULL) return(-1);
+
+  sprintf(fName, "%s/recv-%06ld.jnl", jnlDir, seg.seq);
+  seg.map = mapSegFile(fName, &seg.fd, &seg.fileS, seg.mapS);
+  if (seg.map == NULL) {
+    munmap(seg.idxMap, seg.idxMapS);
+    close(seg.idxFD);
+    seg.idxMap = NULL;
+    return(-1);
+  }
+
+  seg.created = time(NULL);
+  seg.len = RJNL_HDRS;
+  seg.records = 0;
+  seg.synced = 0;
+  seg.idxSynced = 0;
+
+  hdr = (struct RJnlHdr *) seg.map;
+  memcpy(hdr->magic, RJNL_MAGIC, 8);
+  hdr->created = seg.created;
+  hdr->length = seg.len;
+
+  idxHdr = (struct RIdxHdr *) seg.idxMap;
+  memcpy(idxHdr->magic, RIDX_MAGIC, 8);
+  idxHdr->entryS = sizeof(struct RJnlIdx);
+
+  sprintf(errStr, "Journalling received messages to: %s", fName);
+  writeLog(LOG_INFO, errStr, 1);
+  return(0);
+}
+
+
+// Sync and close the current segment, trimming the files to the records written.
+// Called with jnlLock held, waits for the sync thread to finish with the mappings
+static void closeSegment() {
+  long int idxLen = RIDX_HDRS + seg.records * sizeof(struct RJnlIdx);
+
+  while (jnlSyncing == 1) pthread_cond_wait(&jnlSynced, &jnlLock);
+  if (seg.map == NULL) return;
+
+  msync(seg.map, seg.len, MS_SYNC);
+  msync(seg.idxMap, idxLen, MS_SYNC);
+  munmap(seg.map, seg.mapS);
+  munmap(seg.idxMap, seg.idxMapS);
+
+  if (ftruncate(seg.fd, seg.len) == -1 || ftruncate(seg.idxFD, idxLen) == -1)
+    handleError(LOG_WARNING, "Could not trim closed receive journal", -1, 0, 1);
+
+  close(seg.fd);
+  close(seg.idxFD);
+  seg.map = NULL;
+  seg.idxMap = NULL;
+}
+
+
+// Close the current segment and start the next, called with jnlLock held. Journalling
+// stops if the next segment can't be started
+static void rotateSegment(long int recS) {
+  closeSegment();
+  if (openSegment(recS) != 0)
+    handleError(LOG_ERR, "Could not start a new receive journal, journal stopped", -1, 0, 1);
+}
+
+
+// Sync a range of a mapping, from the page holding start
+static void syncRange(char *map, long int start, long int end) {
+  long int pageS = sysconf(_SC_PAGESIZE);
+
+  start = (start / pageS) * pageS;
+  if (end > start) msync(map + start, end - start, MS_SYNC);
+}
+
+
+// Group commit thread, syncs the records written since the last sync every journalSync
+// ms and rotates segments that are too old. The sync is done without the lock so
+// listeners keep writing, closing a segment waits for it to finish
+static void *journalSyncer(void *arg) {
+  struct timespec pause;
+  char *map = NULL, *idxMap = NULL;
+  long int start = 0, end = 0, idxStart = 0, idxEnd = 0, seq = 0;
+  int syncT = journalSyncTime(), age = journalAge();
+
+  (void) arg;
+  pause.tv_sec = (syncT > 0 ? syncT : 1000) / 1000;
+  pause.tv_nsec = ((syncT > 0 ? syncT : 1000) % 1000) * 1000000L;
+
+  while (1) {
+    nanosleep(&pause, NULL);
+
+    pthread_mutex_lock(&jnlLock);
+    if (seg.map != NULL && age > 0 && seg.records > 0 && time(NULL) - seg.created >= age)
+      rotateSegment(0);
+
+    if (seg.map == NULL || syncT == 0 || seg.len == seg.synced) {
+      pthread_mutex_unlock(&jnlLock);
+      continue;
+    }
+
+    map = seg.map;
+    idxMap = seg.idxMap;
+    seq = seg.seq;
+    start = seg.synced;
+    end = seg.len;
+    idxStart = seg.idxSynced;
+    idxEnd = RIDX_HDRS + seg.records * sizeof(struct RJnlIdx);
+    jnlSyncing = 1;
+    pthread_mutex_unlock(&jnlLock);
+
+    // The header pages hold the record counts, then the records since the last sync
+    msync(map, RJNL_HDRS, MS_SYNC);
+    syncRange(map, start, end);
+    msync(idxMap, RIDX_HDRS, MS_SYNC);
+    syncRange(idxMap, idxStart, idxEnd);
+
+    pthread_mutex_lock(&jnlLock);
+    jnlSyncing = 0;
+    if (seg.seq == seq) {
+      seg.synced = end;
+      seg.idxSynced = idxEnd;
+    }
+    pthread_cond_broadcast(&jnlSynced);
+    pthread_mutex_unlock(&jnlLock);
+  }
+  return(NULL);
+}
+
+
+// Find the highest segment number already in the journal directory
+static long int lastSegment() {
+  DIR *dir = NULL;
+  struct dirent *ent = NULL;
+  long int seq = 0, last = 0;
+  char ext[5] = "";
+
+  dir = opendir(jnlDir);
+  if (dir == NULL) return(0);
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (sscanf(ent->d_name, "recv-%ld.%4s", &seq, ext) == 2 && seq > last) last = seq;
+  }
+  closedir(dir);
+  return(last);
+}
+
+
+// Start journalling received messages to new segments in dir, ret 0 on success
+int openRecvJournal(char *dir) {
+  pthread_t thread;
+  sigset_t sigs, oldSigs;
+  int rc = 0;
+
+  if (strlen(dir) == 0 || strlen(dir) > 200) {
+    handleError(LOG_ERR, "Invalid journal directory (1-200 chars)", -1, 0, 1);
+    return(-1);
+  }
+
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    handleError(LOG_ERR, "Cannot create journal directory", -1, 0, 1);
+    return(-1);
+  }
+  sprintf(jnlDir, "%s", dir);
+
+  // Segments are never reopened, a restart carries on from the next number
+  pthread_mutex_lock(&jnlLock);
+  seg.seq = lastSegment();
+  rc = openSegment(0);
+  pthread_mutex_unlock(&jnlLock);
+  if (rc != 0) return(-1);
+
+  // The sync thread runs until the process exits, signals are left for the listener
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+  rc = pthread_create(&thread, NULL, journalSyncer, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+
+  if (rc != 0) {
+    handleError(LOG_ERR, "Failed to start the receive journal sync thread", -1, 0, 1);
+    closeRecvJournal();
+    return(-1);
+  }
+  pthread_detach(thread);
+  return(0);
+}
+
+
+// Check if received messages are being journalled (1=enabled)
+int recvJournalEnabled() {
+  return(seg.map != NULL);
+}
+
+
+// Copy a field for the index, only the first component of it's first repetition
+static void idxField(char *msg, char *segName, int field, int firstComp, char *res, int resS) {
+  batchField(msg, segName, field, res, resS);
+  if (firstComp == 1) res[strcspn(res, "^~")] = '\0';
+}
+
+
+// Append a received message, who sent it and the ACK code it was sent to the journal
+void writeRecvJournal(char *msg, long int msgL, char *peer, char *ackCode) {
+  struct RJnlHdr *hdr = NULL;
+  struct RJnlRec *rec = NULL;
+  struct RJnlIdx *idx = NULL;
+  struct timespec now;
+  long int recS = (sizeof(struct RJnlRec) + msgL + 1 + 7) & ~7L, idxEnd = 0;
+  char type[20] = "", cid[40] = "", pid[40] = "";
+  int age = journalAge();
+
+  if (seg.map == NULL) return;
+
+  // Index fields are found before taking the lock, batches are indexed by their first message
+  clock_gettime(CLOCK_REALTIME, &now);
+  idxField(msg, "MSH|", 9, 0, type, sizeof(type));
+  idxField(msg, "MSH|", 10, 0, cid, sizeof(cid));
+  idxField(msg, "PID|", 3, 1, pid, sizeof(pid));
+
+  pthread_mutex_lock(&jnlLock);
+  if (seg.map == NULL) {
+    pthread_mutex_unlock(&jnlLock);
+    return;
+  }
+
+  if (seg.len + recS > seg.mapS ||
+      (age > 0 && seg.records > 0 && now.tv_sec - seg.created >= age)) {
+    rotateSegment(recS);
+    if (seg.map == NULL) {
+      pthread_mutex_unlock(&jnlLock);
+      return;
+    }
+  }
+
+  idxEnd = RIDX_HDRS + (seg.records + 1) * sizeof(struct RJnlIdx);
+  if ((seg.len + recS > seg.fileS &&
+       growFile(seg.fd, &seg.fileS, seg.len + recS, seg.mapS) != 0) ||
+      (idxEnd > seg.idxFileS &&
+       growFile(seg.idxFD, &seg.idxFileS, idxEnd, seg.idxMapS) != 0)) {
+
+    closeSegment();
+    pthread_mutex_unlock(&jnlLock);
+    handleError(LOG_ERR, "Could not extend receive journal, journal stopped", -1, 0, 1);
+    return;
+  }
+
+  rec = (struct RJnlRec *) (seg.map + seg.len);
+  memcpy(seg.map + seg.len + sizeof(struct RJnlRec), msg, msgL);
+  seg.map[seg.len + sizeof(struct RJnlRec) + msgL] = '\0';
+  rec->len = msgL;
+  rec->sec = now.tv_sec;
+  rec->nsec = now.tv_nsec;
+  snprintf(rec->ack, sizeof(rec->ack), "%s", ackCode);
+  snprintf(rec->peer, sizeof(rec->peer), "%s", peer);
+  __atomic_store_n(&rec->magic, RJNL_RMAGIC, __ATOMIC_RELEASE);
+
+  idx = (struct RJnlIdx *) (seg.idxMap + RIDX_HDRS) + seg.records;
+  idx->off = seg.len;
+  idx->sec = now.tv_sec;
+  idx->nsec = now.tv_nsec;
+  idx->len = msgL;
+  memcpy(idx->ack, rec->ack, sizeof(idx->ack));
+  strncpy(idx->type, type, sizeof(idx->type));
+  strncpy(idx->cid, cid, sizeof(idx->cid));
+  strncpy(idx->pid, pid, sizeof(idx->pid));
+
+  seg.len = seg.len + recS;
+  seg.records++;
+  hdr = (struct RJnlHdr *) seg.map;
+  hdr->records = seg.records;
+  hdr->length = seg.len;
+  ((struct RIdxHdr *) seg.idxMap)->records = seg.records;
+
+  // Without a group commit interval every message is synced before the next
+  if (journalSyncTime() == 0) {
+    msync(seg.map, RJNL_HDRS, MS_SYNC);
+    syncRange(seg.map, seg.len - recS, seg.len);
+    msync(seg.idxMap, RIDX_HDRS, MS_SYNC);
+    syncRange(seg.idxMap, idxEnd - sizeof(struct RJnlIdx), idxEnd);
+    seg.synced = seg.len;
+    seg.idxSynced = idxEnd;
+  }
+  pthread_mutex_unlock(&jnlLock);
+}
+
+
+// Sync and close the journal, once the listeners writing to it have stopped
+void closeRecvJournal() {
+  pthread_mutex_lock(&jnlLock);
+  closeSegment();
+  pthread_mutex_unlock(&jnlLock);
+}
+
+
+// Check if a file is a receive journal segment, ret it's first record or NULL if not
+char *recvJournalStart(char *data, long int dataL) {
+  if (dataL < RJNL_HDRS || memcmp(data, RJNL_MAGIC, 8) != 0) return(NULL);
+  return(data + RJNL_HDRS);
+}
+
+
+// Read the journal record at pos, ret a pointer to the message (\0 terminated) and set
+// next to the following record, or NULL at the end of the segment
+char *recvJournalNext(char *pos, char *end, double *recvT, long int *msgL, char **next) {
+  struct RJnlRec *rec = (struct RJnlRec *) pos;
+
+  if (end - pos < (long int) sizeof(struct RJnlRec) || rec->magic != RJNL_RMAGIC ||
+      (long int) rec->len >= end - pos - (long int) sizeof(struct RJnlRec)) return(NULL);
+
+  *recvT = rec->sec + rec->nsec / 1000000000.0;
+  *msgL = rec->len;
+  *next = pos + ((sizeof(struct RJnlRec) + rec->len + 1 + 7) & ~7UL);
+  return(pos + sizeof(struct RJnlRec));
+}
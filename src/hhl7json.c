@@ -290,8 +290,9 @@ static int parseVals(char ***hl7Msg, int *hl7MsgS, char *vStr, char *nStr, char
     }
 
   } else if (strncmp(vStr, "$TRV", 4) == 0) {
-    struct tm *tm = localtime(&rangeVal);
-    strftime(dtVar, 26, "%Y%m%d%H%M%S", tm);
+    struct tm tm;
+    localtime_r(&rangeVal, &tm);
+    strftime(dtVar, 26, "%Y%m%d%H%M%S", &tm);
     reqS = strlen(**hl7Msg) + 28;
     if (reqS > *hl7MsgS) **hl7Msg = dblBuf(**hl7Msg, hl7MsgS, reqS);
     strcat(**hl7Msg, dtVar);
@@ -0,0 +1,149 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "hhl7mllp.h"
+#include "hhl7utils.h"
+
+// Minimum free space offered for each read
+#define MLLP_READS 4096
+
+
+// Set up an empty decoder, the buffer is allocated on first use
+void mllpInit(struct MLLPDecoder *dec) {
+  memset(dec, 0, sizeof(struct MLLPDecoder));
+  dec->start = -1;
+}
+
+
+// Free a decoders buffer and reset it
+void mllpFree(struct MLLPDecoder *dec) {
+  free(dec->buf);
+  mllpInit(dec);
+}
+
+
+// Get the free space at the end of the buffer to read in to, ret a pointer to it and
+// it's length in spaceL, or NULL if memory couldn't be allocated
+char *mllpSpace(struct MLLPDecoder *dec, int *spaceL) {
+  char *newBuf = NULL;
+  int newS = 0;
+
+  // Drop the frames already returned, only the unreturned tail is moved
+  if (dec->head > 0) {
+    dec->len = dec->len - dec->head;
+    memmove(dec->buf, dec->buf + dec->head, dec->len);
+    dec->scan = dec->scan - dec->head;
+    if (dec->start >= 0) dec->start = dec->start - dec->head;
+    dec->head = 0;
+  }
+
+  // Double the buffer when it's short of space, keeping a byte for the terminator
+  if (dec->size - dec->len - 1 < MLLP_READS) {
+    newS = (dec->size > 0) ? dec->size * 2 : MLLP_READS * 2;
+    while (newS - dec->len - 1 < MLLP_READS) newS = newS * 2;
+
+    newBuf = realloc(dec->buf, newS);
+    if (newBuf == NULL) {
+      handleError(LOG_ERR, "Could not allocate memory for an MLLP receive buffer", -1, 0, 1);
+      return(NULL);
+    }
+    dec->buf = newBuf;
+    dec->size = newS;
+  }
+
+  *spaceL = dec->size - dec->len - 1;
+  return(dec->buf + dec->len);
+}
+
+
+// Add bytes read in to the space from mllpSpace() to the buffer
+void mllpFed(struct MLLPDecoder *dec, int bytes) {
+  if (bytes > 0) dec->len = dec->len + bytes;
+}
+
+
+// Get the next complete frame, without it's MLLP wrapper and NUL terminated in place,
+// valid until the next call to mllpSpace(). Ret the frame length, 0 if more data is
+// needed or -1 if a frame was larger than MLLP_MAXFRAME and has been discarded
+int mllpNext(struct MLLPDecoder *dec, char **frame) {
+  char *buf = dec->buf, errStr[100] = "";
+  int s = dec->scan, frameL = 0;
+
+  for (; s < dec->len; s++) {
+    if (buf[s] == 0x0B) {
+      // A new frame, anything before it (or a frame with no end) is garbage
+      dec->skipped = dec->skipped + s - dec->head;
+      dec->head = s;
+      dec->start = s + 1;
+
+    } else if (buf[s] == 0x1C && dec->start >= 0) {
+      // The trailer is 0x1C 0x0D, wait for the 0x0D if it's not been read yet
+      if (s + 1 >= dec->len) break;
+      if (buf[s + 1] != 0x0D) continue;
+
+      buf[s] = '\0';
+      *frame = buf + dec->start;
+      frameL = s - dec->start;
+
+      dec->frames++;
+      dec->start = -1;
+      dec->head = s + 2;
+      dec->scan = s + 2;
+      return(frameL);
+    }
+  }
+  dec->scan = s;
+
+  // Garbage before a frame is only kept while it could be an unwrapped message
+  if (dec->start < 0 && dec->len - dec->head > MLLP_MAXFRAME) {
+    dec->skipped = dec->skipped + dec->len - dec->head;
+    dec->head = dec->len;
+    dec->scan = dec->len;
+  }
+
+  if (dec->start >= 0 && dec->len - dec->start > MLLP_MAXFRAME) {
+    sprintf(errStr, "Discarding an MLLP frame larger than the %d byte limit", MLLP_MAXFRAME);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    dec->skipped = dec->skipped + dec->len - dec->head;
+    dec->start = -1;
+    dec->head = dec->len;
+    dec->scan = dec->len;
+    return(-1);
+  }
+  return(0);
+}
+
+
+// Get whatever is left in the buffer once the connection has closed, a partial frame
+// or an unwrapped message, NUL terminated. Ret it's length, 0 if there's nothing left
+int mllpRest(struct MLLPDecoder *dec, char **rest) {
+  int restL = dec->len - dec->head;
+
+  if (restL <= 0 || dec->buf == NULL) return(0);
+
+  dec->buf[dec->len] = '\0';
+  *rest = dec->buf + dec->head;
+  dec->head = dec->len;
+  dec->scan = dec->len;
+  dec->start = -1;
+  return(restL);
+}
+
+
+// Check if any bytes are buffered that haven't been returned as a frame (ret 1 if so)
+int mllpBuffered(struct MLLPDecoder *dec) {
+  return(dec->len > dec->head);
+}
@@ -0,0 +1,40 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Largest MLLP frame accepted before it's discarded, 64MB
+#define MLLP_MAXFRAME 67108864
+
+// Incremental MLLP decoder, one per connection. Bytes are read in to the free space
+// at the end of buf and complete frames are returned in place:
+//   head        first byte not yet returned (garbage before a frame is kept until
+//               the frame starts, so unwrapped messages can still be read at EOF)
+//   start       the frame's first byte after the 0x0B, -1 if not in a frame
+//   scan        next byte to examine, every byte is only scanned once
+struct MLLPDecoder {
+  char *buf;
+  int size;
+  int len;
+  int head;
+  int start;
+  int scan;
+  long int frames;
+  long int skipped;
+};
+
+// Function Prototypes
+void mllpInit(struct MLLPDecoder *dec);
+void mllpFree(struct MLLPDecoder *dec);
+char *mllpSpace(struct MLLPDecoder *dec, int *spaceL);
+void mllpFed(struct MLLPDecoder *dec, int bytes);
+int mllpNext(struct MLLPDecoder *dec, char **frame);
+int mllpRest(struct MLLPDecoder *dec, char **rest);
+int mllpBuffered(struct MLLPDecoder *dec);
@@ -14,24 +14,47 @@ You should have received a copy of the GNU General Public License along with hhl
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <syslog.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <getopt.h>
 #include <time.h>
 #include <errno.h>
+#include <pthread.h>
+#include <math.h>
 #include <microhttpd.h>
 #include <json.h>
+#include <openssl/ssl.h>
+#include <linux/io_uring.h>
 #include "hhl7extern.h"
+#include "hhl7ack.h"
+#include "hhl7batch.h"
+#include "hhl7capture.h"
+#include "hhl7dedup.h"
+#include "hhl7ingest.h"
+#include "hhl7journal.h"
+#include "hhl7webring.h"
 #include "hhl7json.h"
+#include "hhl7mllp.h"
 #include "hhl7net.h"
+#include "hhl7queue.h"
+#include "hhl7stats.h"
+#include "hhl7tls.h"
+#include "hhl7uring.h"
 #include "hhl7utils.h"
 #include "hhl7web.h"
 
@@ -50,8 +73,239 @@ struct Response {
   int argc;
 };
 
-// Linked list of responses
-static struct Response *responses;
+// Linked list of responses, one list per listening thread
+static __thread struct Response *responses;
+
+// Struct for a pipelined message awaiting it's ACK
+struct Pending {
+  struct Pending *next;
+  char cid[201];
+  int msgCount;
+  struct timespec sent;
+
+  // Store and forward queue the message was sent from and it's end in the journal
+  struct OutQueue *queue;
+  long int qOff;
+
+  // Number of messages if this is a batch, 0 for a single message
+  int batchMsgs;
+};
+
+// Struct for a server in a fan-out group, with it's own send statistics
+struct FanTarget {
+  struct FanTarget *next;
+  char name[256];
+  char sIP[256];
+  char sPort[6];
+  pthread_mutex_t lock;
+  struct SendStats stats;
+};
+
+// Servers every message is sent to when fanning out (--group), NULL when not
+static struct FanTarget *fanTargets = NULL;
+
+// Struct for pooled outbound connections
+struct Conn {
+  struct Conn *next;
+  char sIP[256];
+  char sPort[6];
+  int sockfd;
+  SSL *ssl;
+  time_t lastUsed;
+
+  // ACK decoder, and for pipelined sends the outstanding messages (oldest first)
+  struct MLLPDecoder dec;
+  struct Pending *pending;
+  struct Pending *pendTail;
+  int outstanding;
+
+  // Fan-out target the connection is sending to, NULL if not fanning out
+  struct FanTarget *target;
+};
+
+// Linked list of pooled connections, keyed by sIP:sPort, one pool per sending thread
+static __thread struct Conn *conns;
+static __thread int epFd = -1;
+
+// ACK code of the last pipelined ACK this thread processed
+static __thread char lastACK[3] = "";
+
+// io_uring ring for stop & wait sends, one per sending thread (0 not yet set up, 1 ready,
+// -1 unavailable)
+static __thread struct URing sendRing;
+static __thread int sendRingOK = 0;
+
+// Resolved addresses for host:port, shared by all sending threads
+#define ADDR_MAX   4
+#define ADDR_CACHE 256
+struct AddrCache {
+  struct AddrCache *next;
+  char host[256];
+  char port[6];
+  struct sockaddr_in addrs[ADDR_MAX];
+  int addrCount;
+  time_t expires;
+};
+
+static struct AddrCache *addrCache = NULL;
+static int addrCacheCount = 0;
+static pthread_mutex_t addrLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Struct for an inbound MLLP session, held open for as long as the sender keeps it open
+struct Session {
+  struct Session *next;
+  int sockfd;
+  SSL *ssl;
+  int tlsDone;
+  int tlsOut;
+  time_t started;
+  char peer[INET_ADDRSTRLEN + 7];
+  struct MLLPDecoder dec;
+
+  // Web listener the session was accepted by, NULL for the command line listener
+  struct WebListener *wl;
+
+  // io_uring listener, recv armed, send in flight and closing once both have completed
+  int uRecv;
+  int uSend;
+  int uClosing;
+
+  // ACKs waiting to be sent (ack[ackCur]) and those being sent, double buffered
+  char *ack[2];
+  int ackLen[2];
+  int ackSize[2];
+  int ackOff;
+  int ackCur;
+};
+
+// Linked list of open inbound sessions, one list per listening thread
+static __thread struct Session *sessions;
+static __thread int sessCount = 0;
+
+// Reads from one session before moving on to the next, time allowed for a TLS handshake
+#define SESS_READS 16
+#define SESS_HSTIME 10
+
+// io_uring listener ring size and provided receive buffers (count must be a power of 2)
+#define URING_ENTRIES 1024
+#define URING_BUFS    256
+#define URING_BUFSIZE 16384
+
+// ACKs waiting on a sender that isn't reading them before it's session is dropped
+#define SESS_ACKMAX 4194304
+
+// io_uring user_data tags, the rest of user_data is the session
+#define UR_ACCEPT 1
+#define UR_RECV   2
+#define UR_SEND   3
+
+// Session the io_uring listener is processing, it's ACKs are collected to send together
+static __thread struct Session *corkSess = NULL;
+
+// Ring received messages are passed to this listener's processing threads through,
+// NULL if the listener processes them itself
+static __thread struct IngestRing *ingest = NULL;
+
+// Number of listener worker threads, each with it's own socket and event loop (-j)
+static int lsnWorkers = 1;
+
+// Listener, processing and web listener engine threads still running, each exits once a
+// stop is requested and they're waited for before shutting down
+static int svcThreads = 0;
+
+// Shared state for listener worker threads
+struct ListenJob {
+  char *lIP;
+  const char *lPort;
+  char *sIP;
+  char *sPort;
+  int argc;
+  int optind;
+  char **argv;
+  int resType;
+  char *ackList;
+  int aTimeout;
+  unsigned int seed;
+};
+
+// A web session's listener, every one is run by the web listener engine thread
+struct WebListener {
+  struct WebListener *next;
+  int id;
+  int svrfd;
+  int stopping;
+  char sIP[256];
+  char sPort[6];
+  int aTimeout;
+
+  // Messages and response lists to the web interface, responder templates from it
+  struct WebRing *out;
+  struct WebRing *in;
+
+  // This listener's sessions and responses, swapped in while the engine handles it
+  struct Session *sessions;
+  int sessCount;
+  struct Response *responses;
+  int nextResp;
+  time_t lastProcess;
+
+  // Responder templates to check messages against, none if respCount is 0
+  char respTemps[20][256];
+  char *respTempsPtrs[20];
+  int respCount;
+};
+
+// Web listeners run by the engine (webLsns) and those started but not yet picked up
+// (webLsnNew), both only changed with webLsnLock held
+static struct WebListener *webLsns = NULL;
+static struct WebListener *webLsnNew = NULL;
+static pthread_mutex_t webLsnLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t webLsnCond = PTHREAD_COND_INITIALIZER;
+static int webLsnEp = -1;
+static int webLsnWake = -1;
+static int webLsnID = 0;
+
+// Web listener engine epoll tags, the rest of the event data is the web listener.
+// Sessions are untagged
+#define WL_ACCEPT 1
+#define WL_TEMPS  2
+#define WL_WAKE   3
+
+// Shared state for an ingest ring's processing threads
+struct IngestJob {
+  struct IngestRing *ring;
+  struct ListenJob *job;
+};
+
+// Number of messages that may be sent before waiting for an ACK (1 = stop & wait)
+static int sendWindow = 1;
+
+// Minimum send window used when draining a store and forward queue
+#define QUEUE_WINDOW 100
+
+// Shared state for multi-threaded template sending (-j)
+struct SendJob {
+  char *sIP;
+  char *sPort;
+  char *tName;
+  int noSend;
+  int fShowTemplate;
+  int optind;
+  int argc;
+  char **argv;
+  int aTimeout;
+  int pACK;
+  int sCount;
+  int sSleep;
+  int nextSend;
+  unsigned int seed;
+
+  // Open loop schedule, rate (msg/s) ramping to rampRate over rampSecs from start
+  double rate;
+  double rampRate;
+  double rampSecs;
+  struct timespec start;
+};
 
 
 // Add a response struct to the queue
@@ -115,22 +369,33 @@ static void addRespWeb(char *newResp, struct Response *resp, int respCount) {
 }
 
 
+// Free a response and it's template send arguments
+static void freeResponse(struct Response *resp) {
+  int argCount = 0;
+
+  free(resp->tName);
+  free(resp->rName);
+  for (argCount = 0; argCount < resp->argc; argCount++) free(resp->sendArgs[argCount]);
+  free(resp->sendArgs);
+  free(resp);
+}
+
+
 // Process the response queue
-static int processResponses(int fd, int aTimeout) {
+static int processResponses(struct WebRing *webOut, int aTimeout) {
   struct Response *resp;
   time_t tNow = time(NULL), fTime;
-  char writeSize[11] = "";
   char resStr[3] = "";
-  char *sArg = "";
-  int nextResp = -1, respCount = 0, rmCount = 0, argCount = 0, expTime = 900;
+  int nextResp = -1, respCount = 0, rmCount = 0, expTime = 900;
   int webRespS = 1024, reqS = 0, webLimit = 200;
-  char *webResp = malloc(webRespS);
-  webResp[0] = '\0';
-  char errStr[256] = "";
+  char *webResp = NULL;
 
   resp = responses;
   if (resp == NULL) return(nextResp);
 
+  webResp = malloc(webRespS);
+  webResp[0] = '\0';
+
   char newResp[strlen(resp->rName) + strlen(resp->tName) +
                strlen(resp->sIP) + strlen(resp->sPort) + 293];
 
@@ -149,20 +414,7 @@ static int processResponses(int fd, int aTimeout) {
     if (tNow - resp->sendTime >= expTime && resp->sent == 1) {
       writeLog(LOG_DEBUG, "Response queue processing, old response removed", 0);
       responses = resp->next;
-      free(resp->tName);
-      free(resp->rName);
-
-      // Free all template send arguments
-      sArg = resp->sendArgs[0];
-      while (sArg != NULL) {
-        free(resp->sendArgs[argCount]);
-        argCount++;
-        sArg = resp->sendArgs[argCount];
-      }
-      free(resp->sendArgs);
-
-      argCount = 0;
-      free(resp);
+      freeResponse(resp);
       resp = responses;
       rmCount++;
       continue;
@@ -209,17 +461,9 @@ static int processResponses(int fd, int aTimeout) {
 
   if (webRunning == 1 && (respCount + rmCount) > 0) {
     if ((int) strlen(webResp) == 0 && webResp) sprintf(webResp, "%s", "QE");
-      sprintf(writeSize, "%d", (int) strlen(webResp));
-
-    if (write(fd, writeSize, 11) == -1) {
-      sprintf(errStr, "Failed to write to named pipe: %s", strerror(errno));
-      handleError(LOG_ERR, errStr, 1, 0, 0);
-    }
 
-    if (write(fd, webResp, strlen(webResp)) == -1) {
-      sprintf(errStr, "Failed to write to named pipe: %s", strerror(errno));
-      handleError(LOG_ERR, errStr, 1, 0, 0);
-    }
+    // A full ring is counted as dropped and shown by the web interface
+    webRingPut(webOut, webResp, strlen(webResp));
   }
 
   webResp[0] = '\0';
@@ -245,218 +489,1655 @@ int validPort(char *port) {
 }
 
 
-// Connect to server on IP:Port
-int connectSvr(char *ip, char *port) {
-  int sockfd = -1, rv;
+// Get the timeout for connecting to a server (ms)
+static int connTimeout() {
+  int connT = 3000;
+
+  if (globalConfig) {
+    if (globalConfig->connTimeout > 0) connT = globalConfig->connTimeout;
+  }
+  return(connT);
+}
+
+
+// Get the timeout for writing a message to a server (ms)
+static int writeTimeout() {
+  int writeT = 5000;
+
+  if (globalConfig) {
+    if (globalConfig->writeTimeout > 0) writeT = globalConfig->writeTimeout;
+  }
+  return(writeT);
+}
+
+
+// Set a deadline waitMs from now
+static void setDeadline(struct timespec *end, int waitMs) {
+  clock_gettime(CLOCK_MONOTONIC, end);
+  end->tv_sec = end->tv_sec + waitMs / 1000;
+  end->tv_nsec = end->tv_nsec + (waitMs % 1000) * 1000000;
+  if (end->tv_nsec >= 1000000000) {
+    end->tv_sec++;
+    end->tv_nsec = end->tv_nsec - 1000000000;
+  }
+}
+
+
+// Get the ms left until a deadline, 0 if it has passed
+static int msLeft(struct timespec *end) {
+  struct timespec now;
+  long leftMs = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  leftMs = (end->tv_sec - now.tv_sec) * 1000 + (end->tv_nsec - now.tv_nsec) / 1000000;
+  return(leftMs > 0 ? (int) leftMs : 0);
+}
+
+
+// Arm a socket for one shot events on this threads epoll instance, ret -1 on error
+// Being one shot, a socket that timed out fires at most once later
+static int armSock(int sockfd, unsigned int events) {
+  struct epoll_event ev;
+
+  if (epFd == -1) {
+    epFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epFd == -1) return(-1);
+  }
+
+  ev.events = events | EPOLLONESHOT;
+  ev.data.fd = sockfd;
+  if (epoll_ctl(epFd, EPOLL_CTL_MOD, sockfd, &ev) == -1) {
+    if (errno != ENOENT || epoll_ctl(epFd, EPOLL_CTL_ADD, sockfd, &ev) == -1) return(-1);
+  }
+  return(0);
+}
+
+
+// Wait up to waitMs for events on a socket with this threads epoll instance
+// Returns 1 if the socket is ready, 0 on timeout or -1 on error
+static int waitSock(int sockfd, unsigned int events, int waitMs) {
+  struct epoll_event evs[8];
+  struct timespec end;
+  int evCount = 0, e = 0;
+
+  if (armSock(sockfd, events) == -1) return(-1);
+
+  setDeadline(&end, waitMs);
+
+  while (1) {
+    evCount = epoll_wait(epFd, evs, 8, msLeft(&end));
+    if (evCount == -1 && errno != EINTR) return(-1);
+
+    // Ignore late events from other sockets that previously timed out
+    for (e = 0; e < evCount; e++) {
+      if (evs[e].data.fd == sockfd) return(1);
+    }
+    if (msLeft(&end) == 0) return(0);
+  }
+}
+
+
+// Get the time to cache a resolved (or failed if isNeg=1) address lookup
+static int addrCacheTTL(int isNeg) {
+  int addrT = 60, negT = 5;
+
+  if (globalConfig) {
+    if (globalConfig->addrTTL >= 0) addrT = globalConfig->addrTTL;
+    if (globalConfig->addrNegTTL >= 0) negT = globalConfig->addrNegTTL;
+  }
+  return(isNeg == 1 ? negT : addrT);
+}
+
+
+// Find host:port in the address cache, expiring old entries on the way (addrLock held)
+static struct AddrCache *findAddr(char *host, char *port) {
+  struct AddrCache *this = addrCache, *prev = NULL, *next;
+  time_t now = time(NULL);
+
+  while (this != NULL) {
+    next = this->next;
+    if (this->expires <= now) {
+      if (prev == NULL) {
+        addrCache = next;
+      } else {
+        prev->next = next;
+      }
+      free(this);
+      addrCacheCount--;
+
+    } else if (strcmp(this->host, host) == 0 && strcmp(this->port, port) == 0) {
+      return(this);
+
+    } else {
+      prev = this;
+    }
+    this = next;
+  }
+  return(NULL);
+}
+
+
+// Resolve host:port to up to ADDR_MAX addresses, using the cache where possible
+// Returns the number of addresses found, 0 if the host could not be resolved
+static int resolveAddr(char *host, char *port, struct sockaddr_in *addrs) {
+  struct AddrCache *entry;
   struct addrinfo hints, *servinfo, *p;
-  char errStr[299] = "";
+  int addrCount = 0, ttl = 0;
+
+  pthread_mutex_lock(&addrLock);
+  entry = findAddr(host, port);
+  if (entry != NULL) {
+    addrCount = entry->addrCount;
+    memcpy(addrs, entry->addrs, addrCount * sizeof(struct sockaddr_in));
+  }
+  pthread_mutex_unlock(&addrLock);
 
+  statsAddrCache(entry != NULL);
+  if (entry != NULL) return(addrCount);
+
+  // Not cached, resolve without holding the lock
   memset(&hints, 0, sizeof hints);
   hints.ai_family = AF_INET;
   hints.ai_socktype = SOCK_STREAM;
 
-  if ((rv = getaddrinfo(ip, port, &hints, &servinfo)) != 0) {
-    handleError(LOG_ERR, "Can't obtain address info when connecting to server", -1, 0, 1);
+  if (getaddrinfo(host, port, &hints, &servinfo) == 0) {
+    for (p = servinfo; p != NULL && addrCount < ADDR_MAX; p = p->ai_next) {
+      memcpy(&addrs[addrCount++], p->ai_addr, sizeof(struct sockaddr_in));
+    }
     freeaddrinfo(servinfo);
+  }
+
+  // Cache the result, failed lookups are cached as an entry with no addresses
+  ttl = addrCacheTTL(addrCount == 0);
+  if (ttl <= 0 || strlen(host) > 255 || strlen(port) > 5) return(addrCount);
+
+  pthread_mutex_lock(&addrLock);
+  entry = findAddr(host, port);
+  if (entry == NULL && addrCacheCount < ADDR_CACHE) {
+    entry = calloc(1, sizeof(struct AddrCache));
+    if (entry != NULL) {
+      sprintf(entry->host, "%s", host);
+      sprintf(entry->port, "%s", port);
+      entry->next = addrCache;
+      addrCache = entry;
+      addrCacheCount++;
+    }
+  }
+  if (entry != NULL) {
+    entry->addrCount = addrCount;
+    memcpy(entry->addrs, addrs, addrCount * sizeof(struct sockaddr_in));
+    entry->expires = time(NULL) + ttl;
+  }
+  pthread_mutex_unlock(&addrLock);
+
+  return(addrCount);
+}
+
+
+// Connect to a server without blocking for longer than the connect timeout
+int connectSvr(char *ip, char *port) {
+  int sockfd = -1, rv, sockErr = 0, connT = connTimeout(), addrCount = 0, a = 0;
+  socklen_t errL = sizeof(sockErr);
+  struct sockaddr_in addrs[ADDR_MAX];
+  char errStr[299] = "";
+
+  addrCount = resolveAddr(ip, port, addrs);
+  if (addrCount == 0) {
+    handleError(LOG_ERR, "Can't obtain address info when connecting to server", -1, 0, 1);
     return(-1);
   }
 
   // Loop through results and try to connect
-  for(p = servinfo; p != NULL; p = p->ai_next) {
-    if ((sockfd = socket(p->ai_family, p->ai_socktype,
-      p->ai_protocol)) == -1) {
+  for (a = 0; a < addrCount; a++) {
+    if ((sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
       continue;
     }
-    if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-      close(sockfd);
-      continue;
+
+    // Wait for an in progress connect to complete, then check it's result
+    if (connect(sockfd, (struct sockaddr *) &addrs[a], sizeof(struct sockaddr_in)) == -1) {
+      if (errno != EINPROGRESS) {
+        close(sockfd);
+        continue;
+      }
+      rv = waitSock(sockfd, EPOLLOUT, connT);
+      if (rv <= 0) {
+        sprintf(errStr, "Timeout connecting to server %s on port %s", ip, port);
+        writeLog(LOG_WARNING, errStr, 1);
+        close(sockfd);
+        continue;
+      }
+      if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &sockErr, &errL) == -1 || sockErr != 0) {
+        close(sockfd);
+        continue;
+      }
     }
     sprintf(errStr, "Connected to server %s on port %s", ip, port);
     writeLog(LOG_INFO, errStr, 1);
     break;
   }
 
-  if (p == NULL) {
+  // None of the addresses connected, the cached addresses are kept until they expire so
+  // a server that's down isn't looked up again on every retry
+  if (a == addrCount) {
     sprintf(errStr, "Failed to connect to server %s on port %s", ip, port);
     handleError(LOG_ERR, errStr, -1, 0, 1);
-    freeaddrinfo(servinfo);
     return(-1);
   }
 
-  freeaddrinfo(servinfo);
   return(sockfd);
 }
 
 
-// Listen for ACK from server
-int listenACK(int sockfd, char *res, int aTimeout, int pACK) {
-  char ackBuf[512] = "", app[12] = "", code[7] = "", aCode[3] = "", errStr[46] = "";
-  int recvL = 0, ackT = 3;
+// Start TLS on a connected socket, the handshake is bound by the connect timeout
+static SSL *connectTLS(int sockfd, char *ip, char *port) {
+  SSL *ssl = tlsClient(sockfd, ip, port);
+  struct timespec end;
+  int rv = 0, err = 0;
+  char errStr[300] = "";
 
-  // Get the timeout from global config if it exists
-  if (aTimeout > 0 && aTimeout <= 60) {
-    ackT = aTimeout;
-  } else {
-    if (globalConfig) {
-      if (globalConfig->ackTimeout > 0 && globalConfig->ackTimeout < 100)
-        ackT = globalConfig->ackTimeout;
+  if (ssl == NULL) return(NULL);
+  setDeadline(&end, connTimeout());
 
+  while ((rv = SSL_connect(ssl)) != 1) {
+    err = SSL_get_error(ssl, rv);
+    if (err == SSL_ERROR_WANT_READ) {
+      rv = waitSock(sockfd, EPOLLIN, msLeft(&end));
+    } else if (err == SSL_ERROR_WANT_WRITE) {
+      rv = waitSock(sockfd, EPOLLOUT, msLeft(&end));
     } else {
-      ackT = 4; // No valid ACK timeout from CLI or conf, fall back to a value of 4 seconds
+      rv = -1;
+    }
+
+    if (rv <= 0) {
+      sprintf(errStr, "TLS handshake with server %s on port %s failed", ip, port);
+      tlsError(errStr, ssl);
+      tlsClientFailed(ssl);
+      SSL_free(ssl);
+      return(NULL);
     }
   }
 
-  // Set ListenACK timeout
-  struct timeval tv, *tvp;
-  tv.tv_sec = ackT;
-  tv.tv_usec = 0;
-  tvp = &tv;
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, tvp, sizeof tv);
+  statsTLS(SSL_session_reused(ssl));
+  sprintf(errStr, "TLS %s with server %s on port %s (%s)",
+          SSL_session_reused(ssl) ? "session resumed" : "handshake completed", ip, port,
+          SSL_get_version(ssl));
+  writeLog(LOG_INFO, errStr, 1);
+  return(ssl);
+}
 
-  writeLog(LOG_INFO, "Listening for ACK...", 1);
 
-  // Receive the response from the server and strip MLLP wrapper
-  if ((recvL = recv(sockfd, ackBuf, 512, 0)) == -1) {
-    handleError(LOG_ERR, "Timeout listening for ACK response", 1, 0, 1);
-    return(-2);
+// Record messages sent to a fan-out target, target may be NULL
+static void fanSent(struct FanTarget *target, long int bytes) {
+  if (target == NULL) return;
+  pthread_mutex_lock(&target->lock);
+  statsTargetSent(&target->stats, bytes);
+  pthread_mutex_unlock(&target->lock);
+}
 
-  } else {
-    stripMLLP(ackBuf);
 
-    // Find the ack response in MSA.1
-    getHL7Field(ackBuf, "MSA", 1, aCode);
+// Record an ACK from a fan-out target, target may be NULL
+static void fanACK(struct FanTarget *target, char *aCode, struct timespec *sent) {
+  if (target == NULL) return;
+  pthread_mutex_lock(&target->lock);
+  statsTargetACK(&target->stats, aCode, sent);
+  pthread_mutex_unlock(&target->lock);
+}
 
-    // Process the code, either AA, AE, AR, CA, CE or CR.
-    if ((char) aCode[0] == 'A') {
-      strcpy(app, "Application");
-    } else if ((char) aCode[0] == 'C') {
-      strcpy(app, "Commit");
-    }
 
-    if ((char) aCode[1] == 'A') {
-      strcpy(code, "Accept");
-    } else if ((char) aCode[1] == 'E') {
-      strcpy(code, "Error");
-    } else if ((char) aCode[1] == 'R') {
-      strcpy(code, "Reject");
-    }
+// Record messages to a fan-out target that failed, target may be NULL
+static void fanFailed(struct FanTarget *target, long int count) {
+  if (target == NULL) return;
+  pthread_mutex_lock(&target->lock);
+  statsTargetFailed(&target->stats, count);
+  pthread_mutex_unlock(&target->lock);
+}
 
-    sprintf(errStr, "Server ACK response: %s %s (%s)", app, code, aCode);
-    writeLog(LOG_INFO, errStr, 1);
 
-    if (pACK == 1) hl72unix(ackBuf, 1);
+// Get the idle time before a pooled connection is closed
+static int connIdleTime() {
+  int idleT = 30;
 
-    if (res) {
-      aCode[2] = '\0';
-      strcpy(res, aCode);
-    }
+  if (globalConfig) {
+    if (globalConfig->connIdle >= 0) idleT = globalConfig->connIdle;
   }
-  return(recvL);
+  return(idleT);
 }
 
 
-// Send a file over socket
-void sendFile(char *sIP, char *sPort, FILE *fp, long int fileSize,
-              int aTimeout, int pACK) {
-  char fileData[fileSize + 4];
-  char resStr[3] = "";
-
-  // Read file to buffer
-  size_t newLen = fread(fileData, sizeof(char), fileSize, fp);
-  if (ferror(fp) != 0) {
-    handleError(LOG_ERR, "Could not read data file to send", 1, 0, 1);
+// Check if the server has closed a pooled connection (ret 1=open, 0=closed)
+static int connAlive(struct Conn *conn) {
+  char peekBuf[1];
+  int peekL = 0;
 
-  } else {
-    fileData[newLen++] = '\0';
+  // Read through TLS, post handshake records such as session tickets aren't data
+  if (conn->ssl != NULL) {
+    peekL = SSL_peek(conn->ssl, peekBuf, 1);
+    if (peekL <= 0 && SSL_get_error(conn->ssl, peekL) == SSL_ERROR_WANT_READ) return(1);
+    return(0);
   }
 
-  fclose(fp);
+  peekL = recv(conn->sockfd, peekBuf, 1, MSG_PEEK | MSG_DONTWAIT);
+
+  // No data waiting and no EOF means the connection is still usable
+  if (peekL == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return(1);
 
-  // Send the data file to the server
-  unix2hl7(fileData);
-  sendPacket(sIP, sPort, fileData, resStr, 0, 0, 0, aTimeout, pACK);
+  // EOF, error or unexpected data (e.g: a late ACK), don't reuse
+  return(0);
 }
 
-// Send a single HL7 message over a socket
-int sendPacket(char *sIP, char *sPort, char *hl7Msg, char *resStr, int msgCount,
-                  int noSend, int fShowTemplate, int aTimeout, int pACK) {
 
-  int sockfd = -1, retVal = 0;
-  char errStr[43] = "";
+// Close a pooled connection and remove it from the pool
+static void dropConn(struct Conn *conn) {
+  struct Conn *this = conns, *prev = NULL;
+  struct Pending *pend;
+  char errStr[330] = "";
 
-  // Print the HL7 message if requested
-  if (fShowTemplate == 1) {
-    hl72unix(hl7Msg, 1);
+  while (this != NULL) {
+    if (this == conn) {
+      if (prev == NULL) {
+        conns = this->next;
+      } else {
+        prev->next = this->next;
+      }
+      // Any messages still awaiting an ACK on this connection are lost
+      if (this->outstanding > 0) {
+        sprintf(errStr, "Connection to %s:%s closed with %d ACKs outstanding",
+                        this->sIP, this->sPort, this->outstanding);
+        handleError(LOG_WARNING, errStr, -1, 0, 1);
+        statsFailed(this->outstanding);
+        fanFailed(this->target, this->outstanding);
+      }
+      // Queued messages are sent again from the first one not ACKed
+      if (this->pending != NULL && this->pending->queue != NULL)
+        queueRewind(this->pending->queue);
+
+      while (this->pending != NULL) {
+        pend = this->pending;
+        this->pending = pend->next;
+        free(pend);
+      }
+
+      tlsClose(this->ssl);
+      close(this->sockfd);
+      mllpFree(&this->dec);
+      free(this);
+      return;
+    }
+    prev = this;
+    this = this->next;
   }
+}
 
-  if (noSend == 0) {
-    // Send the data file to the server
-    sprintf(errStr, "Sending HL7 message %d to server", msgCount);
-    writeLog(LOG_INFO, errStr, 1);
 
-    // Set the default response code to EE
-    if (resStr != NULL) sprintf(resStr, "%s", "EE");
+// Close pooled connections that have been idle too long, those still waiting on ACKs
+// are left to pollConnPool() or waitPipeACKs() to time out
+void expireConnPool() {
+  struct Conn *this = conns, *next;
+  time_t now = time(NULL);
+  int idleT = connIdleTime();
+  char errStr[300] = "";
+
+  while (this != NULL) {
+    next = this->next;
+    if (this->outstanding == 0 && now - this->lastUsed >= idleT) {
+      sprintf(errStr, "Closing idle connection to %s:%s", this->sIP, this->sPort);
+      writeLog(LOG_DEBUG, errStr, 0);
+      dropConn(this);
+    }
+    this = next;
+  }
+}
 
-    // Connect to the target server
-    sockfd = connectSvr(sIP, sPort);
-    if (sockfd >= 0) { 
-      // Add MLLP wrapper to this message
-      wrapMLLP(hl7Msg);
 
-      // Send the message to the server
-      if (send(sockfd, hl7Msg, strlen(hl7Msg), 0) == -1) {
-        handleError(LOG_ERR, "Could not send data packet to server", -1, 0, 1);
-        return(-1);
+// Close all pooled connections
+void closeConnPool() {
+  while (conns != NULL) dropConn(conns);
+
+  if (epFd != -1) {
+    close(epFd);
+    epFd = -1;
+  }
+
+  if (sendRingOK == 1) uringClose(&sendRing);
+  sendRingOK = 0;
+}
 
-      } else {
-        retVal = listenACK(sockfd, resStr, aTimeout, pACK);
 
+// Get a connection to sIP:sPort from the pool, or open a new one (*isNew=1)
+static struct Conn *getConn(char *sIP, char *sPort, int *isNew) {
+  struct Conn *conn = NULL;
+  SSL *ssl = NULL;
+  struct timespec cStart;
+  char errStr[300] = "";
+  int sockfd = -1;
+
+  // Expiring idle connections may drop the head of the pool
+  expireConnPool();
+  conn = conns;
+  *isNew = 0;
+
+  while (conn != NULL) {
+    if (strcmp(conn->sIP, sIP) == 0 && strcmp(conn->sPort, sPort) == 0) {
+      // Pipelined connections with ACKs outstanding are expected to have data waiting
+      if (conn->outstanding > 0 || connAlive(conn) == 1) {
+        conn->lastUsed = time(NULL);
+        return(conn);
       }
 
-    } else {
-      retVal = -4;
+      // The server has closed the connection, reconnect below
+      sprintf(errStr, "Server %s:%s closed pooled connection, reconnecting", sIP, sPort);
+      writeLog(LOG_DEBUG, errStr, 0);
+      dropConn(conn);
+      break;
     }
+    conn = conn->next;
+  }
 
+  // Connect, including the TLS handshake, is counted as the connect latency
+  clock_gettime(CLOCK_MONOTONIC, &cStart);
+  sockfd = connectSvr(sIP, sPort);
+  if (sockfd < 0) return(NULL);
+  if (tlsClientEnabled() == 1 && (ssl = connectTLS(sockfd, sIP, sPort)) == NULL) {
     close(sockfd);
+    return(NULL);
   }
+  statsConnect(&cStart);
 
-  return(retVal);
-}
-
+  conn = calloc(1, sizeof(struct Conn));
+  if (conn == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for a pooled connection", -1, 0, 1);
+    tlsClose(ssl);
+    close(sockfd);
+    return(NULL);
+  }
 
-// Split a packet in to individual messages
-int splitPacket(char *sIP, char *sPort, char *hl7Msg, char *resStr, char **resList,
-                int noSend, int fShowTemplate, int aTimeout, int pACK) {
+  sprintf(conn->sIP, "%s", sIP);
+  sprintf(conn->sPort, "%s", sPort);
+  conn->sockfd = sockfd;
+  conn->ssl = ssl;
+  conn->lastUsed = time(NULL);
+  mllpInit(&conn->dec);
+  conn->next = conns;
+  conns = conn;
+  *isNew = 1;
+  return(conn);
+}
 
-  char *curMsg = hl7Msg, *nextMsg = NULL;
-  char newMsgStr[6] = "MSH|^";
-  int rv = 0, msgCount = 0, lastMsg = 0, reqS = 0, rlSize = 301;
-  long unsigned int hl7MsgS = strlen(hl7Msg);
 
-  // Check if there's more than 1 message, if not send the full packet
-  if (hl7MsgS >= strlen(newMsgStr)) nextMsg = strstr(hl7Msg + 1, newMsgStr);
-  if (nextMsg == NULL) {
-    msgCount++;
-    rv = sendPacket(sIP, sPort, hl7Msg, resStr, msgCount, noSend,
-                       fShowTemplate, aTimeout, pACK);
+// Write a message over TLS in an MLLP frame, the header, body and trailer are passed to
+// successive SSL_write() calls straight from the callers buffer, ret 0 or -1 on error.
+// The socket is corked so the frame's records leave together, not held back by Nagle.
+// On an error errno is only EPIPE or ECONNRESET if none of the message was sent
+static int writeTLS(int sockfd, SSL *ssl, char *hl7Msg, size_t msgL) {
+  static char mllpSB[1] = { 11 }, mllpEB[2] = { 28, 13 };
+  char *part[3] = { mllpSB, hl7Msg, mllpEB };
+  int partL[3] = { 1, (int) msgL, 2 };
+  struct timespec end;
+  int p = 0, rv = 0, err = 0, cork = 1, retVal = 0, errNo = 0;
+
+  setDeadline(&end, writeTimeout());
+  setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+  for (p = 0; p < 3 && retVal == 0; p++) {
+    // A retried SSL_write() must be passed the same buffer and length
+    while ((rv = SSL_write(ssl, part[p], partL[p])) <= 0) {
+      err = SSL_get_error(ssl, rv);
+      if (err == SSL_ERROR_WANT_WRITE) {
+        rv = waitSock(sockfd, EPOLLOUT, msLeft(&end));
+      } else if (err == SSL_ERROR_WANT_READ) {
+        rv = waitSock(sockfd, EPOLLIN, msLeft(&end));
+      } else {
+        errNo = (p > 0) ? EIO : errno;
+        retVal = -1;
+        break;
+      }
 
-    if (resList != NULL) strcat(*resList, resStr);
+      if (rv <= 0) {
+        handleError(LOG_ERR, "Timeout writing message to server", -1, 0, 1);
+        errNo = ETIMEDOUT;
+        retVal = -1;
+        break;
+      }
+    }
+  }
 
-  // If there's multiple messages, split and send each individually
-  } else {
-    char singleMsg[strlen(hl7Msg + 1)];
+  cork = 0;
+  setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  if (retVal == -1) errno = errNo;
+  return(retVal);
+}
 
-    // Loop through each message in the template
-    while (nextMsg != NULL) {
-      msgCount++;
-      hl7MsgS = (int) (nextMsg - curMsg) + 1;
 
-      // Send each sub message from the template
-      snprintf(singleMsg, hl7MsgS, "%s", curMsg);
+// Write a message to a socket in an MLLP frame straight from the callers buffer,
+// the header, body and trailer are sent as one iovec list, ret 0 or -1 on error. On an
+// error errno is only EPIPE or ECONNRESET if none of the message was sent
+static int writeMLLP(int sockfd, SSL *ssl, char *hl7Msg, size_t msgL) {
+  static char mllpSB[1] = { 11 }, mllpEB[2] = { 28, 13 };
+  struct iovec iov[3] = { { mllpSB, 1 }, { hl7Msg, msgL }, { mllpEB, 2 } };
+  struct msghdr mHdr;
+  struct timespec end;
+  ssize_t sendL = 0;
+  int started = 0;
+
+  if (ssl != NULL) return(writeTLS(sockfd, ssl, hl7Msg, msgL));
+
+  memset(&mHdr, 0, sizeof(mHdr));
+  mHdr.msg_iov = iov;
+  mHdr.msg_iovlen = 3;
+  setDeadline(&end, writeTimeout());
+
+  while (mHdr.msg_iovlen > 0) {
+    sendL = sendmsg(sockfd, &mHdr, MSG_NOSIGNAL);
+    if (sendL == -1) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (started == 1) errno = EIO;
+        return(-1);
+      }
 
-      // TODO - take the worst return code!
-      rv = sendPacket(sIP, sPort, singleMsg, resStr, msgCount, noSend,
+      // The socket buffer is full, wait for the server to read more
+      if (waitSock(sockfd, EPOLLOUT, msLeft(&end)) <= 0) {
+        handleError(LOG_ERR, "Timeout writing message to server", -1, 0, 1);
+        errno = ETIMEDOUT;
+        return(-1);
+      }
+      continue;
+    }
+    started = 1;
+
+    // Skip any fully written iovecs and advance into a partially written one
+    while (mHdr.msg_iovlen > 0 && (size_t) sendL >= mHdr.msg_iov[0].iov_len) {
+      sendL = sendL - mHdr.msg_iov[0].iov_len;
+      mHdr.msg_iov++;
+      mHdr.msg_iovlen--;
+    }
+    if (mHdr.msg_iovlen > 0) {
+      mHdr.msg_iov[0].iov_base = (char *) mHdr.msg_iov[0].iov_base + sendL;
+      mHdr.msg_iov[0].iov_len = mHdr.msg_iov[0].iov_len - sendL;
+    }
+  }
+  return(0);
+}
+
+
+// Check if data is already buffered by TLS, so won't show as readable on the socket
+static int connPending(struct Conn *conn) {
+  return(conn->ssl != NULL && SSL_pending(conn->ssl) > 0);
+}
+
+
+// Read from a connection without blocking, over TLS if ssl isn't NULL, ret as recv(),
+// -1 with errno EAGAIN if nothing (or only part of a TLS record) is available
+static int sockRecv(int sockfd, SSL *ssl, char *buf, int bufL) {
+  int recvL = 0, err = 0;
+
+  if (ssl == NULL) return(recv(sockfd, buf, bufL, MSG_DONTWAIT));
+
+  recvL = SSL_read(ssl, buf, bufL);
+  if (recvL > 0) return(recvL);
+
+  err = SSL_get_error(ssl, recvL);
+  if (err == SSL_ERROR_ZERO_RETURN) return(0);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+    errno = EAGAIN;
+  } else {
+    errno = ECONNRESET;
+  }
+  return(-1);
+}
+
+
+// Read from a pooled connection in to it's MLLP decoder, waiting up to waitMs for
+// data. Ret as recv(), -1 with errno ETIMEDOUT if nothing arrived in time
+static int connFill(struct Conn *conn, int waitMs) {
+  char *space = NULL;
+  int spaceL = 0, recvL = 0;
+
+  if (connPending(conn) == 0 && waitSock(conn->sockfd, EPOLLIN, waitMs) <= 0) {
+    errno = ETIMEDOUT;
+    return(-1);
+  }
+
+  space = mllpSpace(&conn->dec, &spaceL);
+  if (space == NULL) {
+    errno = ENOMEM;
+    return(-1);
+  }
+
+  recvL = sockRecv(conn->sockfd, conn->ssl, space, spaceL);
+  if (recvL > 0) mllpFed(&conn->dec, recvL);
+  return(recvL);
+}
+
+
+// Get the seconds to wait for an ACK, from the CLI or global config
+static int ackTimeout(int aTimeout) {
+  int ackT = 3;
+
+  // Get the timeout from global config if it exists
+  if (aTimeout > 0 && aTimeout <= 60) {
+    ackT = aTimeout;
+  } else {
+    if (globalConfig) {
+      if (globalConfig->ackTimeout > 0 && globalConfig->ackTimeout < 100)
+        ackT = globalConfig->ackTimeout;
+
+    } else {
+      ackT = 4; // No valid ACK timeout from CLI or conf, fall back to a value of 4 seconds
+    }
+  }
+  return(ackT);
+}
+
+
+// Send a message and read the start of it's ACK with a single io_uring_enter(), the
+// write, the read in to the connections decoder and the ACK timeout are linked. Ret 0
+// once sent (listenACK() takes the ACK or close from the decoder), -1 if the write
+// failed, -2 if the ACK timed out or -3 if io_uring isn't available
+static int uringSendRecv(struct Conn *conn, char *hl7Msg, size_t msgL, int waitMs) {
+  static char mllpSB[1] = { 11 }, mllpEB[2] = { 28, 13 };
+  struct iovec iov[3] = { { mllpSB, 1 }, { hl7Msg, msgL }, { mllpEB, 2 } };
+  struct msghdr mHdr;
+  struct __kernel_timespec ts;
+  struct io_uring_sqe *sqe[3];
+  struct io_uring_cqe *cqe = NULL;
+  char *space = NULL;
+  int spaceL = 0, res[3] = { -ECANCELED, -ECANCELED, 0 }, done = 0, cancelled = 0;
+
+  if (sendRingOK == 0) sendRingOK = (uringInit(&sendRing, 8) == 0) ? 1 : -1;
+  if (sendRingOK != 1) return(-3);
+
+  space = mllpSpace(&conn->dec, &spaceL);
+  if (space == NULL) return(-1);
+
+  memset(&mHdr, 0, sizeof(mHdr));
+  mHdr.msg_iov = iov;
+  mHdr.msg_iovlen = 3;
+  ts.tv_sec = waitMs / 1000;
+  ts.tv_nsec = (waitMs % 1000) * 1000000L;
+
+  sqe[0] = uringSQE(&sendRing);
+  sqe[1] = uringSQE(&sendRing);
+  sqe[2] = uringSQE(&sendRing);
+  if (sqe[0] == NULL || sqe[1] == NULL || sqe[2] == NULL) return(-3);
+
+  // MSG_WAITALL has io_uring finish a short send itself, a failed send cancels the recv
+  sqe[0]->opcode = IORING_OP_SENDMSG;
+  sqe[0]->fd = conn->sockfd;
+  sqe[0]->addr = (unsigned long) &mHdr;
+  sqe[0]->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe[0]->flags = IOSQE_IO_LINK;
+  sqe[0]->user_data = 0;
+
+  sqe[1]->opcode = IORING_OP_RECV;
+  sqe[1]->fd = conn->sockfd;
+  sqe[1]->addr = (unsigned long) space;
+  sqe[1]->len = spaceL;
+  sqe[1]->flags = IOSQE_IO_LINK;
+  sqe[1]->user_data = 1;
+
+  sqe[2]->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe[2]->addr = (unsigned long) &ts;
+  sqe[2]->len = 1;
+  sqe[2]->user_data = 2;
+
+  // The recv is bounded by it's linked timeout, the send by the write timeout, if that
+  // passes everything on the socket is cancelled (the recv must finish before returning)
+  while (done < 3) {
+    if (uringSubmit(&sendRing, 3 - done, cancelled ? -1 : writeTimeout() + waitMs) < 0)
+      return(-1);
+
+    if (uringCQE(&sendRing) == NULL && cancelled == 0) {
+      sqe[0] = uringSQE(&sendRing);
+      sqe[0]->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe[0]->fd = conn->sockfd;
+      sqe[0]->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe[0]->user_data = 3;
+      cancelled = 1;
+      done--;
+    }
+
+    while ((cqe = uringCQE(&sendRing)) != NULL) {
+      if (cqe->user_data < 3) res[cqe->user_data] = cqe->res;
+      uringSeen(&sendRing);
+      done++;
+    }
+  }
+
+  // errno is only EPIPE or ECONNRESET if none of the message was sent
+  if (cancelled == 1 || res[0] != (int) msgL + 3) {
+    errno = (cancelled == 1) ? ETIMEDOUT : (res[0] < 0) ? -res[0] : EIO;
+    return(-1);
+  }
+  if (res[1] > 0) mllpFed(&conn->dec, res[1]);
+  if (res[1] == -ECANCELED) return(-2);
+  return(0);
+}
+
+
+// Find the ACK code (MSA-1) and acknowledged control ID (MSA-2) in an ACK
+static void getACKFields(char *ack, int ackL, char *aCode, char *cid) {
+  int a = 0, f = 0, c = 0;
+
+  aCode[0] = '\0';
+  cid[0] = '\0';
+
+  // Find the start of the MSA segment
+  for (a = 0; a < ackL - 3; a++) {
+    if ((a == 0 || ack[a - 1] == '\r' || ack[a - 1] == '\n') &&
+        strncmp(ack + a, "MSA|", 4) == 0) break;
+  }
+  if (a >= ackL - 3) return;
+
+  // Copy MSA-1 and MSA-2, stopping at the end of the segment
+  for (a = a + 4; a < ackL && ack[a] != '\r' && ack[a] != '\n' && f < 2; a++) {
+    if (ack[a] == '|') {
+      if (f == 0) aCode[c] = '\0';
+      if (f == 1) cid[c] = '\0';
+      f++;
+      c = 0;
+
+    } else if (f == 0 && c < 2) {
+      aCode[c++] = ack[a];
+      aCode[c] = '\0';
+
+    } else if (f == 1 && c < 200) {
+      cid[c++] = ack[a];
+      cid[c] = '\0';
+    }
+  }
+}
+
+
+// Listen for ACK from server
+static int listenACK(struct Conn *conn, char *res, int aTimeout, int pACK) {
+  char app[12] = "", code[7] = "", aCode[3] = "", cid[201] = "", errStr[46] = "";
+  char *ack = NULL;
+  int recvL = 0, ackL = 0, ackT = ackTimeout(aTimeout);
+  struct timespec end;
+
+  writeLog(LOG_INFO, "Listening for ACK...", 1);
+
+  // Receive until the decoder has a complete frame, however many reads it takes
+  setDeadline(&end, ackT * 1000);
+  while ((ackL = mllpNext(&conn->dec, &ack)) <= 0) {
+    recvL = connFill(conn, msLeft(&end));
+    if (recvL == 0 || (recvL == -1 && errno != EAGAIN && errno != EINTR)) break;
+  }
+
+  if (ackL > 0) {
+    // Find the ack response in MSA.1, bounded as the frame may be any length
+    getACKFields(ack, ackL, aCode, cid);
+
+    // Process the code, either AA, AE, AR, CA, CE or CR.
+    if ((char) aCode[0] == 'A') {
+      strcpy(app, "Application");
+    } else if ((char) aCode[0] == 'C') {
+      strcpy(app, "Commit");
+    }
+
+    if ((char) aCode[1] == 'A') {
+      strcpy(code, "Accept");
+    } else if ((char) aCode[1] == 'E') {
+      strcpy(code, "Error");
+    } else if ((char) aCode[1] == 'R') {
+      strcpy(code, "Reject");
+    }
+
+    sprintf(errStr, "Server ACK response: %s %s (%s)", app, code, aCode);
+    writeLog(LOG_INFO, errStr, 1);
+
+    if (pACK == 1) hl72unix(ack, 1);
+
+    if (res) {
+      aCode[2] = '\0';
+      strcpy(res, aCode);
+    }
+
+  } else if (recvL == 0 || errno == ECONNRESET || errno == EPIPE) {
+    writeLog(LOG_DEBUG, "Server closed the connection before sending an ACK", 0);
+    return(-5);
+
+  } else {
+    handleError(LOG_ERR, "Timeout listening for ACK response", 1, 0, 1);
+    return(-2);
+  }
+  return(ackL);
+}
+
+
+// Set the number of messages that may be sent before waiting for ACKs
+void setSendWindow(int window) {
+  if (window > 0) sendWindow = window;
+}
+
+
+// Match an ACK to the message it acknowledges and record the result, ret -1 if a
+// queued message wasn't accepted and is to be retried, the connection must be dropped
+static int procPipeACK(struct Conn *conn, char *ack, int ackL, int pACK) {
+  struct Pending *pend = conn->pending, *prev = NULL, *next = NULL;
+  char aCode[3] = "", cid[201] = "", errStr[300] = "";
+  double rtt = 0;
+  int isBatchACK = 0, rejected = 0, retry = 0;
+
+  isBatchACK = batchACKFields(ack, ackL, aCode, cid, &rejected);
+  if (isBatchACK == 0) getACKFields(ack, ackL, aCode, cid);
+
+  // Find the pending message by control ID, in order delivery means it's normally first
+  while (pend != NULL && strcmp(pend->cid, cid) != 0) {
+    prev = pend;
+    pend = pend->next;
+  }
+
+  // Fall back to the oldest outstanding message only if the server didn't echo the ID,
+  // an ACK for an ID we're not waiting for (e.g: a late one for a message already timed
+  // out) is discarded rather than releasing another message
+  if (pend == NULL && cid[0] != '\0') {
+    sprintf(errStr, "ACK control ID (%s) does not match a sent message, ignored", cid);
+    writeLog(LOG_WARNING, errStr, 1);
+    return(0);
+
+  } else if (pend == NULL) {
+    writeLog(LOG_WARNING, "ACK has no control ID, matched to the oldest sent message", 1);
+    pend = conn->pending;
+    prev = NULL;
+    if (pend == NULL) return(0);
+  }
+
+  // Remove from the outstanding list
+  if (prev == NULL) {
+    conn->pending = pend->next;
+  } else {
+    prev->next = pend->next;
+  }
+  if (conn->pendTail == pend) conn->pendTail = prev;
+  conn->outstanding--;
+
+  rtt = statsACK(aCode, &pend->sent);
+  fanACK(conn->target, aCode, &pend->sent);
+  sprintf(lastACK, "%s", aCode);
+
+  // Only an accept releases a queued message, queueNak() has rewound the queue if it's
+  // to be retried so the rest of it's messages on this connection mustn't rewind again
+  if (pend->queue != NULL) {
+    if (aCode[1] == 'A') {
+      queueAcked(pend->queue, pend->qOff);
+
+    } else if (queueNak(pend->queue, pend->qOff, aCode) == 1) {
+      retry = 1;
+      for (next = conn->pending; next != NULL; next = next->next) {
+        if (next->queue == pend->queue) next->queue = NULL;
+      }
+    }
+  }
+
+  // A single ACK for a batch accepts or rejects all of it's messages
+  if (pend->batchMsgs > 0) {
+    if (isBatchACK == 0) rejected = (aCode[1] == 'A') ? 0 : pend->batchMsgs;
+    statsBatch(pend->batchMsgs, rejected);
+    sprintf(errStr, "Batch %s of %d messages ACK: %s, %d rejected, round trip %.3f ms",
+                    pend->cid, pend->batchMsgs, aCode, rejected, rtt);
+  } else {
+    sprintf(errStr, "Message %d (%s) ACK: %s, round trip %.3f ms", pend->msgCount,
+                    pend->cid, aCode, rtt);
+  }
+  writeLog(LOG_INFO, errStr, 1);
+
+  if (pACK == 1) {
+    ack[ackL] = '\0';
+    hl72unix(ack, 1);
+    printf("\n");
+  }
+
+  free(pend);
+  return(retry ? -1 : 0);
+}
+
+
+// Read ACKs from a pipelined connection, waiting up to waitMs for data
+// Returns -1 if the connection failed or timed out, otherwise ACKs processed
+static int readPipeACKs(struct Conn *conn, int waitMs, int pACK) {
+  char *ack = NULL;
+  int recvL = 0, ackL = 0, acks = 0;
+
+  recvL = connFill(conn, waitMs);
+  if (recvL == -1 && errno == ETIMEDOUT) return(waitMs > 0 ? -1 : 0);
+  if (recvL == 0 || (recvL == -1 && errno != EAGAIN && errno != EINTR)) return(-1);
+
+  // Process each complete frame, a partial frame is kept for the next read
+  while ((ackL = mllpNext(&conn->dec, &ack)) != 0) {
+    if (ackL < 0) continue;
+    if (procPipeACK(conn, ack, ackL, pACK) < 0) return(-1);
+    acks++;
+  }
+  return(acks);
+}
+
+
+// Get the ACK timeout in milliseconds from the CLI, config or default
+static int pipeTimeout(int aTimeout) {
+  if (aTimeout > 0 && aTimeout <= 60) return(aTimeout * 1000);
+  if (globalConfig) {
+    if (globalConfig->ackTimeout > 0 && globalConfig->ackTimeout < 100)
+      return(globalConfig->ackTimeout * 1000);
+  }
+  return(4000);
+}
+
+
+// Wait for a connections outstanding ACKs to drop to max, ret -1 if connection dropped
+static int waitPipeACKs(struct Conn *conn, int max, int aTimeout, int pACK) {
+  char errStr[330] = "";
+
+  while (conn->outstanding > max) {
+    if (readPipeACKs(conn, pipeTimeout(aTimeout), pACK) < 0) {
+      sprintf(errStr, "Timeout or connection failure waiting for ACKs from %s:%s",
+                      conn->sIP, conn->sPort);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      dropConn(conn);
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+
+// Housekeeping for threads that send between other work, such as listeners forwarding
+// to a queue. Processes any ACKs that have arrived without blocking, drops connections
+// where the oldest outstanding message has waited longer than the ACK timeout (which
+// rewinds any queued messages) then closes idle connections
+void pollConnPool(int aTimeout) {
+  struct Conn *conn = conns, *next = NULL;
+  struct timespec now;
+  char errStr[330] = "";
+  long int waitedMs = 0;
+
+  while (conn != NULL) {
+    next = conn->next;
+    if (conn->outstanding > 0) {
+      if (readPipeACKs(conn, 0, 0) < 0) {
+        dropConn(conn);
+
+      } else if (conn->pending != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        waitedMs = (now.tv_sec - conn->pending->sent.tv_sec) * 1000 +
+                   (now.tv_nsec - conn->pending->sent.tv_nsec) / 1000000;
+
+        if (waitedMs >= pipeTimeout(aTimeout)) {
+          sprintf(errStr, "Timeout waiting for ACKs from %s:%s", conn->sIP, conn->sPort);
+          handleError(LOG_ERR, errStr, -1, 0, 1);
+          dropConn(conn);
+        }
+      }
+    }
+    conn = next;
+  }
+  expireConnPool();
+}
+
+
+// Send a message without waiting for it's ACK, waiting only when the window is full
+// Messages from a store and forward queue are only tried once, the queue resends
+// them in order when the connection fails
+static int sendPipelined(char *sIP, char *sPort, char *hl7Msg, int msgCount,
+                         int aTimeout, int pACK, struct FanTarget *target,
+                         struct OutQueue *queue, long int qOff) {
+
+  struct Conn *conn = NULL;
+  struct Pending *pend = NULL;
+  struct timespec wStart;
+  int isNew = 0, tries = 0, msgL = strlen(hl7Msg), window = sendWindow, batchMsgs = 0, acks = 0;
+  char cid[201] = "";
+
+  // Record the control ID (the batch control ID for a batch), used to match the ACK
+  if (isBatch(hl7Msg) == 1) {
+    batchMsgs = batchCount(hl7Msg, cid);
+  } else {
+    // Truncated to fit, as the ACK's MSA-2 is when it's matched
+    batchField(hl7Msg, "MSH|", 10, cid, sizeof(cid));
+  }
+  if (queue != NULL && window < QUEUE_WINDOW) window = QUEUE_WINDOW;
+
+  while (tries < (queue == NULL ? 2 : 1)) {
+    tries++;
+    conn = getConn(sIP, sPort, &isNew);
+    if (conn == NULL) return(-4);
+    conn->target = target;
+
+    // Make room in the window before sending
+    if (waitPipeACKs(conn, window - 1, aTimeout, pACK) < 0) {
+      conn = NULL;
+      continue;
+    }
+
+    // Servers that close after each ACK may have closed while we waited for it
+    if (isNew == 0 && conn->outstanding == 0 && connAlive(conn) == 0) {
+      dropConn(conn);
+      conn = NULL;
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wStart);
+    if (writeMLLP(conn->sockfd, conn->ssl, hl7Msg, msgL) == 0) {
+      statsWrite(&wStart);
+      break;
+    }
+    dropConn(conn);
+    conn = NULL;
+    if (isNew == 1) break;
+  }
+
+  if (conn == NULL) {
+    handleError(LOG_ERR, "Could not send data packet to server", -1, 0, 1);
+    return(-1);
+  }
+
+  // Add the message to the end of the outstanding list
+  pend = calloc(1, sizeof(struct Pending));
+  if (pend == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for a pipelined message", -1, 0, 1);
+    return(-1);
+  }
+  sprintf(pend->cid, "%s", cid);
+  pend->msgCount = msgCount;
+  pend->sent = wStart;
+  pend->queue = queue;
+  pend->qOff = qOff;
+  pend->batchMsgs = batchMsgs;
+
+  if (conn->pendTail == NULL) {
+    conn->pending = pend;
+  } else {
+    conn->pendTail->next = pend;
+  }
+  conn->pendTail = pend;
+  conn->outstanding++;
+  if (queue != NULL) queueSent(queue, qOff);
+  statsSent(msgL + 3);
+  fanSent(target, msgL + 3);
+
+  // Collect any ACKs that have already arrived without blocking, a queued message
+  // that's to be retried drops the connection so the queue is resent from it
+  while (conn->outstanding > 0 && (acks = readPipeACKs(conn, 0, pACK)) > 0);
+  if (acks < 0) dropConn(conn);
+
+  return(0);
+}
+
+
+// Sleep until due, processing pipelined ACKs as they arrive so their latency isn't
+// inflated by the time spent waiting for the next scheduled send
+void waitACKsUntil(struct timespec *due, int pACK) {
+  struct epoll_event evs[16];
+  struct Conn *conn, *next;
+  int evCount = 0, e = 0, armed = 0;
+
+  while (msLeft(due) > 0) {
+    // ACKs already read in to TLS buffers won't wake epoll, process them first
+    for (conn = conns; conn != NULL; conn = next) {
+      next = conn->next;
+      if (conn->outstanding > 0 && connPending(conn) == 1 &&
+          readPipeACKs(conn, 0, pACK) < 0) dropConn(conn);
+    }
+
+    armed = 0;
+    for (conn = conns; conn != NULL; conn = conn->next) {
+      if (conn->outstanding > 0 && armSock(conn->sockfd, EPOLLIN) == 0) armed++;
+    }
+    if (armed == 0) break;
+
+    evCount = epoll_wait(epFd, evs, 16, msLeft(due));
+    if (evCount == -1 && errno != EINTR) break;
+
+    for (e = 0; e < evCount; e++) {
+      for (conn = conns; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->sockfd == evs[e].data.fd && conn->outstanding > 0) {
+          if (readPipeACKs(conn, 0, pACK) < 0) dropConn(conn);
+          break;
+        }
+      }
+    }
+  }
+
+  // Finish with a sleep for sub millisecond accuracy
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, due, NULL) == EINTR);
+}
+
+
+// Send this threads part built batch, ret as sendPacket() or 0 if there's no batch
+static int sendBatch(int aTimeout, int pACK) {
+  char *batch = NULL, *bIP = NULL, *bPort = NULL;
+  int msgCount = 0;
+
+  batch = batchTake(&bIP, &bPort, &msgCount);
+  if (batch == NULL) return(0);
+  return(sendPacket(bIP, bPort, batch, NULL, msgCount, 0, 0, aTimeout, pACK));
+}
+
+
+// Wait for all outstanding pipelined ACKs
+void flushACKs(int aTimeout, int pACK) {
+  struct Conn *conn = conns, *next;
+
+  sendBatch(aTimeout, pACK);
+  conn = conns;
+
+  while (conn != NULL) {
+    next = conn->next;
+    waitPipeACKs(conn, 0, aTimeout, pACK);
+    conn = next;
+  }
+}
+
+
+// Send a queues unsent messages, pipelined, unless it's backing off or another thread
+// has messages in flight, ret messages sent or -1 if the server failed
+static int drainQueue(struct OutQueue *queue, int aTimeout, int pACK,
+                      struct FanTarget *target) {
+  char *sIP = NULL, *sPort = NULL, *msg = NULL;
+  long int qOff = 0;
+  int sent = 0;
+
+  if (queueReady(queue) == 0 || queueClaim(queue) == 0) return(0);
+  queueTarget(queue, &sIP, &sPort);
+
+  // Only dropConn() rewinds, when a connection closes with messages in flight, and it
+  // backs off as it does. A failure that didn't lose any messages just backs off
+  while (queueReady(queue) == 1 && queueNext(queue, &msg, &qOff) == 1) {
+    if (sendPipelined(sIP, sPort, msg, 0, aTimeout, pACK, target, queue, qOff) < 0) {
+      if (queueReady(queue) == 1) queueFailed(queue);
+      return(-1);
+    }
+    sent++;
+  }
+  return(sent);
+}
+
+
+// Journal a message then send as much of the servers queue as it will take
+// Returns 0 if queued, -1 on error or 1 if the journal isn't available (send directly)
+static int queueSend(char *sIP, char *sPort, char *hl7Msg, char *resStr, int aTimeout,
+                     int pACK, struct FanTarget *target) {
+  struct OutQueue *queue = getQueue(sIP, sPort);
+  struct Conn *conn = NULL;
+  int rv = 0;
+
+  if (queue == NULL) return(1);
+  if (queuePush(queue, hl7Msg, strlen(hl7Msg)) != 0) return(-1);
+  lastACK[0] = '\0';
+
+  // QD = queued for a later retry, -- = sent and the ACK will be handled later
+  if (drainQueue(queue, aTimeout, pACK, target) < 0 || queueReady(queue) == 0) {
+    if (resStr != NULL) sprintf(resStr, "%s", "QD");
+
+  // The web interface sends one message at a time and shows it's ACK, as the message is
+  // the last sent it's ACK is the last one read once the ACKs have been waited for. If
+  // none arrived (another thread is sending the queue, or it's to be retried) it's
+  // still queued
+  } else if (resStr != NULL && webRunning == 1 && sendWindow == 1) {
+    for (conn = conns; conn != NULL; conn = conn->next) {
+      if (strcmp(conn->sIP, sIP) == 0 && strcmp(conn->sPort, sPort) == 0) {
+        rv = waitPipeACKs(conn, 0, aTimeout, pACK);
+        break;
+      }
+    }
+    sprintf(resStr, "%s", (rv == 0 && lastACK[0] != '\0') ? lastACK : "QD");
+
+  } else {
+    if (resStr != NULL) sprintf(resStr, "%s", "--");
+  }
+
+  // A message is only reported as queued once it's journal has been synced
+  if (resStr != NULL && strcmp(resStr, "QD") == 0) queueWaitSync(queue);
+  return(0);
+}
+
+
+// Send queued messages to every server that isn't backing off, ret messages still queued
+long int drainQueues(int aTimeout, int pACK) {
+  struct OutQueue *queue = NULL;
+  long int depth = 0;
+
+  while ((queue = nextQueue(queue)) != NULL) {
+    if (queueDepth(queue) > 0) drainQueue(queue, aTimeout, pACK, NULL);
+    depth = depth + queueDepth(queue);
+  }
+  return(depth);
+}
+
+
+// Drain the queues until they're empty or every server with messages is backing off,
+// then sync the journals, ret the number of messages left queued
+long int flushQueues(int aTimeout, int pACK) {
+  struct OutQueue *queue = NULL;
+  char *sIP = NULL, *sPort = NULL;
+  char errStr[330] = "";
+  long int depth = 0;
+  int ready = 1;
+
+  while (ready == 1 && stopRequested() == 0) {
+    drainQueues(aTimeout, pACK);
+    flushACKs(aTimeout, pACK);
+
+    depth = 0;
+    ready = 0;
+    while ((queue = nextQueue(queue)) != NULL) {
+      depth = depth + queueDepth(queue);
+      if (queueDepth(queue) > 0 && queueReady(queue) == 1) ready = 1;
+    }
+  }
+  syncQueues();
+
+  while ((queue = nextQueue(queue)) != NULL) {
+    if (queueDepth(queue) == 0) continue;
+    queueTarget(queue, &sIP, &sPort);
+    sprintf(errStr, "%ld messages left queued for %s:%s", queueDepth(queue), sIP, sPort);
+    writeLog(LOG_NOTICE, errStr, 1);
+  }
+  return(depth);
+}
+
+
+// Load the servers in a group from servers.hhl7 and send every message to all of them,
+// servers without a port use defPort, ret 0 on success
+int setFanOut(char *group, char *defPort) {
+  struct json_object *svrsObj = NULL, *svrArray = NULL, *svrObj = NULL, *grpArray = NULL;
+  struct json_object *nameObj = NULL, *addrObj = NULL, *portObj = NULL;
+  struct FanTarget *target = NULL, *tail = NULL;
+  int sCount = 0, s = 0, gCount = 0, g = 0, tCount = 0;
+  char svrsFile[34] = "", errStr[600] = "";
+
+  // Define server file location
+  if (isDaemon == 1) {
+    sprintf(svrsFile, "%s", "/usr/local/hhl7/conf/servers.hhl7");
+  } else {
+    sprintf(svrsFile, "%s", "./conf/servers.hhl7");
+  }
+
+  svrsObj = json_object_from_file(svrsFile);
+  if (svrsObj == NULL) {
+    handleError(LOG_ERR, "Failed to read server config file", -1, 0, 1);
+    return(1);
+  }
+
+  json_object_object_get_ex(svrsObj, "servers", &svrArray);
+  if (svrArray == NULL) {
+    handleError(LOG_ERR, "Failed to get server object, server file corrupt?", -1, 0, 1);
+    json_object_put(svrsObj);
+    return(1);
+  }
+
+  sCount = json_object_array_length(svrArray);
+  for (s = 0; s < sCount; s++) {
+    svrObj = json_object_array_get_idx(svrArray, s);
+    nameObj = json_object_object_get(svrObj, "displayName");
+    addrObj = json_object_object_get(svrObj, "address");
+    portObj = json_object_object_get(svrObj, "port");
+    grpArray = json_object_object_get(svrObj, "groups");
+    if (nameObj == NULL || addrObj == NULL || grpArray == NULL) continue;
+
+    // Check if this server is a member of the group
+    gCount = json_object_array_length(grpArray);
+    for (g = 0; g < gCount; g++) {
+      if (strcmp(json_object_get_string(json_object_array_get_idx(grpArray, g)), group) == 0)
+        break;
+    }
+    if (g == gCount) continue;
+
+    if (strlen(json_object_get_string(addrObj)) > 255 ||
+        (portObj != NULL && validPort((char *) json_object_get_string(portObj)) > 0)) {
+      sprintf(errStr, "Invalid address or port for server %.255s, skipping",
+              json_object_get_string(nameObj));
+      handleError(LOG_WARNING, errStr, -1, 0, 1);
+      continue;
+    }
+
+    target = calloc(1, sizeof(struct FanTarget));
+    if (target == NULL) {
+      handleError(LOG_ERR, "Could not allocate memory for a fan-out server", -1, 0, 1);
+      break;
+    }
+    snprintf(target->name, sizeof(target->name), "%s", json_object_get_string(nameObj));
+    sprintf(target->sIP, "%s", json_object_get_string(addrObj));
+    sprintf(target->sPort, "%s", portObj ? json_object_get_string(portObj) : defPort);
+    pthread_mutex_init(&target->lock, NULL);
+
+    // Keep the servers file order for the summary
+    if (tail == NULL) {
+      fanTargets = target;
+    } else {
+      tail->next = target;
+    }
+    tail = target;
+    tCount++;
+
+    sprintf(errStr, "Fanning out to %s (%s:%s)", target->name, target->sIP, target->sPort);
+    writeLog(LOG_INFO, errStr, 1);
+  }
+
+  json_object_put(svrsObj);
+
+  if (tCount == 0) {
+    sprintf(errStr, "No servers found in group: %.255s", group);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(1);
+  }
+  return(0);
+}
+
+
+// Print the result and ACK latency summary for each fan-out server
+void printFanOutStats() {
+  struct FanTarget *target = fanTargets;
+
+  while (target != NULL) {
+    printTargetStats(target->name, &target->stats, target == fanTargets);
+    target = target->next;
+  }
+}
+
+
+// Find the next message in a mapped file, either an MLLP frame or a run of lines
+// starting with MSH|, ret a pointer to the message start or NULL at end of file
+static char *nextFileMsg(char *pos, char *end, char **msgEnd, char **next) {
+  char *mshPos = NULL;
+
+  // Skip blank lines and MLLP trailers left between messages
+  while (pos < end && (*pos == '\r' || *pos == '\n' || *pos == ' ' || *pos == '\t' ||
+                       *pos == 28)) pos++;
+  if (pos >= end) return(NULL);
+
+  // MLLP framed message, ends at the 0x1C trailer
+  if (*pos == 11) {
+    pos++;
+    *msgEnd = memchr(pos, 28, end - pos);
+    if (*msgEnd == NULL) *msgEnd = end;
+    *next = *msgEnd;
+    return(pos);
+  }
+
+  // Unwrapped batch, sent whole, ends with the FTS (or BTS if there's no FHS) line
+  if (isBatch(pos) == 1) {
+    mshPos = pos;
+    while ((mshPos = memmem(mshPos + 1, end - mshPos - 1, *pos == 'F' ? "FTS|" : "BTS|", 4))
+           != NULL) {
+      if (mshPos[-1] == '\r' || mshPos[-1] == '\n') break;
+    }
+    if (mshPos == NULL) {
+      *msgEnd = end;
+    } else {
+      *msgEnd = memchr(mshPos, '\n', end - mshPos);
+      if (*msgEnd == NULL) *msgEnd = memchr(mshPos, '\r', end - mshPos);
+      if (*msgEnd == NULL) *msgEnd = end;
+    }
+    *next = *msgEnd;
+    return(pos);
+  }
+
+  // Unwrapped message, ends at the next line starting with MSH|
+  mshPos = pos + 1;
+  while ((mshPos = memmem(mshPos, end - mshPos, "MSH|", 4)) != NULL) {
+    if (mshPos[-1] == '\r' || mshPos[-1] == '\n' || mshPos[-1] == 11) break;
+    mshPos++;
+  }
+  *msgEnd = (mshPos == NULL) ? end : mshPos;
+  if (mshPos != NULL && mshPos[-1] == 11) (*msgEnd)--;
+  *next = *msgEnd;
+  return(pos);
+}
+
+
+// Copy a message from a mapped file converting line endings to \r, ret the length
+static long copyFileMsg(char *dest, char *src, long srcL) {
+  long s = 0, d = 0;
+
+  for (s = 0; s < srcL; s++) {
+    if (src[s] == '\r' || src[s] == '\n') {
+      // Collapse \r\n and blank lines to a single segment terminator
+      if (d > 0 && dest[d - 1] != '\r') dest[d++] = '\r';
+    } else if (src[s] != 11 && src[s] != 28) {
+      dest[d++] = src[s];
+    }
+  }
+  if (d > 0 && dest[d - 1] != '\r') dest[d++] = '\r';
+  dest[d] = '\0';
+  return(d);
+}
+
+
+// Stream a file of HL7 messages to the server, ret the number of messages sent
+// The file is mapped rather than read so only the current message is held in
+// memory and pages already sent are dropped as the file is walked
+long sendFile(char *sIP, char *sPort, FILE *fp, long int fileSize,
+              int aTimeout, int pACK) {
+
+  char *fileData = NULL, *pos = NULL, *end = NULL, *msg = NULL, *msgEnd = NULL;
+  char *msgBuf = NULL, resStr[3] = "", errStr[100] = "";
+  long msgBufS = 0, msgCount = 0, pageS = sysconf(_SC_PAGESIZE), dropped = 0, doneL = 0;
+  time_t lastProg = time(NULL);
+
+  if (fileSize <= 0) {
+    handleError(LOG_ERR, "Data file to send is empty", -1, 0, 1);
+    fclose(fp);
+    return(0);
+  }
+
+  fileData = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  fclose(fp);
+  if (fileData == MAP_FAILED) {
+    handleError(LOG_ERR, "Could not map data file to send", -1, 0, 1);
+    return(0);
+  }
+  madvise(fileData, fileSize, MADV_SEQUENTIAL);
+
+  pos = fileData;
+  end = fileData + fileSize;
+  while (stopRequested() == 0 && (msg = nextFileMsg(pos, end, &msgEnd, &pos)) != NULL) {
+    // Grow the message buffer to fit the largest message seen so far
+    if (msgEnd - msg + 2 > msgBufS) {
+      msgBufS = msgEnd - msg + 2;
+      free(msgBuf);
+      msgBuf = malloc(msgBufS);
+      if (msgBuf == NULL) {
+        handleError(LOG_ERR, "Could not allocate memory for a message in the data file", -1, 0, 1);
+        break;
+      }
+    }
+
+    if (copyFileMsg(msgBuf, msg, msgEnd - msg) > 0) {
+      msgCount++;
+      sendPacket(sIP, sPort, msgBuf, resStr, msgCount, 0, 0, aTimeout, pACK);
+    }
+
+    // Release pages that have been sent, a page at a time in 16MB steps
+    doneL = ((pos - fileData) / pageS) * pageS;
+    if (doneL - dropped >= 16777216) {
+      madvise(fileData + dropped, doneL - dropped, MADV_DONTNEED);
+      dropped = doneL;
+    }
+
+    // Report progress once a second
+    if (time(NULL) != lastProg) {
+      lastProg = time(NULL);
+      sprintf(errStr, "Sent %ld messages, %.1f of %.1f MB (%.0f%%)", msgCount,
+              (pos - fileData) / 1048576.0, fileSize / 1048576.0,
+              100.0 * (pos - fileData) / fileSize);
+      writeLog(LOG_NOTICE, errStr, 1);
+    }
+  }
+
+  free(msgBuf);
+  munmap(fileData, fileSize);
+  return(msgCount);
+}
+
+
+// Send a single HL7 message over a socket
+int sendPacket(char *sIP, char *sPort, char *hl7Msg, char *resStr, int msgCount,
+                  int noSend, int fShowTemplate, int aTimeout, int pACK) {
+
+  struct Conn *conn = NULL;
+  struct FanTarget *target = NULL;
+  struct timespec sent;
+  int retVal = 0, isNew = 0, tries = 0, msgL = 0, uRv = 0;
+  char errStr[43] = "", aCode[3] = "";
+
+  // Print the HL7 message if requested
+  if (fShowTemplate == 1) {
+    hl72unix(hl7Msg, 1);
+  }
+
+  if (noSend == 0) {
+    // Send the data file to the server
+    sprintf(errStr, "Sending HL7 message %d to server", msgCount);
+    writeLog(LOG_INFO, errStr, 1);
+
+    // Set the default response code to EE
+    if (resStr != NULL) sprintf(resStr, "%s", "EE");
+
+    // Add the message to this threads batch, sending the batch once it's full or
+    // before starting a batch for a different server
+    if (batchSize() > 1 && isBatch(hl7Msg) == 0) {
+      if (resStr != NULL) sprintf(resStr, "%s", "--");
+      if (batchMatch(sIP, sPort) == 0) retVal = sendBatch(aTimeout, pACK);
+      if (batchAdd(sIP, sPort, hl7Msg) >= batchSize()) retVal = sendBatch(aTimeout, pACK);
+      return(retVal);
+    }
+
+    // Store and forward, journal the message before sending it
+    if (queueEnabled() == 1 && fanTargets == NULL) {
+      retVal = queueSend(sIP, sPort, hl7Msg, resStr, aTimeout, pACK, NULL);
+      if (retVal < 0) statsFailed(1);
+      if (retVal <= 0) return(retVal);
+      retVal = 0;
+    }
+
+    // Fan out to every server in the group, each over it's own connection, the
+    // message is written to all of them before waiting on any ACK
+    if (fanTargets != NULL) {
+      if (resStr != NULL) sprintf(resStr, "%s", "--");
+      for (target = fanTargets; target != NULL; target = target->next) {
+        if (queueEnabled() == 1 &&
+            queueSend(target->sIP, target->sPort, hl7Msg, NULL, aTimeout, pACK, target) == 0)
+          continue;
+
+        if (sendPipelined(target->sIP, target->sPort, hl7Msg, msgCount, aTimeout, pACK,
+                          target, NULL, 0) < 0) {
+          statsFailed(1);
+          fanFailed(target, 1);
+          retVal = -1;
+        }
+      }
+      return(retVal);
+    }
+
+    // Pipelined sends are ACKed later by readPipeACKs()/flushACKs(), batches are always
+    // pipelined as their ACK may be larger than listenACK() reads
+    if (sendWindow > 1 || isBatch(hl7Msg) == 1) {
+      if (resStr != NULL) sprintf(resStr, "%s", "--");
+      retVal = sendPipelined(sIP, sPort, hl7Msg, msgCount, aTimeout, pACK, NULL, NULL, 0);
+      if (retVal < 0) statsFailed(1);
+      return(retVal);
+    }
+
+    msgL = strlen(hl7Msg);
+
+    // Send over a pooled connection, if a reused connection has been closed by
+    // the server before any of the message was written retry once over a fresh
+    // connection. Once it's written it's never resent, the server may have it
+    while (tries < 2) {
+      tries++;
+      conn = getConn(sIP, sPort, &isNew);
+      if (conn == NULL) {
+        retVal = -4;
+        break;
+      }
+
+      // Send the message to the server, with io_uring the ACK read is submitted with it
+      clock_gettime(CLOCK_MONOTONIC, &sent);
+      uRv = -3;
+      if (uringEnabled() == 1 && conn->ssl == NULL)
+        uRv = uringSendRecv(conn, hl7Msg, msgL, ackTimeout(aTimeout) * 1000);
+
+      if (uRv == -1 || (uRv == -3 && writeMLLP(conn->sockfd, conn->ssl, hl7Msg, msgL) == -1)) {
+        dropConn(conn);
+        if (isNew == 0 && (errno == EPIPE || errno == ECONNRESET)) continue;
+        handleError(LOG_ERR, "Could not send data packet to server", -1, 0, 1);
+        retVal = -1;
+        break;
+      }
+      statsWrite(&sent);
+
+      if (uRv == -2) {
+        handleError(LOG_ERR, "Timeout listening for ACK response", 1, 0, 1);
+        retVal = -2;
+      } else {
+        retVal = listenACK(conn, aCode, aTimeout, pACK);
+      }
+      if (retVal >= 0) {
+        statsSent(msgL + 3);
+        statsACK(aCode, &sent);
+        if (resStr != NULL) sprintf(resStr, "%s", aCode);
+      }
+
+      if (retVal == -5) {
+        dropConn(conn);
+        handleError(LOG_ERR, "Server closed the connection without an ACK", -1, 0, 1);
+        retVal = -1;
+
+      } else if (retVal < 0) {
+        dropConn(conn);
+
+      } else if (connIdleTime() == 0) {
+        dropConn(conn);
+
+      }
+      break;
+    }
+
+    if (retVal < 0) statsFailed(1);
+  }
+
+  return(retVal);
+}
+
+
+// Split a packet in to individual messages
+int splitPacket(char *sIP, char *sPort, char *hl7Msg, char *resStr, char **resList,
+                int noSend, int fShowTemplate, int aTimeout, int pACK) {
+
+  char *curMsg = hl7Msg, *nextMsg = NULL;
+  char newMsgStr[6] = "MSH|^";
+  int rv = 0, msgCount = 0, lastMsg = 0, reqS = 0, rlSize = 301;
+  long unsigned int hl7MsgS = strlen(hl7Msg);
+
+  // Check if there's more than 1 message, if not send the full packet
+  if (hl7MsgS >= strlen(newMsgStr)) nextMsg = strstr(hl7Msg + 1, newMsgStr);
+  if (nextMsg == NULL) {
+    msgCount++;
+    rv = sendPacket(sIP, sPort, hl7Msg, resStr, msgCount, noSend,
+                       fShowTemplate, aTimeout, pACK);
+
+    if (resList != NULL) strcat(*resList, resStr);
+
+  // If there's multiple messages, split and send each individually
+  } else {
+    char nextChar;
+
+    // Loop through each message in the template
+    while (nextMsg != NULL) {
+      msgCount++;
+      hl7MsgS = (int) (nextMsg - curMsg) + 1;
+
+      // Send each sub message in place, terminating it at the next message
+      nextChar = *nextMsg;
+      *nextMsg = '\0';
+
+      // TODO - take the worst return code!
+      rv = sendPacket(sIP, sPort, curMsg, resStr, msgCount, noSend,
                          fShowTemplate, 0, pACK);
+      *nextMsg = nextChar;
 
       if (fShowTemplate == 1) printf("\n");
 
@@ -538,6 +2219,107 @@ void sendTemp(char *sIP, char *sPort, char *tName, int noSend, int fShowTemplate
 }
 
 
+// Get the time (seconds from the start of a run) that send number sNum is due
+static double schedTime(struct SendJob *job, long int sNum) {
+  double r0 = job->rate, r1 = job->rampRate, rT = job->rampSecs, a = 0, rampN = 0;
+
+  if (rT <= 0 || r1 <= 0) return(sNum / r0);
+
+  // Linear ramp from r0 to r1, sends due by time t: r0*t + (r1-r0)*t^2/(2*rT)
+  rampN = (r0 + r1) / 2 * rT;
+  if (sNum > rampN) return(rT + (sNum - rampN) / r1);
+
+  a = (r1 - r0) / (2 * rT);
+  if (fabs(a) < 1e-12) return(sNum / r0);
+  return((-r0 + sqrt(r0 * r0 + 4 * a * sNum)) / (2 * a));
+}
+
+
+// Sleep until send number sNum is due and record how far behind schedule we are
+static void waitSchedule(struct SendJob *job, long int sNum, time_t *lastWarn) {
+  struct timespec due, now;
+  double dueT = schedTime(job, sNum), lag = 0;
+  char errStr[80] = "";
+
+  due.tv_sec = job->start.tv_sec + (time_t) dueT;
+  due.tv_nsec = job->start.tv_nsec + (long) ((dueT - (time_t) dueT) * 1000000000);
+  if (due.tv_nsec >= 1000000000) {
+    due.tv_sec++;
+    due.tv_nsec = due.tv_nsec - 1000000000;
+  }
+
+  waitACKsUntil(&due, job->pACK);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  lag = (now.tv_sec - due.tv_sec) * 1000.0 + (now.tv_nsec - due.tv_nsec) / 1000000.0;
+  statsLag(lag);
+
+  // Warn at most once a second per worker that we can't keep up with the schedule
+  if (lag > 1 && now.tv_sec != *lastWarn) {
+    *lastWarn = now.tv_sec;
+    sprintf(errStr, "Falling behind schedule, send %ld is %.3f ms late", sNum + 1, lag);
+    writeLog(LOG_WARNING, errStr, 1);
+  }
+}
+
+
+// Send worker thread, sends templates until the shared send count is reached
+static void *sendWorker(void *arg) {
+  struct SendJob *job = arg;
+  long int sNum = 0;
+  time_t lastWarn = 0;
+
+  seedRand(__atomic_add_fetch(&job->seed, 7919, __ATOMIC_RELAXED));
+
+  while (stopRequested() == 0 &&
+         (sNum = __atomic_fetch_add(&job->nextSend, 1, __ATOMIC_RELAXED)) < job->sCount) {
+    if (job->rate > 0) waitSchedule(job, sNum, &lastWarn);
+
+    sendTemp(job->sIP, job->sPort, job->tName, job->noSend, job->fShowTemplate,
+             job->optind, job->argc, job->argv, NULL, job->aTimeout, job->pACK);
+    if (job->sSleep > 0 && job->rate <= 0) usleep(job->sSleep);
+  }
+
+  // Collect outstanding ACKs, add this workers stats to the totals & close it's pool
+  flushACKs(job->aTimeout, job->pACK);
+  mergeSendStats();
+  closeConnPool();
+  return(NULL);
+}
+
+
+// Send a template sCount times shared between worker threads, each with it's own
+// connection. If rate > 0 sends are issued on an open loop schedule of rate msg/s,
+// optionally ramping to rampRate msg/s over rampSecs seconds.
+void sendTempWorkers(char *sIP, char *sPort, char *tName, int noSend, int fShowTemplate,
+                     int optind, int argc, char *argv[], int aTimeout, int pACK,
+                     int sCount, int sSleep, int workers, double rate, double rampRate,
+                     double rampSecs) {
+
+  struct SendJob job = { sIP, sPort, tName, noSend, fShowTemplate, optind, argc, argv,
+                         aTimeout, pACK, sCount, sSleep, 0, (unsigned int) time(NULL),
+                         rate, rampRate, rampSecs, { 0, 0 } };
+  pthread_t threads[workers];
+  int w = 0, started = 0;
+  char errStr[64] = "";
+
+  clock_gettime(CLOCK_MONOTONIC, &job.start);
+  for (w = 0; w < workers; w++) {
+    if (pthread_create(&threads[w], NULL, sendWorker, &job) != 0) {
+      sprintf(errStr, "Failed to start send worker %d", w + 1);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      break;
+    }
+    started++;
+  }
+
+  // Fall back to sending from this thread if no workers could be started
+  if (started == 0) sendWorker(&job);
+
+  for (w = 0; w < started; w++) pthread_join(threads[w], NULL);
+}
+
+
 // Get a random resCode based on command line arguments
 static int getResCode(int resType, char *ackList, char *resCode) {
   int resRand = 0, listCount = 0;
@@ -599,36 +2381,166 @@ static int getResCode(int resType, char *ackList, char *resCode) {
 }
 
 
-// Send and ACK after receiving a message
-int sendACK(int sessfd, char *hl7msg, int resType, char *ackList) {
-  char dt[26] = "", cid[201] = "", errStr[256] = "";
-  char ackBuf[1024] = "", resCode[3] = "AA";
-  char *resCodeP = resCode;
-  int writeL = 0;
+// Build the ACK for a received batch, a batch holding an ACK for each message that
+// wasn't accepted, ret the ACK (to be freed) or NULL on error
+static char *batchACK(char *batch, int resType, char *ackList, int *msgs, int *rejected,
+                      char *batchCode) {
+  char id[17] = "", refID[201] = "", cid[201] = "", resCode[3] = "";
+  char *ack = NULL, *msg = NULL, *msgEnd = NULL, *pos = batch, *dt = ackTime(), endChar;
+  int ackS = 1024, ackL = 0, acks = 0, msgAckL = 0, isFile = (strncmp(batch, "FHS|", 4) == 0);
+
+  *msgs = 0;
+  *rejected = 0;
+  sprintf(batchCode, "%s", "AA");
+
+  ack = malloc(ackS);
+  if (ack == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for a batch ACK", -1, 0, 1);
+    return(NULL);
+  }
+
+  // Headers refer to the received file and batch control IDs
+  if (isFile == 1) {
+    batchField(batch, "FHS|", 11, refID, 201);
+    batchID(id, 'F');
+    ackL += sprintf(ack + ackL, "FHS|^~\\&|HHL7||||%s||||%s|%s\r", dt, id, refID);
+  }
+  batchField(batch, "BHS|", 11, refID, 201);
+  batchID(id, 'B');
+  ackL += sprintf(ack + ackL, "BHS|^~\\&|HHL7||||%s||||%s|%s\r", dt, id, refID);
+
+  while ((msg = batchNext(pos, &msgEnd)) != NULL) {
+    pos = msgEnd;
+    (*msgs)++;
+
+    sprintf(resCode, "%s", "AA");
+    if (resType > 0) getResCode(resType, ackList, resCode);
+    statsACKSent(resCode);
+    if (resCode[1] == 'A') continue;
+
+    // Build the ACK from this message only, growing the batch ACK until it fits
+    endChar = *msgEnd;
+    *msgEnd = '\0';
+    if (ackL + 1024 > ackS) ack = dblBuf(ack, &ackS, ackL + 1024);
+    while ((msgAckL = ackBuild(msg, resCode, cid, ack + ackL, ackS - ackL - 128)) < 0)
+      ack = dblBuf(ack, &ackS, ackS * 2);
+    *msgEnd = endChar;
+
+    ackL += msgAckL;
+    if (*rejected == 0) sprintf(batchCode, "%s", resCode);
+    (*rejected)++;
+    acks++;
+  }
 
-  // Get current time and control ID of incoming message
-  timeNow(dt, 0); 
-  getHL7Field(hl7msg, "MSH", 10, cid);
-  if (strlen(cid) == 0) sprintf(cid, "%s", "<UNKNOWN>");
+  if (ackL + 128 > ackS) ack = dblBuf(ack, &ackS, ackL + 128);
+  ackL += sprintf(ack + ackL, "BTS|%d|%d messages received\r", acks, *msgs);
+  if (isFile == 1) ackL += sprintf(ack + ackL, "FTS|1\r");
+  return(ack);
+}
 
-  // Create the resCode if required
-  if (resType > 0) getResCode(resType, ackList, resCodeP);
 
-  sprintf(ackBuf, "%c%s%s%s%s%s%s%s%s%s%c%c", 0x0B, "MSH|^~\\&|||||", dt, "||ACK|", cid,
-                                              "|P|2.4\rMSA|", resCodeP, "|", cid, "|OK\r",
-                                              0x1C, 0x0D);
+// Add an ACK in it's MLLP frame to the ACKs waiting to be sent on an io_uring session,
+// ret 0 or -1 on error
+static int corkACK(struct Session *sess, char *ack, int ackL) {
+  int c = sess->ackCur, newS = 0;
+  char *newBuf = NULL, errStr[100] = "";
 
-  if ((writeL = write(sessfd, ackBuf, strlen(ackBuf))) == -1) {
-    close(sessfd);
+  if (sess->ackLen[c] + ackL + 3 > sess->ackSize[c]) {
+    if (sess->ackLen[c] + ackL + 3 > SESS_ACKMAX) {
+      sprintf(errStr, "Sending server %s is not reading it's ACKs, dropping the connection",
+              sess->peer);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      return(-1);
+    }
+
+    newS = (sess->ackLen[c] + ackL + 3) * 2;
+    if (newS < 16384) newS = 16384;
+    newBuf = realloc(sess->ack[c], newS);
+    if (newBuf == NULL) {
+      handleError(LOG_ERR, "Could not allocate memory for ACK responses", -1, 0, 1);
+      return(-1);
+    }
+    sess->ack[c] = newBuf;
+    sess->ackSize[c] = newS;
+  }
+
+  newBuf = sess->ack[c] + sess->ackLen[c];
+  newBuf[0] = 11;
+  memcpy(newBuf + 1, ack, ackL);
+  newBuf[ackL + 1] = 28;
+  newBuf[ackL + 2] = 13;
+  sess->ackLen[c] = sess->ackLen[c] + ackL + 3;
+  return(0);
+}
+
+
+// Send and ACK after receiving a message, over TLS if ssl isn't NULL, the connection
+// is left open for the caller to close. resCode is set to the code sent
+static int sendACK(int sessfd, SSL *ssl, char *hl7msg, int resType, char *ackList,
+                   char *resCode) {
+  static __thread char *ackBuf = NULL;
+  static __thread int ackBufS = 0;
+  char cid[201] = "", errStr[256] = "";
+  char *resCodeP = resCode, *ackP = NULL;
+  int writeL = 0, msgs = 0, rejected = 0;
+
+  if (isBatch(hl7msg) == 1) {
+    // Batches get a single batch ACK
+    batchField(hl7msg, "BHS|", 11, cid, 201);
+    ackP = batchACK(hl7msg, resType, ackList, &msgs, &rejected, resCode);
+    if (ackP == NULL) return(-1);
+
+  } else {
+    // Create the resCode if required
+    sprintf(resCode, "%s", "AA");
+    if (resType > 0) getResCode(resType, ackList, resCodeP);
+    statsACKSent(resCodeP);
+
+    // The ACK is built from the compiled template in to this threads buffer, it's only
+    // grown for an ACK echoing unusually long fields
+    while (ackBufS == 0 || (writeL = ackBuild(hl7msg, resCodeP, cid, ackBuf, ackBufS)) < 0) {
+      free(ackBuf);
+      ackBufS = (ackBufS == 0) ? 4096 : ackBufS * 2;
+      ackBuf = malloc(ackBufS);
+      if (ackBuf == NULL || ackBufS > MLLP_MAXFRAME) {
+        handleError(LOG_ERR, "Could not allocate memory for an ACK response", -1, 0, 1);
+        free(ackBuf);
+        ackBuf = NULL;
+        ackBufS = 0;
+        return(-1);
+      }
+    }
+    ackP = ackBuf;
+    if (strlen(cid) == 0) sprintf(cid, "%s", "<UNKNOWN>");
+  }
+
+  // Sessions are non-blocking, writeMLLP() waits if the sender isn't reading it's ACKs,
+  // the io_uring listener sends a reads ACKs together once they're all processed
+  if (ackP != ackBuf) writeL = strlen(ackP);
+  if (corkSess != NULL) {
+    if (corkACK(corkSess, ackP, writeL) == -1) {
+      corkSess->uClosing = 1;
+      writeL = -1;
+    }
+  } else if (writeMLLP(sessfd, ssl, ackP, writeL) == -1) {
+    writeL = -1;
+  }
+  if (ackP != ackBuf) free(ackP);
+
+  if (writeL == -1) {
     handleError(LOG_ERR, "Failed to send ACK response to server", -1, 0, 1);
     return(-1);
 
+  } else if (msgs > 0) {
+    sprintf(errStr, "Batch with control ID %s of %d messages received OK and ACK sent (%d rejected)",
+            cid, msgs, rejected);
+    writeLog(LOG_INFO, errStr, 1);
+
   } else {
     sprintf(errStr, "Message with control ID %s received OK and ACK (%s) sent", cid, resCode);
     writeLog(LOG_INFO, errStr, 1);
   }
 
-  close(sessfd);
   return(writeL);
 }
 
@@ -763,99 +2675,463 @@ static struct Response *checkResponse(char *msg, char *sIP, char *sPort,
 
   }
 
-  // Add the response to the queue
-  respHead = queueResponse(resp);
-  sprintf(errStr, "Response queued, delivery in %ld secs", resp->sendTime - time(NULL));
-  writeLog(LOG_INFO, errStr, 1);
+  // Add the response to the queue
+  respHead = queueResponse(resp);
+  sprintf(errStr, "Response queued, delivery in %ld secs", resp->sendTime - time(NULL));
+  writeLog(LOG_INFO, errStr, 1);
+
+  json_object_put(resObj);
+  return(respHead);
+}
+
+
+// Process a received message once it's been ACKed, capture it, check it against any
+// responders and pass it to the web interface or stdout
+static void procStage(struct WebRing *webOut, char *msgBuf, struct timespec *recvT, char *sIP, char *sPort,
+                      int argc, int optind, char *argv[], int aTimeout, int webErr) {
+
+  struct Response *respHead = responses;
+  char errStr[306] = "";
+  char *batchMsg = NULL, *batchEnd = NULL, endChar;
+  char *webMsg = msgBuf;
+
+  writeCapture(msgBuf, strlen(msgBuf), recvT);
+
+  // If we're responding, parse each respond template to see if msg matches, checking
+  // each message in a batch separately
+  if (argc > 0) {
+    batchMsg = msgBuf;
+    batchEnd = msgBuf + strlen(msgBuf);
+    if (isBatch(msgBuf) == 1) batchMsg = batchNext(msgBuf, &batchEnd);
+
+    while (batchMsg != NULL) {
+      endChar = *batchEnd;
+      *batchEnd = '\0';
+      for (int i = optind; i < argc; i++) {
+        sprintf(errStr, "Checking if incoming message matches responder: %s", argv[i]);
+        writeLog(LOG_INFO, errStr, 1);
+        respHead = checkResponse(batchMsg, sIP, sPort, argv[i], aTimeout);
+        responses = respHead;
+      }
+      *batchEnd = endChar;
+
+      batchMsg = (isBatch(msgBuf) == 1) ? batchNext(batchEnd, &batchEnd) : NULL;
+    }
+  }
+
+  if (webRunning == 1) {
+    if (webErr > 0)
+      webMsg = "ERROR: The backend failed to receive or process a message from the sending server";
+
+    if (argc <= 0) webRingPut(webOut, webMsg, strlen(webMsg));
+
+  } else if (argc <= 0) {
+    // Listener workers share stdout, keep each message together
+    flockfile(stdout);
+    hl72unix(msgBuf, 1);
+    printf("\n");
+    funlockfile(stdout);
+  }
+}
+
+
+// ACK a received message and process it, or with an ingest ring pass it to the
+// listener's processing threads so the next message can be read straight away
+static struct Response *procMsg(struct Session *sess, struct WebRing *webOut, char *msgBuf,
+                                char *sIP,
+                                char *sPort, int argc, int optind, char *argv[],
+                                int resType, char *ackList, int aTimeout, int webErr) {
+
+  long int msgL = strlen(msgBuf);
+  char resCode[3] = "", cid[201] = "", errStr[301] = "";
+  int dMode = dedupMode(), isDup = 0;
+
+  statsRecv(msgL);
+
+  // A duplicate (same sending facility and control ID within the window) is counted,
+  // with flag it's also logged and processed as normal, with ack it's ACKed AA and
+  // journaled but not processed again
+  if (dMode != DEDUP_OFF && dedupCheck(msgBuf, (sess->wl == NULL) ? 0 : sess->wl->id,
+                                       cid, sizeof(cid)) == 1) {
+    if (dMode != DEDUP_COUNT) {
+      snprintf(errStr, sizeof(errStr), "Duplicate message received from %s, control ID: %s",
+               sess->peer, cid);
+      writeLog(LOG_WARNING, errStr, 1);
+    }
+    if (dMode == DEDUP_ACK) {
+      isDup = 1;
+      resType = 0;
+      ackList = NULL;
+    }
+  }
+
+  if (sendACK(sess->sockfd, sess->ssl, msgBuf, resType, ackList, resCode) == -1) webErr = 1;
+  writeRecvJournal(msgBuf, msgL, sess->peer, resCode);
+
+  if (isDup == 1) {
+    return(responses);
+  } else if (ingest != NULL) {
+    ingestPut(ingest, msgBuf, msgL);
+  } else {
+    procStage(webOut, msgBuf, NULL, sIP, sPort, argc, optind, argv, aTimeout, webErr);
+  }
+  return(responses);
+}
+
+
+// Process queued responses after a listener has handled events (idle=0) or waited
+// idle, at most once a second, ret the seconds until the next are due or -1 if none
+static int listenResponses(struct WebRing *webOut, int argc, int aTimeout, int nextResp, int idle,
+                           time_t now, time_t *lastProcess) {
+  char errStr[58] = "";
+  int procThrot = 1;
+
+  if (idle == 1 && (argc <= 0 || nextResp == -1)) return(nextResp);
+
+  if ((now - *lastProcess) >= procThrot) {
+    if (argc > 0) nextResp = processResponses(webOut, aTimeout);
+    *lastProcess = now;
+  } else {
+    nextResp = procThrot;
+  }
+
+  if (idle == 1) {
+    if (nextResp == -1) {
+      writeLog(LOG_INFO, "Response queue empty, awaiting next received message", 1);
+    } else {
+      sprintf(errStr, "Responses processed, next process in %d seconds", nextResp);
+      writeLog(LOG_INFO, errStr, 1);
+    }
+  }
+  return(nextResp);
+}
+
+
+// Start a detached listener, processing or web listener engine thread, ret 0 or -1
+static int startService(void *(*func)(void *), void *arg) {
+  pthread_t thread;
+
+  __atomic_add_fetch(&svcThreads, 1, __ATOMIC_SEQ_CST);
+  if (pthread_create(&thread, NULL, func, arg) != 0) {
+    __atomic_sub_fetch(&svcThreads, 1, __ATOMIC_SEQ_CST);
+    return(-1);
+  }
+  pthread_detach(thread);
+  return(0);
+}
+
+
+// Called by a thread started with startService() as it exits
+static void serviceDone() {
+  __atomic_sub_fetch(&svcThreads, 1, __ATOMIC_SEQ_CST);
+}
+
+
+// Wait for every listener, processing and web listener engine thread to exit, once a
+// stop has been requested
+void waitServiceThreads() {
+  struct timespec pause = { 0, 10000000 };
+
+  while (__atomic_load_n(&svcThreads, __ATOMIC_SEQ_CST) > 0) nanosleep(&pause, NULL);
+}
+
+
+// Processing thread for a listener's ingest ring, takes each message from the ring and
+// processes it, and sends any responses that are due
+static void *ingestWorker(void *arg) {
+  struct IngestJob *iJob = arg;
+  struct ListenJob *job = iJob->job;
+  struct IngestSlot *slot = NULL;
+  time_t lastProcess = time(NULL), lastMerge = time(NULL), now;
+  int nextResp = -1, waitMs = 1000;
+
+  while (1) {
+    now = time(NULL);
+    pollConnPool(job->aTimeout);
+
+    // Add this threads statistics to the totals once a second
+    if (now != lastMerge) {
+      mergeRecvStats();
+      lastMerge = now;
+    }
+
+    waitMs = 1000;
+    if (nextResp >= 0 && nextResp < 1) waitMs = 0;
+
+    slot = ingestTake(iJob->ring, waitMs);
+    if (slot == NULL && ingestClosed(iJob->ring) == 1) break;
+    if (slot != NULL) {
+      procStage(NULL, slot->msg, &slot->recvT, job->sIP, job->sPort, job->argc,
+                job->optind, job->argv, job->aTimeout, 0);
+
+      // Don't leave statistics unmerged while the ring is idle, they'd miss the report
+      if (ingestQueued(iJob->ring) == 0) mergeRecvStats();
+      ingestDone(iJob->ring, slot);
+    }
+
+    nextResp = listenResponses(NULL, job->argc, job->aTimeout, nextResp, slot == NULL,
+                               now, &lastProcess);
+  }
+
+  mergeRecvStats();
+  closeConnPool();
+  serviceDone();
+  return(NULL);
+}
+
+
+// Create an ingest ring for this listener and start it's processing threads, messages
+// are processed by the listener if the ring is disabled or can't be started
+static void startIngest(struct ListenJob *job) {
+  struct IngestJob *iJob = NULL;
+  sigset_t sigs, oldSigs;
+  char errStr[58] = "";
+  int w = 0, started = 0;
+
+  // The web interface updates responders from this thread, so it processes it's own
+  if (ingestSize() <= 0 || webRunning == 1) return;
+
+  iJob = calloc(1, sizeof(struct IngestJob));
+  if (iJob == NULL || (iJob->ring = ingestCreate()) == NULL) {
+    free(iJob);
+    return;
+  }
+  iJob->job = job;
+
+  // Processing threads run until the ring is closed, signals are left for the listener
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+
+  for (w = 0; w < ingestWorkers(); w++) {
+    if (startService(ingestWorker, iJob) != 0) {
+      sprintf(errStr, "Failed to start processing thread %d", w + 1);
+      handleError(LOG_ERR, errStr, -1, 0, 1);
+      break;
+    }
+    started++;
+  }
+  pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+
+  // Nothing can take from the ring (it's left unused), process messages here instead
+  if (started > 0) ingest = iJob->ring;
+}
+
+
+// Close an inbound session and remove it from the list, lsnEp is -1 for io_uring
+static void closeSession(int lsnEp, struct Session *sess) {
+  struct Session *this = sessions, *prev = NULL;
+  char errStr[100] = "";
+
+  while (this != NULL && this != sess) {
+    prev = this;
+    this = this->next;
+  }
+  if (this == NULL) return;
+
+  if (prev == NULL) {
+    sessions = this->next;
+  } else {
+    prev->next = this->next;
+  }
+  sessCount--;
+
+  sprintf(errStr, "Closed connection from %s (%d open)", sess->peer, sessCount);
+  writeLog(LOG_INFO, errStr, 1);
+
+  if (lsnEp != -1) epoll_ctl(lsnEp, EPOLL_CTL_DEL, sess->sockfd, NULL);
+  tlsClose(sess->ssl);
+  close(sess->sockfd);
+  mllpFree(&sess->dec);
+  free(sess->ack[0]);
+  free(sess->ack[1]);
+  free(sess);
+}
+
+
+// Add an accepted connection to this threads sessions, ret the session or NULL on error
+static struct Session *addSession(int sessfd) {
+  struct Session *sess = NULL;
+  struct sockaddr_in addr;
+  socklen_t addrL = sizeof(addr);
+  char errStr[100] = "";
+  int keepAlive = 1;
+
+  // Sessions may be idle for days, keepalives detect senders that have gone away
+  setsockopt(sessfd, SOL_SOCKET, SO_KEEPALIVE, &keepAlive, sizeof(keepAlive));
+
+  sess = calloc(1, sizeof(struct Session));
+  if (sess == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for an inbound session", -1, 0, 1);
+    close(sessfd);
+    return(NULL);
+  }
+  sess->sockfd = sessfd;
+  sess->started = time(NULL);
+  sess->tlsDone = 1;
+  mllpInit(&sess->dec);
+
+  memset(&addr, 0, sizeof(addr));
+  getpeername(sessfd, (struct sockaddr *) &addr, &addrL);
+  sprintf(sess->peer, "%s:%d", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+  if (tlsServerEnabled() == 1) {
+    sess->ssl = tlsServer(sessfd);
+    sess->tlsDone = 0;
+    if (sess->ssl == NULL) {
+      close(sessfd);
+      free(sess);
+      return(NULL);
+    }
+  }
+
+  sess->next = sessions;
+  sessions = sess;
+  sessCount++;
+  statsSession();
+
+  sprintf(errStr, "Accepted connection from %s (%d open)", sess->peer, sessCount);
+  writeLog(LOG_INFO, errStr, 1);
+  return(sess);
+}
+
+
+// Accept a new inbound session and add it to the listeners epoll instance, ret the
+// session or NULL if there are no more connections waiting
+static struct Session *openSession(int lsnEp, int svrfd) {
+  struct Session *sess = NULL;
+  struct epoll_event ev;
+  int sessfd = -1;
+
+  sessfd = accept4(svrfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sessfd == -1) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      handleError(LOG_ERR, "Can't accept connections", -1, 0, 1);
+    return(NULL);
+  }
+
+  sess = addSession(sessfd);
+  if (sess == NULL) return(NULL);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = sess;
+  if (epoll_ctl(lsnEp, EPOLL_CTL_ADD, sessfd, &ev) == -1) {
+    handleError(LOG_ERR, "Could not add an inbound session to the listener", -1, 0, 1);
+    closeSession(lsnEp, sess);
+    return(NULL);
+  }
+  return(sess);
+}
+
+
+// Watch a session for writing (tlsOut=1) or reading on it's listener's epoll instance
+static int sessWatch(int lsnEp, struct Session *sess, int tlsOut) {
+  struct epoll_event ev;
+
+  if (sess->tlsOut == tlsOut) return(0);
+  ev.events = (tlsOut == 1) ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = sess;
+  if (epoll_ctl(lsnEp, EPOLL_CTL_MOD, sess->sockfd, &ev) == -1) return(-1);
+  sess->tlsOut = tlsOut;
+  return(0);
+}
+
+
+// Continue a sessions TLS handshake, ret 1 when complete, 0 if it's waiting for the
+// sender or -1 if it failed. A handshake blocked on a full socket buffer waits for
+// EPOLLOUT in the listener's loop rather than blocking it
+static int sessHandshake(int lsnEp, struct Session *sess) {
+  int rv = SSL_accept(sess->ssl), err = 0;
+
+  if (rv == 1) {
+    sess->tlsDone = 1;
+    if (SSL_session_reused(sess->ssl)) writeLog(LOG_DEBUG, "TLS session resumed", 0);
+    if (sessWatch(lsnEp, sess, 0) == -1) return(-1);
+    return(1);
+  }
+
+  err = SSL_get_error(sess->ssl, rv);
+  if (err == SSL_ERROR_WANT_READ && sessWatch(lsnEp, sess, 0) == 0) return(0);
+  if (err == SSL_ERROR_WANT_WRITE && sessWatch(lsnEp, sess, 1) == 0) return(0);
 
-  json_object_put(resObj);
-  return(respHead);
+  // A failed TLS handshake only drops this connection, not the listener
+  tlsError("TLS handshake with sending server failed", sess->ssl);
+  return(-1);
 }
 
 
-// Handle an incoming message
-static struct Response *handleMsg(int sessfd, int fd, char *sIP, char *sPort, int argc,
-                                  int optind, char *argv[], int resType, char *ackList,
-                                  int aTimeout) {
-
-  struct Response *respHead = responses;
-  int readSize = 1024, msgSize = 0, maxSize = readSize + msgSize, rcvSize = 1;
-  int webErr = 0;
-  int *ms = &maxSize;
-  char rcvBuf[readSize + 1];
-  memset(rcvBuf, 0, sizeof rcvBuf);
-  char *msgBuf = calloc(1, readSize);
-  char writeSize[11] = "";
-  char errStr[306] = "";
-  msgBuf[0] = '\0';
-  rcvBuf[0] = '\0';
-
-  // Receive the full message
-  while (rcvSize > 0) {
-    rcvBuf[0] = '\0';
-    rcvSize = read(sessfd, rcvBuf, readSize);
+// Read what's waiting on a session and process each complete message in order, a frame
+// may span reads and a read may hold several frames. Ret -1 if the session has closed
+static int readSession(struct Session *sess, struct WebRing *webOut, char *sIP, char *sPort, int argc,
+                       int optind, char *argv[], int resType, char *ackList, int aTimeout) {
 
-    if (rcvSize == -1) {
-      handleError(LOG_ERR, "Failed to read incoming message from server", 1, 0, 1);
-      webErr = 1;
-    }
+  char *space = NULL, *msg = NULL;
+  int spaceL = 0, recvL = 0, msgL = 0, reads = 0;
 
-    if (rcvSize > 0) {
-      msgSize = msgSize + rcvSize;
-      if ((msgSize + 1) > maxSize) msgBuf = dblBuf(msgBuf, ms, msgSize);
-      strcat(msgBuf, rcvBuf);
-      msgBuf[msgSize] = '\0';
+  while (reads < SESS_READS) {
+    space = mllpSpace(&sess->dec, &spaceL);
+    if (space == NULL) return(-1);
 
+    recvL = sockRecv(sess->sockfd, sess->ssl, space, spaceL);
+    if (recvL == -1 && errno == EINTR) continue;
+    if (recvL == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return(0);
+    if (recvL <= 0) break;
+    reads++;
 
-      if (rcvBuf[rcvSize - 2] == 28 && rcvBuf[rcvSize - 1] == 13) {
-        rcvSize = 0;
-      }
+    mllpFed(&sess->dec, recvL);
+    while ((msgL = mllpNext(&sess->dec, &msg)) != 0) {
+      if (msgL < 0) continue;
+      responses = procMsg(sess, webOut, msg, sIP, sPort, argc, optind, argv,
+                          resType, ackList, aTimeout, 0);
     }
   }
+  if (reads == SESS_READS) return(0);
+
+  // The sender has closed, anything left may be an unwrapped message ended by the close
+  if (recvL == -1) {
+    handleError(LOG_ERR, "Failed to read incoming message from server", -1, 0, 1);
+  } else if (mllpRest(&sess->dec, &msg) > 0) {
+    stripMLLP(msg);
+    responses = procMsg(sess, webOut, msg, sIP, sPort, argc, optind, argv,
+                        resType, ackList, aTimeout, 0);
+  }
+  return(-1);
+}
 
-  stripMLLP(msgBuf);
-  if (sendACK(sessfd, msgBuf, resType, ackList) == -1) webErr = 1;
 
-  // If we're responding, parse each respond template to see if msg matches
-  if (argc > 0) {
-    for (int i = optind; i < argc; i++) {
-      sprintf(errStr, "Checking if incoming message matches responder: %s", argv[i]);
-      writeLog(LOG_INFO, errStr, 1);
-      respHead = checkResponse(msgBuf, sIP, sPort, argv[i], aTimeout);
-      responses = respHead;
-    }
-  }
+// Service TLS sessions that epoll won't wake for, those with records already read in
+// to their TLS buffer and handshakes that have taken too long. Ret 1 if any have data
+static int serviceTLS(int lsnEp, struct WebRing *webOut, char *sIP, char *sPort, int argc, int optind,
+                      char *argv[], int resType, char *ackList, int aTimeout) {
 
-  if (webRunning == 1) {
-    if (webErr > 0) {
-      if (msgBuf)
-        sprintf(msgBuf, "ERROR: The backend failed to receive or process a message from the sending server");
-    }
+  struct Session *sess = sessions, *next = NULL;
+  time_t now = time(NULL);
+  int pending = 0;
 
-    if (argc <= 0) {
-      sprintf(writeSize, "%d", (int) strlen(msgBuf));
-      if (write(fd, writeSize, 11) == -1) {
-        handleError(LOG_ERR, "ERROR: Failed to write to named pipe", 1, 0, 1);
-      }
+  while (sess != NULL) {
+    next = sess->next;
+
+    if (sess->tlsDone == 0 && now - sess->started >= SESS_HSTIME) {
+      writeLog(LOG_WARNING, "Timeout waiting for TLS handshake with sending server", 1);
+      closeSession(lsnEp, sess);
 
-      if (write(fd, msgBuf, strlen(msgBuf)) == -1) {
-        handleError(LOG_ERR, "ERROR: Failed to write to named pipe", 1, 0, 1);
+    } else if (sess->tlsDone == 1 && SSL_pending(sess->ssl) > 0) {
+      if (readSession(sess, webOut, sIP, sPort, argc, optind, argv, resType, ackList,
+                      aTimeout) < 0) {
+        closeSession(lsnEp, sess);
+      } else if (SSL_pending(sess->ssl) > 0) {
+        pending = 1;
       }
     }
-
-  } else if (argc <= 0) {
-    hl72unix(msgBuf, 1);
-    printf("\n");
+    sess = next;
   }
-
-  free(msgBuf);
-  close(sessfd);
-  return(responses);
+  return(pending);
 }
 
 
 // Listen for incoming messages
-static int createSession(char *ip, const char *port) {
+static int createSession(char *ip, const char *port, int reusePort) {
   int svrfd, rv;
   struct addrinfo hints, *res = 0;
 
@@ -882,18 +3158,30 @@ static int createSession(char *ip, const char *port) {
   int reuseaddr = 1;
   if (setsockopt(svrfd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) == -1) {
     freeaddrinfo(res);
+    close(svrfd);
+    handleError(LOG_ERR, "Can't set socket options", 1, 0, 1);
+    return(-1);
+  }
+
+  // Listener workers each bind their own socket, the kernel shares connections between them
+  if (reusePort == 1 &&
+      setsockopt(svrfd, SOL_SOCKET, SO_REUSEPORT, &reuseaddr, sizeof(reuseaddr)) == -1) {
+    freeaddrinfo(res);
+    close(svrfd);
     handleError(LOG_ERR, "Can't set socket options", 1, 0, 1);
     return(-1);
   }
 
   if (bind(svrfd, res->ai_addr, res->ai_addrlen) == -1) {
     freeaddrinfo(res);
+    close(svrfd);
     handleError(LOG_ERR, "Can't bind address", 1, 0, 1);
     return(-1);
   }
 
   if (listen(svrfd, SOMAXCONN)) {
     freeaddrinfo(res);
+    close(svrfd);
     handleError(LOG_ERR, "Can't listen for connections", 1, 0, 1);
     return(-1);
   }
@@ -903,162 +3191,779 @@ static int createSession(char *ip, const char *port) {
 }
 
 
-// Check the named pipe for response template updates
-static int readRespTemps(int respFD, char respTemps[20][256], char *respTempsPtrs[20]) {
+// Check the web interface's ring for response template updates
+static int readRespTemps(struct WebRing *webIn, char respTemps[20][256],
+                         char *respTempsPtrs[20]) {
   struct json_object *rootObj = NULL, *dataArray = NULL, *dataObj = NULL;
-  char readSizeBuf[11];
-  int pLen = 1, updated = 0, dataInt = 0, i = 0;
-  unsigned long int readSize = 0;
+  char *rBuf = NULL;
+  long int rBufS = 0;
+  int updated = 0, dataInt = 0, i = 0;
 
-  while (pLen > 0) {
-    if ((pLen = read(respFD, readSizeBuf, 11)) > 0) {
-      readSize = atoi(readSizeBuf);
+  if (webIn == NULL) return(0);
 
-      char rBuf[readSize + 1];
-      if ((pLen = read(respFD, rBuf, readSize)) > 0) {
-        updated = 1;
-        rBuf[readSize] = '\0';
+  while (webRingGet(webIn, &rBuf, &rBufS) >= 0) {
+    updated = 1;
+    rootObj = json_tokener_parse(rBuf);
+    json_object_object_get_ex(rootObj, "templates", &dataArray);
 
-        rootObj = json_tokener_parse(rBuf);
-        json_object_object_get_ex(rootObj, "templates", &dataArray);
-
-        if (dataArray == NULL) {
-          handleError(LOG_ERR, "Invalid response templates list provided", 1, 0, 1);
-          json_object_put(rootObj);
-          return(1);
+    if (dataArray == NULL) {
+      handleError(LOG_ERR, "Invalid response templates list provided", 1, 0, 1);
+      json_object_put(rootObj);
+      free(rBuf);
+      return(1);
 
-        } else {
-          dataInt = json_object_array_length(dataArray);
+    } else {
+      dataInt = json_object_array_length(dataArray);
+      if (dataInt > 20) dataInt = 20;
 
-          for (i = 0; i < dataInt; i++) {
-            dataObj = json_object_array_get_idx(dataArray, i);
-            sprintf(respTemps[i], "%s", json_object_get_string(dataObj));
-            respTempsPtrs[i] = respTemps[i];
-          }
-        }
+      for (i = 0; i < dataInt; i++) {
+        dataObj = json_object_array_get_idx(dataArray, i);
+        sprintf(respTemps[i], "%s", json_object_get_string(dataObj));
+        respTempsPtrs[i] = respTemps[i];
       }
     }
+    json_object_put(rootObj);
   }
+  free(rBuf);
 
   if (updated == 1) return(dataInt);
   return(0);
 }
 
 
-// Start listening for incoming messages
-int startMsgListener(char *lIP, const char *lPort, char *sIP, char *sPort, int argc,
-                     int optind, char *argv[], int resType, char *ackList, int aTimeout) {
+// Housekeeping for each pass of a listeners event loop
+static void listenTick(struct ListenJob *job, int worker, time_t now, time_t *lastMerge) {
+  pollConnPool(job->aTimeout);
+  if (worker == 0 && queueEnabled() == 1) drainQueues(job->aTimeout, 0);
+  if (worker == 0) syncCapture();
 
-  // TODO - malloc instead of limited resp templates
-  char respTemps[20][256];
-  char *respTempsPtrs[20];
-  char errStr[58] = "";
-  int svrfd = 0, sessfd = 0, fd = 0, rfd = 0, nextResp = -1, resU = 0, respUpdated = 0;
-  time_t lastProcess = time(NULL), now;
-  int procThrot = 1;
+  // Add this workers statistics to the totals once a second
+  if (now != *lastMerge) {
+    mergeRecvStats();
+    *lastMerge = now;
+  }
+}
 
-  writeLog(LOG_INFO, "Listener child process starting up", 0);
 
-  svrfd = createSession(lIP, lPort);
+// Queue a multishot recv for a session, in to the rings provided buffers
+static void uringRecv(struct URing *ring, struct Session *sess) {
+  struct io_uring_sqe *sqe = uringSQE(ring);
 
-  // Create a named pipe to write to
-  if (webRunning == 1) {
-    char hhl7fifo[21]; 
-    sprintf(hhl7fifo, "%s%d", "/tmp/hhl7fifo.", getpid());
-    mkfifo(hhl7fifo, 0666);
-    fd = open(hhl7fifo, O_WRONLY);
-
-    // Send FS code to parent process to state the listener has bound it's port
-    if (svrfd != -1) {
-      if (write(fd, "FS", 2) == -1) {
-        handleError(LOG_ERR, "Failed to write to named pipe while starting listener", 1, 1, 0);
+  if (sqe == NULL) {
+    sess->uClosing = 1;
+    return;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sess->sockfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = (unsigned long) sess | UR_RECV;
+  sess->uRecv = 1;
+}
+
+
+// Send a sessions waiting ACKs if none are already being sent, the ACKs collected
+// while they're sent go in the other buffer
+static void uringSendACKs(struct URing *ring, struct Session *sess) {
+  struct io_uring_sqe *sqe = NULL;
+  int c = sess->ackCur;
+
+  if (sess->uSend == 1 || sess->ackLen[c] == 0) return;
+
+  sqe = uringSQE(ring);
+  if (sqe == NULL) {
+    sess->uClosing = 1;
+    return;
+  }
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = sess->sockfd;
+  sqe->addr = (unsigned long) sess->ack[c];
+  sqe->len = sess->ackLen[c];
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  sqe->user_data = (unsigned long) sess | UR_SEND;
+
+  sess->uSend = 1;
+  sess->ackOff = 0;
+  sess->ackCur = 1 - c;
+}
+
+
+// Handle a session's recv completion, copying the data in to it's decoder and
+// processing each complete message, their ACKs are sent once they're all processed
+static void uringRecvDone(struct URing *ring, struct Session *sess, int res,
+                          unsigned int flags, struct WebRing *webOut, char *sIP, char *sPort, int argc,
+                          int optind, char *argv[], int resType, char *ackList,
+                          int aTimeout) {
+
+  char *buf = NULL, *space = NULL, *msg = NULL;
+  int bid = flags >> IORING_CQE_BUFFER_SHIFT, copied = 0, spaceL = 0, msgL = 0;
+
+  if ((flags & IORING_CQE_F_MORE) == 0) sess->uRecv = 0;
+
+  if ((flags & IORING_CQE_F_BUFFER) != 0) {
+    buf = uringBuf(ring, bid);
+    while (copied < res) {
+      space = mllpSpace(&sess->dec, &spaceL);
+      if (space == NULL) {
+        sess->uClosing = 1;
+        break;
       }
-    } else {
-      return(-1);
+      if (spaceL > res - copied) spaceL = res - copied;
+      memcpy(space, buf + copied, spaceL);
+      mllpFed(&sess->dec, spaceL);
+      copied += spaceL;
+    }
+    uringBufReturn(ring, bid);
+  }
+
+  // The kernel stops a multishot recv if it runs out of buffers, they're back now
+  if (res == -ENOBUFS) {
+    if (sess->uRecv == 0 && sess->uClosing == 0) uringRecv(ring, sess);
+    return;
+  }
+
+  corkSess = sess;
+  if (res > 0) {
+    while ((msgL = mllpNext(&sess->dec, &msg)) != 0) {
+      if (msgL < 0) continue;
+      responses = procMsg(sess, webOut, msg, sIP, sPort, argc, optind, argv,
+                          resType, ackList, aTimeout, 0);
+    }
+    if (sess->uRecv == 0 && sess->uClosing == 0) uringRecv(ring, sess);
+
+  } else {
+    // The sender has closed, anything left may be an unwrapped message ended by the close
+    if (res < 0 && res != -ECONNRESET && res != -ECANCELED) {
+      handleError(LOG_ERR, "Failed to read incoming message from server", -1, 0, 1);
+    } else if (mllpRest(&sess->dec, &msg) > 0) {
+      stripMLLP(msg);
+      responses = procMsg(sess, webOut, msg, sIP, sPort, argc, optind, argv,
+                          resType, ackList, aTimeout, 0);
     }
+    sess->uClosing = 1;
+  }
+  corkSess = NULL;
+
+  uringSendACKs(ring, sess);
+}
+
+
+// Handle a session's send completion, finishing a short send or sending the ACKs
+// collected since it started
+static void uringSendDone(struct URing *ring, struct Session *sess, int res) {
+  struct io_uring_sqe *sqe = NULL;
+  int c = 1 - sess->ackCur;
+
+  sess->uSend = 0;
+  if (res < 0) {
+    handleError(LOG_ERR, "Failed to send ACK response to server", -1, 0, 1);
+    sess->uClosing = 1;
+    return;
+  }
+
+  sess->ackOff += res;
+  if (sess->ackOff < sess->ackLen[c] && res > 0 && (sqe = uringSQE(ring)) != NULL) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sess->sockfd;
+    sqe->addr = (unsigned long) (sess->ack[c] + sess->ackOff);
+    sqe->len = sess->ackLen[c] - sess->ackOff;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (unsigned long) sess | UR_SEND;
+    sess->uSend = 1;
+    return;
+  }
+
+  sess->ackLen[c] = 0;
+  uringSendACKs(ring, sess);
+}
+
+
+// Queue a multishot accept on the listening socket
+static int uringAccept(struct URing *ring, int svrfd) {
+  struct io_uring_sqe *sqe = uringSQE(ring);
+
+  if (sqe == NULL) return(-1);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = svrfd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  sqe->user_data = UR_ACCEPT;
+  return(0);
+}
 
-    // Switch to non blocking after initial FS message
-    fcntl(fd, F_SETFL, O_NONBLOCK);
 
-    char hhl7rfifo[22];
-    sprintf(hhl7rfifo, "%s%d", "/tmp/hhl7rfifo.", getpid());
-    mkfifo(hhl7rfifo, 0666);
-    rfd = open(hhl7rfifo, O_RDONLY | O_NONBLOCK);
+// Run a listeners event loop on svrfd with io_uring, a multishot accept and a multishot
+// recv per session into provided buffers, ret -1 if io_uring couldn't be set up
+static int uringLoop(struct ListenJob *job, int svrfd, int worker) {
+  struct URing ring;
+  struct io_uring_cqe *cqe = NULL;
+  struct Session *sess = NULL, *next = NULL;
+  unsigned long uData = 0;
+  unsigned int flags = 0;
+  int nextResp = -1, waitMs = -1, res = 0, cqes = 0;
+  time_t lastProcess = time(NULL), lastMerge = time(NULL), now;
+
+  if (uringInit(&ring, URING_ENTRIES) != 0 ||
+      uringBufs(&ring, URING_BUFS, URING_BUFSIZE) != 0 || uringAccept(&ring, svrfd) != 0) {
+    uringClose(&ring);
+    writeLog(LOG_WARNING, "Could not set up io_uring for the listener, using epoll", 1);
+    return(-1);
   }
 
-  while(1) {
+  while (stopRequested() == 0) {
     now = time(NULL);
-    struct timeval tv, *tvp;
-    fd_set rs;
-    FD_ZERO(&rs);
-    FD_SET(svrfd, &rs);
+    listenTick(job, worker, now, &lastMerge);
+
+    // Wake at least once a second to see a stop request
+    waitMs = (nextResp == -1) ? -1 : nextResp * 1000;
+    if (waitMs == -1 || waitMs > 1000) waitMs = 1000;
+
+    if (uringSubmit(&ring, 1, waitMs) < 0) {
+      handleError(LOG_ERR, "startMsgListener() Failed during io_uring_enter() routine", 1, 1, 1);
+      break;
+    }
+
+    cqes = 0;
+    while ((cqe = uringCQE(&ring)) != NULL) {
+      uData = cqe->user_data;
+      res = cqe->res;
+      flags = cqe->flags;
+      uringSeen(&ring);
+      cqes++;
+
+      sess = (struct Session *) (uData & ~7UL);
+      if ((uData & 7) == UR_ACCEPT) {
+        sess = NULL;
+        if (res >= 0) {
+          sess = addSession(res);
+          if (sess != NULL) uringRecv(&ring, sess);
+        } else if (res != -EINTR && res != -EAGAIN) {
+          handleError(LOG_ERR, "Can't accept connections", -1, 0, 1);
+        }
+        if ((flags & IORING_CQE_F_MORE) == 0) uringAccept(&ring, svrfd);
+
+      } else if ((uData & 7) == UR_RECV) {
+        uringRecvDone(&ring, sess, res, flags, NULL, job->sIP, job->sPort, job->argc,
+                      job->optind, job->argv, job->resType, job->ackList, job->aTimeout);
+
+      } else if ((uData & 7) == UR_SEND) {
+        uringSendDone(&ring, sess, res);
+      }
+
+      // A closing session's recv is ended by shutting the socket down, it's freed once
+      // nothing is left in flight (a new session is closing if it's recv wasn't queued)
+      if (sess != NULL && sess->uClosing == 1) {
+        if (sess->uRecv == 1) shutdown(sess->sockfd, SHUT_RDWR);
+        if (sess->uRecv == 0 && sess->uSend == 0) closeSession(-1, sess);
+      }
+    }
+
+    nextResp = listenResponses(NULL, job->argc, job->aTimeout, nextResp, cqes == 0, now,
+                               &lastProcess);
+  }
+
+  // Closing the ring cancels everything in flight before the sessions are freed
+  uringClose(&ring);
+  for (sess = sessions; sess != NULL; sess = next) {
+    next = sess->next;
+    closeSession(-1, sess);
+  }
+  mergeRecvStats();
+  close(svrfd);
+  return(0);
+}
+
+
+// Run a listeners event loop on svrfd
+static int listenLoop(struct ListenJob *job, int svrfd, int worker) {
+  char *sIP = job->sIP, *sPort = job->sPort, *ackList = job->ackList;
+  char **argv = job->argv;
+  int argc = job->argc, optind = job->optind, resType = job->resType;
+  int aTimeout = job->aTimeout;
+  int nextResp = -1;
+  int lsnEp = -1, evCount = 0, e = 0, waitMs = -1, sessRv = 0;
+  struct epoll_event ev, evs[64];
+  struct Session *sess = NULL;
+  time_t lastProcess = time(NULL), lastMerge = time(NULL), now;
+
+  startIngest(job);
+
+  // The io_uring backend runs it's own loop, TLS sessions are always read through epoll
+  if (uringEnabled() == 1 && tlsServerEnabled() == 0 &&
+      uringLoop(job, svrfd, worker) == 0) return(0);
+
+  // One epoll instance watches the listening socket and every open session
+  lsnEp = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (lsnEp == -1 || fcntl(svrfd, F_SETFL, O_NONBLOCK) == -1 ||
+      epoll_ctl(lsnEp, EPOLL_CTL_ADD, svrfd, &ev) == -1) {
+    handleError(LOG_ERR, "startMsgListener() Failed to create the epoll instance", 1, 0, 1);
+    close(svrfd);
+    return(-1);
+  }
+
+  while (stopRequested() == 0) {
+    now = time(NULL);
+    listenTick(job, worker, now, &lastMerge);
+
+    waitMs = (nextResp == -1) ? -1 : nextResp * 1000;
+    if (tlsServerEnabled() == 1) {
+      if (serviceTLS(lsnEp, NULL, sIP, sPort, argc, optind, argv, resType, ackList,
+                     aTimeout) == 1) waitMs = 0;
 
-    if (nextResp == -1) {
-      tvp = NULL;
-    } else {
-      tv.tv_sec = nextResp;
-      tv.tv_usec = 0;
-      tvp = &tv;
     }
 
-    int res = select(svrfd + 1, &rs, NULL, NULL, tvp);
+    // Wake at least once a second to see a stop request and time out stalled handshakes
+    if (waitMs == -1 || waitMs > 1000) waitMs = 1000;
 
-    if (res == -1) {
+    evCount = epoll_wait(lsnEp, evs, 64, waitMs);
+
+    if (evCount == -1) {
       if (errno != EINTR) {
-        handleError(LOG_ERR, "startMsgListener() Failed during select() routine", 1, 1, 1);
+        handleError(LOG_ERR, "startMsgListener() Failed during epoll_wait() routine", 1, 1, 1);
         break;
       }
 
-    } else if (res == 0) {
-      if (argc > 0) {
-        if ((now - lastProcess) >= procThrot) {
-          if (argc > 0) nextResp = processResponses(fd, aTimeout);
-          lastProcess = now;
-        } else {
-          nextResp = procThrot;
-        }
+    } else if (evCount == 0) {
+      nextResp = listenResponses(NULL, argc, aTimeout, nextResp, 1, now, &lastProcess);
 
-        if (nextResp == -1) {
-          writeLog(LOG_INFO, "Response queue empty, awaiting next received message", 1);
-        } else {
-          sprintf(errStr, "Responses processed, next process in %d seconds", nextResp);
-          writeLog(LOG_INFO, errStr, 1);
+    } else {
+      for (e = 0; e < evCount; e++) {
+        sess = evs[e].data.ptr;
+
+        // Accept every waiting connection
+        if (sess == NULL) {
+          while (openSession(lsnEp, svrfd) != NULL);
+          continue;
         }
-      }
 
-    } else {
-      if (webRunning == 1) {
-        resU = readRespTemps(rfd, respTemps, respTempsPtrs);
-        if (resU > 0) respUpdated = resU;
-      }
+        sessRv = 0;
+        if (sess->tlsDone == 0) sessRv = sessHandshake(lsnEp, sess);
+        if (sessRv >= 0 && sess->tlsDone == 1)
+          sessRv = readSession(sess, NULL, sIP, sPort, argc, optind, argv, resType,
+                               ackList, aTimeout);
 
-      sessfd = accept(svrfd, 0, 0);
-      if (sessfd == -1) {
-        close(svrfd);
-        handleError(LOG_ERR, "Can't accept connections", 1, 0, 1);
-        return(-1);
+        if (sessRv < 0 || (evs[e].events & EPOLLERR) != 0) closeSession(lsnEp, sess);
       }
 
-      if (respUpdated == 0) {
-        responses = handleMsg(sessfd, fd, sIP, sPort, argc, optind, argv,
-                              resType, ackList, aTimeout);
-      } else {
-        responses = handleMsg(sessfd, fd, sIP, sPort, respUpdated, 0, 
-                              respTempsPtrs, resType, ackList, aTimeout);
+      nextResp = listenResponses(NULL, argc, aTimeout, nextResp, 0, now, &lastProcess);
+    }
+  }
+
+  while (sessions != NULL) closeSession(lsnEp, sessions);
+  close(lsnEp);
+  mergeRecvStats();
+  close(svrfd);
+  return(0);
+}
+
+
+// Listener worker thread, runs it's own event loop on it's own socket
+static void *listenWorker(void *arg) {
+  struct ListenJob *job = arg;
+  int svrfd = createSession(job->lIP, job->lPort, 1);
+
+  // Responder templates generated by each worker get their own random numbers
+  seedRand(__atomic_add_fetch(&job->seed, 7919, __ATOMIC_RELAXED));
+
+  if (svrfd != -1) listenLoop(job, svrfd, 1);
+  if (ingest != NULL) ingestClose(ingest);
+  closeConnPool();
+  serviceDone();
+  return(NULL);
+}
+
+
+// Set the number of listener worker threads
+void setListenWorkers(int workers) {
+  if (workers > 0) lsnWorkers = workers;
+}
+
+// Start listening for incoming messages
+int startMsgListener(char *lIP, const char *lPort, char *sIP, char *sPort, int argc,
+                     int optind, char *argv[], int resType, char *ackList, int aTimeout) {
+
+  struct ListenJob job = { lIP, lPort, sIP, sPort, argc, optind, argv, resType, ackList,
+                           aTimeout, (unsigned int) time(NULL) };
+  int svrfd = 0, workers = lsnWorkers, w = 0, rv = 0;
+  sigset_t sigs, oldSigs;
+  char errStr[58] = "";
+
+  writeLog(LOG_INFO, "Listener starting up", 0);
+
+  svrfd = createSession(lIP, lPort, workers > 1);
+
+  // Compile the ACK template before any workers use it
+  if (svrfd != -1 && initACK() != 0) {
+    close(svrfd);
+    return(-1);
+  }
+
+  startRecvStats();
+
+  // Workers are detached and run until a stop is requested, signals are left for this
+  // thread to handle
+  if (workers > 1) {
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+
+    for (w = 1; w < workers; w++) {
+      if (startService(listenWorker, &job) != 0) {
+        sprintf(errStr, "Failed to start listener worker %d", w + 1);
+        handleError(LOG_ERR, errStr, -1, 0, 1);
+        break;
       }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
 
-      close(sessfd);
+    sprintf(errStr, "Listening with %d workers", w);
+    writeLog(LOG_INFO, errStr, 1);
+  }
+
+  rv = listenLoop(&job, svrfd, 0);
+
+  // The workers and processing threads stop with this thread's loop, they share job so
+  // they're waited for before returning
+  requestStop();
+  if (ingest != NULL) ingestClose(ingest);
+  waitServiceThreads();
+  return(rv);
+}
+
+
+// Swap a web listener's sessions and responses in to this thread's lists, so the engine
+// handles them as a command line listener would it's own
+static void webLsnEnter(struct WebListener *wl) {
+  sessions = wl->sessions;
+  sessCount = wl->sessCount;
+  responses = wl->responses;
+}
+
+
+// Save this thread's lists back to the web listener they were swapped in from
+static void webLsnLeave(struct WebListener *wl) {
+  wl->sessions = sessions;
+  wl->sessCount = sessCount;
+  wl->responses = responses;
+  sessions = NULL;
+  sessCount = 0;
+  responses = NULL;
+}
+
+
+// Watch fd on the engine's epoll instance, tagged with the web listener it's for
+static int webLsnWatch(int fd, struct WebListener *wl, unsigned long tag) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = (unsigned long) wl | tag;
+  return(epoll_ctl(webLsnEp, EPOLL_CTL_ADD, fd, &ev));
+}
+
+
+// Wake the engine to pick up started and stopped web listeners
+static void webLsnSignal() {
+  uint64_t one = 1;
+
+  if (write(webLsnWake, &one, 8) == -1) {}
+}
+
+
+// Close a web listener's sessions and socket, remove it from the engine and free it.
+// Called by the engine with webLsnLock held
+static void webLsnFree(struct WebListener *wl) {
+  struct WebListener *this = webLsns, *prev = NULL;
+  struct Response *resp = NULL;
+  char errStr[40] = "";
+
+  while (this != NULL && this != wl) {
+    prev = this;
+    this = this->next;
+  }
+  if (this == NULL) return;
+
+  if (prev == NULL) {
+    webLsns = wl->next;
+  } else {
+    prev->next = wl->next;
+  }
+
+  webLsnEnter(wl);
+  while (sessions != NULL) closeSession(webLsnEp, sessions);
+  while (responses != NULL) {
+    resp = responses;
+    responses = resp->next;
+    freeResponse(resp);
+  }
+  webLsnLeave(wl);
+
+  epoll_ctl(webLsnEp, EPOLL_CTL_DEL, wl->svrfd, NULL);
+  epoll_ctl(webLsnEp, EPOLL_CTL_DEL, webRingFD(wl->in), NULL);
+  close(wl->svrfd);
+
+  sprintf(errStr, "Web listener %d stopped", wl->id);
+  writeLog(LOG_INFO, errStr, 0);
+  free(wl);
+}
+
+
+// Pick up newly started web listeners and free those being stopped
+static void webLsnUpdate() {
+  struct WebListener *wl = NULL, *next = NULL;
+  uint64_t count = 0;
+
+  if (read(webLsnWake, &count, 8) == -1) {}
+
+  pthread_mutex_lock(&webLsnLock);
+  while (webLsnNew != NULL) {
+    wl = webLsnNew;
+    webLsnNew = wl->next;
+    wl->next = webLsns;
+    webLsns = wl;
+
+    if (webLsnWatch(wl->svrfd, wl, WL_ACCEPT) == -1 ||
+        webLsnWatch(webRingFD(wl->in), wl, WL_TEMPS) == -1) {
+      handleError(LOG_ERR, "Could not add a web listener to the listener engine", -1, 0, 1);
+      wl->stopping = 1;
+    }
+  }
+
+  for (wl = webLsns; wl != NULL; wl = next) {
+    next = wl->next;
+    if (wl->stopping == 1) webLsnFree(wl);
+  }
+
+  // Stopping listeners wait for their web listener to be freed
+  pthread_cond_broadcast(&webLsnCond);
+  pthread_mutex_unlock(&webLsnLock);
+}
+
+
+// Read what's waiting on a web listener's session, or continue it's TLS handshake
+static void webLsnSession(struct Session *sess, unsigned int events) {
+  struct WebListener *wl = sess->wl;
+  int sessRv = 0;
+
+  webLsnEnter(wl);
+  if (sess->tlsDone == 0) sessRv = sessHandshake(webLsnEp, sess);
+  if (sessRv >= 0 && sess->tlsDone == 1)
+    sessRv = readSession(sess, wl->out, wl->sIP, wl->sPort, wl->respCount, 0,
+                         wl->respTempsPtrs, 0, NULL, wl->aTimeout);
+
+  if (sessRv < 0 || (events & EPOLLERR) != 0) closeSession(webLsnEp, sess);
+  webLsnLeave(wl);
+}
+
+
+// The web listener engine, every web session's listener socket, it's sessions and the
+// ring it's sent responder templates through are watched by one epoll instance
+static void *webLsnEngine(void *arg) {
+  struct epoll_event evs[64];
+  struct WebListener *wl = NULL;
+  struct Session *sess = NULL;
+  unsigned long tag = 0;
+  time_t now, lastMerge = time(NULL);
+  int evCount = 0, e = 0, temps = 0, waitMs = 1000, pending = 0, wake = 0;
+  struct timespec ts;
+
+  (void) arg;
+
+  // Responder templates for every web session are generated on this thread
+  clock_gettime(CLOCK_REALTIME, &ts);
+  seedRand((unsigned int) ts.tv_nsec);
+
+  while (1) {
+    evCount = epoll_wait(webLsnEp, evs, 64, waitMs);
+    if (evCount == -1) {
+      if (errno != EINTR)
+        handleError(LOG_ERR, "Web listener engine failed during epoll_wait() routine", -1, 0, 1);
+      evCount = 0;
+    }
+
+    now = time(NULL);
+    pollConnPool(0);
+
+    // Add the engine's statistics to the totals once a second
+    if (now != lastMerge) {
+      mergeRecvStats();
+      lastMerge = now;
+    }
+
+    wake = 0;
+    for (e = 0; e < evCount; e++) {
+      tag = evs[e].data.u64 & 7;
+      wl = (struct WebListener *) (evs[e].data.u64 & ~7UL);
+
+      // Listeners are only freed once all of this pass's events are handled
+      if (tag == WL_WAKE) {
+        wake = 1;
+
+      } else if (tag == WL_ACCEPT) {
+        webLsnEnter(wl);
+        while ((sess = openSession(webLsnEp, wl->svrfd)) != NULL) sess->wl = wl;
+        webLsnLeave(wl);
+
+      } else if (tag == WL_TEMPS) {
+        temps = readRespTemps(wl->in, wl->respTemps, wl->respTempsPtrs);
+        if (temps > 0) wl->respCount = temps;
 
-      if ((now - lastProcess) >= procThrot) {
-        if (argc > 0) nextResp = processResponses(fd, aTimeout);
-        lastProcess = now;
       } else {
-        nextResp = procThrot;
+        webLsnSession(evs[e].data.ptr, evs[e].events);
       }
     }
+
+    // Service TLS sessions epoll won't wake for, and send responses that are due
+    pending = 0;
+    for (wl = webLsns; wl != NULL; wl = wl->next) {
+      webLsnEnter(wl);
+      if (tlsServerEnabled() == 1 &&
+          serviceTLS(webLsnEp, wl->out, wl->sIP, wl->sPort, wl->respCount, 0,
+                     wl->respTempsPtrs, 0, NULL, wl->aTimeout) == 1) pending = 1;
+
+      if (responses != NULL)
+        wl->nextResp = listenResponses(wl->out, wl->respCount, wl->aTimeout, wl->nextResp, 0,
+                                       now, &wl->lastProcess);
+      webLsnLeave(wl);
+    }
+
+    if (wake == 1) webLsnUpdate();
+    waitMs = (pending == 1) ? 0 : 1000;
+
+    // Keep running after a stop is requested until the web interface has stopped every
+    // listener, they're waiting for the engine to free them
+    if (stopRequested() == 1 && webLsns == NULL) break;
   }
 
-  close(sessfd);
-  close(svrfd);
-  return(0);
+  mergeRecvStats();
+  closeConnPool();
+  serviceDone();
+  return(NULL);
+}
+
+
+// Start the web listener engine thread if it's not running, ret 0 or -1 on error
+static int startWebEngine() {
+  sigset_t sigs, oldSigs;
+  int rv = 0;
+
+  pthread_mutex_lock(&webLsnLock);
+  if (webLsnEp == -1) {
+    webLsnEp = epoll_create1(EPOLL_CLOEXEC);
+    webLsnWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (webLsnEp == -1 || webLsnWake == -1 || webLsnWatch(webLsnWake, NULL, WL_WAKE) == -1)
+      rv = -1;
+
+    // The engine runs until a stop is requested, signals are left for the web interface
+    if (rv == 0) {
+      sigemptyset(&sigs);
+      sigaddset(&sigs, SIGINT);
+      sigaddset(&sigs, SIGTERM);
+      pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+      rv = startService(webLsnEngine, NULL);
+      pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+    }
+
+    if (rv == -1) {
+      handleError(LOG_ERR, "Failed to start the web listener engine", -1, 0, 1);
+      if (webLsnEp != -1) close(webLsnEp);
+      if (webLsnWake != -1) close(webLsnWake);
+      webLsnEp = -1;
+      webLsnWake = -1;
+    }
+  }
+  pthread_mutex_unlock(&webLsnLock);
+  return(rv);
+}
+
+
+// Start a listener for a web session on the web listener engine. Messages and response
+// lists are passed to the web interface through out, responder templates (argv, or
+// updates sent through in) replace passing messages to the web interface. Ret the
+// listener's ID or -1 if it couldn't be started
+int startWebListener(char *lIP, char *lPort, char *sIP, char *sPort, int aTimeout,
+                     int argc, char *argv[], struct WebRing *out, struct WebRing *in) {
+
+  struct WebListener *wl = NULL;
+  char errStr[60] = "";
+  int svrfd = -1, i = 0, id = 0;
+
+  if (initACK() != 0 || startWebEngine() != 0) return(-1);
+
+  svrfd = createSession(lIP, lPort, 0);
+  if (svrfd == -1) return(-1);
+
+  wl = calloc(1, sizeof(struct WebListener));
+  if (wl == NULL || fcntl(svrfd, F_SETFL, O_NONBLOCK) == -1) {
+    handleError(LOG_ERR, "Could not create a web listener", -1, 0, 1);
+    close(svrfd);
+    free(wl);
+    return(-1);
+  }
+
+  wl->svrfd = svrfd;
+  snprintf(wl->sIP, sizeof(wl->sIP), "%s", sIP);
+  snprintf(wl->sPort, sizeof(wl->sPort), "%s", sPort);
+  wl->aTimeout = aTimeout;
+  wl->out = out;
+  wl->in = in;
+  wl->nextResp = -1;
+  wl->lastProcess = time(NULL);
+
+  for (i = 0; i < argc && i < 20; i++) {
+    snprintf(wl->respTemps[i], sizeof(wl->respTemps[i]), "%s", argv[i]);
+    wl->respTempsPtrs[i] = wl->respTemps[i];
+  }
+  if (argc > 0) wl->respCount = i;
+
+  // The engine picks it up from webLsnNew when it's woken
+  pthread_mutex_lock(&webLsnLock);
+  wl->id = ++webLsnID;
+  id = wl->id;
+  wl->next = webLsnNew;
+  webLsnNew = wl;
+  pthread_mutex_unlock(&webLsnLock);
+  webLsnSignal();
+
+  sprintf(errStr, "Web listener %d started on port %s", id, lPort);
+  writeLog(LOG_INFO, errStr, 0);
+  return(id);
+}
+
+
+// Stop a web session's listener, returns once the engine has closed it's sessions so the
+// rings it was started with can be freed
+void stopWebListener(int id) {
+  struct WebListener *wl = NULL, *prev = NULL;
+
+  pthread_mutex_lock(&webLsnLock);
+
+  // Not picked up by the engine yet, it can be freed here
+  for (wl = webLsnNew; wl != NULL && wl->id != id; wl = wl->next) prev = wl;
+  if (wl != NULL) {
+    if (prev == NULL) {
+      webLsnNew = wl->next;
+    } else {
+      prev->next = wl->next;
+    }
+    close(wl->svrfd);
+    free(wl);
+    pthread_mutex_unlock(&webLsnLock);
+    return;
+  }
+
+  for (wl = webLsns; wl != NULL && wl->id != id; wl = wl->next);
+  if (wl != NULL) {
+    wl->stopping = 1;
+    webLsnSignal();
+  }
+
+  while (wl != NULL) {
+    pthread_cond_wait(&webLsnCond, &webLsnLock);
+    for (wl = webLsns; wl != NULL && wl->id != id; wl = wl->next);
+  }
+  pthread_mutex_unlock(&webLsnLock);
 }
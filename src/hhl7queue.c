@@ -0,0 +1,689 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>. 
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hhl7extern.h"
+#include "hhl7queue.h"
+#include "hhl7utils.h"
+
+// Outbound store and forward queues, one append only journal file per server:
+//   64 byte header (struct JrnlHdr) then records (struct JrnlRec + message + \0),
+//   each record padded to 8 bytes. Records before head have been ACKed.
+// The whole maximum journal size is mapped up front so pointers in to it stay valid
+// as the file grows. Sequence numbers stop recovery at stale records left behind
+// when an empty journal is reset to the start of the file.
+#define JRNL_MAGIC  "HHL7JRN1"
+#define JRNL_RMAGIC 0x4C374848
+#define JRNL_HDRS   64
+#define JRNL_MINS   1048576
+#define JRNL_MAXS   (1L << 34)
+
+struct JrnlHdr {
+  char magic[8];
+  uint64_t head;
+  uint64_t headSeq;
+  uint64_t tail;
+  uint64_t tailSeq;
+};
+
+struct JrnlRec {
+  uint32_t magic;
+  uint32_t len;
+  uint64_t seq;
+};
+
+// Struct for a servers queue
+struct OutQueue {
+  struct OutQueue *next;
+  char sIP[256];
+  char sPort[6];
+  int fd;
+  char *map;
+  long int fileS;
+  struct JrnlHdr *hdr;
+
+  // Next record to send, records sent but not ACKed and the thread sending them
+  uint64_t sendOff;
+  long int inFlight;
+  pthread_t owner;
+  long int depth;
+
+  // Retry backoff (seconds) after the server failed
+  time_t nextRetry;
+  int backoff;
+
+  // Range written since the last sync, syncing is set while the sync thread is
+  // syncing the journal without the lock, synced is signalled when it's done.
+  // Messages before syncedSeq are on disk
+  long int dirtyStart;
+  long int dirtyEnd;
+  int syncing;
+  uint64_t syncedSeq;
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+};
+
+static struct OutQueue *queues = NULL;
+static pthread_mutex_t queuesLock = PTHREAD_MUTEX_INITIALIZER;
+static char queueDir[256] = "";
+
+// Wakes the sync thread before the group commit interval when a sender is waiting
+static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncWake = PTHREAD_COND_INITIALIZER;
+static int syncReq = 0;
+
+
+// Get the group commit interval for journal syncs (ms)
+static int queueSyncTime() {
+  int syncT = 50;
+
+  if (globalConfig) {
+    if (globalConfig->queueSync >= 0) syncT = globalConfig->queueSync;
+  }
+  return(syncT);
+}
+
+
+// Check if messages the server didn't accept are retried (1) rather than parked
+static int queueNakRetry() {
+  if (globalConfig) {
+    if (strcmp(globalConfig->queueNak, "retry") == 0) return(1);
+  }
+  return(0);
+}
+
+
+// Get the longest time to wait between retries to a failed server (seconds)
+static int queueRetryMax() {
+  int retryT = 60;
+
+  if (globalConfig) {
+    if (globalConfig->queueRetryMax > 0) retryT = globalConfig->queueRetryMax;
+  }
+  return(retryT);
+}
+
+
+// Sync a queue's journal to disk, called with the queue locked. Waits for the sync
+// thread to finish with the mapping first
+static void syncQueue(struct OutQueue *queue) {
+  long int pageS = sysconf(_SC_PAGESIZE), start = 0;
+
+  while (queue->syncing == 1) pthread_cond_wait(&queue->synced, &queue->lock);
+  if (queue->dirtyEnd == 0) return;
+
+  // The header page holds head/tail, then the records written since the last sync
+  msync(queue->map, JRNL_HDRS, MS_SYNC);
+  start = (queue->dirtyStart / pageS) * pageS;
+  if (queue->dirtyEnd > JRNL_HDRS)
+    msync(queue->map + start, queue->dirtyEnd - start, MS_SYNC);
+
+  queue->dirtyStart = 0;
+  queue->dirtyEnd = 0;
+  queue->syncedSeq = queue->hdr->tailSeq;
+}
+
+
+// Group commit thread, syncs the journal writes made since the last sync every
+// queueSync ms, or straight away when a sender is waiting for a message to be synced.
+// The sync is done without the queue's lock so senders keep queueing
+static void *queueSyncer(void *arg) {
+  struct OutQueue *queue = NULL;
+  struct timespec due;
+  char *map = NULL;
+  long int pageS = sysconf(_SC_PAGESIZE), start = 0, end = 0;
+  uint64_t seq = 0;
+  int syncT = queueSyncTime();
+
+  (void) arg;
+
+  while (1) {
+    clock_gettime(CLOCK_REALTIME, &due);
+    due.tv_sec = due.tv_sec + syncT / 1000;
+    due.tv_nsec = due.tv_nsec + (syncT % 1000) * 1000000L;
+    if (due.tv_nsec >= 1000000000L) {
+      due.tv_sec++;
+      due.tv_nsec = due.tv_nsec - 1000000000L;
+    }
+
+    pthread_mutex_lock(&syncLock);
+    while (syncReq == 0 && pthread_cond_timedwait(&syncWake, &syncLock, &due) == 0);
+    syncReq = 0;
+    pthread_mutex_unlock(&syncLock);
+
+    while ((queue = nextQueue(queue)) != NULL) {
+      pthread_mutex_lock(&queue->lock);
+      if (queue->fd == -1 || queue->dirtyEnd == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        continue;
+      }
+      map = queue->map;
+      start = (queue->dirtyStart / pageS) * pageS;
+      end = queue->dirtyEnd;
+      seq = queue->hdr->tailSeq;
+      queue->dirtyStart = 0;
+      queue->dirtyEnd = 0;
+      queue->syncing = 1;
+      pthread_mutex_unlock(&queue->lock);
+
+      msync(map, JRNL_HDRS, MS_SYNC);
+      if (end > JRNL_HDRS) msync(map + start, end - start, MS_SYNC);
+
+      pthread_mutex_lock(&queue->lock);
+      queue->syncing = 0;
+      if (seq > queue->syncedSeq) queue->syncedSeq = seq;
+      pthread_cond_broadcast(&queue->synced);
+      pthread_mutex_unlock(&queue->lock);
+    }
+  }
+  return(NULL);
+}
+
+
+// Enable store and forward queueing, journals are kept in dir, ret 0 on success
+int setQueueDir(char *dir) {
+  pthread_t thread;
+  sigset_t sigs, oldSigs;
+  char errStr[300] = "";
+
+  if (strlen(dir) == 0 || strlen(dir) > 200) {
+    handleError(LOG_ERR, "Invalid queue directory (1-200 chars)", -1, 0, 1);
+    return(-1);
+  }
+
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+    sprintf(errStr, "Cannot create queue directory: %s", dir);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(-1);
+  }
+
+  sprintf(queueDir, "%s", dir);
+
+  // With a group commit interval journals are synced by a thread that runs until the
+  // process exits, signals are left for the main thread
+  if (queueSyncTime() > 0) {
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldSigs);
+    if (pthread_create(&thread, NULL, queueSyncer, NULL) != 0) {
+      pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+      queueDir[0] = '\0';
+      handleError(LOG_ERR, "Failed to start the queue journal sync thread", -1, 0, 1);
+      return(-1);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
+    pthread_detach(thread);
+  }
+
+  sprintf(errStr, "Store and forward queue enabled in: %s", dir);
+  writeLog(LOG_INFO, errStr, 1);
+  return(0);
+}
+
+
+// Check if store and forward queueing is enabled (1=enabled)
+int queueEnabled() {
+  return(queueDir[0] != '\0');
+}
+
+
+// Mark part of the journal as needing a sync
+static void markDirty(struct OutQueue *queue, long int start, long int end) {
+  if (queue->dirtyEnd == 0 || start < queue->dirtyStart) queue->dirtyStart = start;
+  if (end > queue->dirtyEnd) queue->dirtyEnd = end;
+}
+
+
+// Open or create the journal for a queue and find the records not yet ACKed
+static int openJournal(struct OutQueue *queue) {
+  struct stat st;
+  struct JrnlRec *rec;
+  char jFile[600] = "", errStr[700] = "";
+  uint64_t off = 0, seq = 0;
+
+  sprintf(jFile, "%s/%s_%s.jrnl", queueDir, queue->sIP, queue->sPort);
+  queue->fd = open(jFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (queue->fd == -1) {
+    sprintf(errStr, "Cannot open queue journal: %s", jFile);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(-1);
+  }
+
+  // Only one process may use a journal, e.g: the web listener child sends directly
+  if (flock(queue->fd, LOCK_EX | LOCK_NB) == -1) {
+    sprintf(errStr, "Queue journal in use by another process: %s", jFile);
+    writeLog(LOG_DEBUG, errStr, 1);
+    close(queue->fd);
+    return(-1);
+  }
+
+  if (fstat(queue->fd, &st) == -1 ||
+      (st.st_size < JRNL_MINS && ftruncate(queue->fd, JRNL_MINS) == -1)) {
+    sprintf(errStr, "Cannot size queue journal: %s", jFile);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    close(queue->fd);
+    return(-1);
+  }
+  queue->fileS = st.st_size < JRNL_MINS ? JRNL_MINS : st.st_size;
+
+  queue->map = mmap(NULL, JRNL_MAXS, PROT_READ | PROT_WRITE, MAP_SHARED, queue->fd, 0);
+  if (queue->map == MAP_FAILED) {
+    sprintf(errStr, "Cannot map queue journal: %s", jFile);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    close(queue->fd);
+    return(-1);
+  }
+  queue->hdr = (struct JrnlHdr *) queue->map;
+
+  // New journal
+  if (memcmp(queue->hdr->magic, JRNL_MAGIC, 8) != 0) {
+    memcpy(queue->hdr->magic, JRNL_MAGIC, 8);
+    queue->hdr->head = JRNL_HDRS;
+    queue->hdr->headSeq = 1;
+    queue->hdr->tail = JRNL_HDRS;
+    queue->hdr->tailSeq = 1;
+    markDirty(queue, 0, JRNL_HDRS);
+  }
+
+  // Walk the records from head to find the real tail, the header may not have been
+  // synced with the last records written before a crash
+  off = queue->hdr->head;
+  seq = queue->hdr->headSeq;
+  while (off + sizeof(struct JrnlRec) <= (uint64_t) queue->fileS) {
+    rec = (struct JrnlRec *) (queue->map + off);
+    if (rec->magic != JRNL_RMAGIC || rec->seq != seq ||
+        off + sizeof(struct JrnlRec) + rec->len > (uint64_t) queue->fileS) break;
+
+    off = off + ((sizeof(struct JrnlRec) + rec->len + 7) & ~7UL);
+    seq++;
+    queue->depth++;
+  }
+  queue->hdr->tail = off;
+  queue->hdr->tailSeq = seq;
+  queue->syncedSeq = seq;
+  queue->sendOff = queue->hdr->head;
+
+  if (queue->depth > 0) {
+    sprintf(errStr, "Recovered %ld queued messages for %s:%s", queue->depth,
+            queue->sIP, queue->sPort);
+    writeLog(LOG_NOTICE, errStr, 1);
+  }
+  return(0);
+}
+
+
+// Get the queue for sIP:sPort, opening it's journal, NULL if queueing isn't possible
+struct OutQueue *getQueue(char *sIP, char *sPort) {
+  struct OutQueue *queue = NULL;
+
+  if (queueDir[0] == '\0' || strlen(sIP) > 255 || strlen(sPort) > 5) return(NULL);
+
+  pthread_mutex_lock(&queuesLock);
+  for (queue = queues; queue != NULL; queue = queue->next) {
+    if (strcmp(queue->sIP, sIP) == 0 && strcmp(queue->sPort, sPort) == 0) break;
+  }
+
+  if (queue == NULL) {
+    queue = calloc(1, sizeof(struct OutQueue));
+    if (queue != NULL) {
+      sprintf(queue->sIP, "%s", sIP);
+      sprintf(queue->sPort, "%s", sPort);
+      pthread_mutex_init(&queue->lock, NULL);
+      pthread_cond_init(&queue->synced, NULL);
+
+      // Keep a failed journal open as fd -1 so we don't retry it for every message
+      if (openJournal(queue) != 0) queue->fd = -1;
+      queue->next = queues;
+      queues = queue;
+    }
+  }
+  pthread_mutex_unlock(&queuesLock);
+
+  if (queue == NULL || queue->fd == -1) return(NULL);
+  return(queue);
+}
+
+
+// Iterate over the open queues, pass NULL to get the first
+struct OutQueue *nextQueue(struct OutQueue *queue) {
+  struct OutQueue *next = NULL;
+
+  pthread_mutex_lock(&queuesLock);
+  next = (queue == NULL) ? queues : queue->next;
+  while (next != NULL && next->fd == -1) next = next->next;
+  pthread_mutex_unlock(&queuesLock);
+  return(next);
+}
+
+
+// Open every journal in the queue directory, e.g: to drain them
+void openQueues() {
+  DIR *dir = NULL;
+  struct dirent *ent = NULL;
+  char jName[256] = "", *sep = NULL, *ext = NULL;
+
+  dir = opendir(queueDir);
+  if (dir == NULL) return;
+
+  while ((ent = readdir(dir)) != NULL) {
+    // Journal names are <host>_<port>.jrnl
+    if (strlen(ent->d_name) > 255) continue;
+    sprintf(jName, "%s", ent->d_name);
+    ext = strstr(jName, ".jrnl");
+    sep = strrchr(jName, '_');
+    if (ext == NULL || ext[5] != '\0' || sep == NULL || sep > ext) continue;
+
+    *ext = '\0';
+    *sep = '\0';
+    getQueue(jName, sep + 1);
+  }
+  closedir(dir);
+}
+
+
+// Get the server a queue sends to
+void queueTarget(struct OutQueue *queue, char **sIP, char **sPort) {
+  *sIP = queue->sIP;
+  *sPort = queue->sPort;
+}
+
+
+// Append a message to the end of a queue, ret 0 on success
+int queuePush(struct OutQueue *queue, char *msg, long int msgL) {
+  struct JrnlRec *rec;
+  long int recS = (sizeof(struct JrnlRec) + msgL + 1 + 7) & ~7L, newS = 0;
+  uint64_t tail = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  tail = queue->hdr->tail;
+
+  // Grow the journal file, the mapping already covers the maximum size
+  if ((long int) tail + recS > queue->fileS) {
+    newS = queue->fileS * 2;
+    while (newS < (long int) tail + recS) newS = newS * 2;
+    if (newS > JRNL_MAXS || ftruncate(queue->fd, newS) == -1) {
+      pthread_mutex_unlock(&queue->lock);
+      handleError(LOG_ERR, "Queue journal full or could not be extended", -1, 0, 1);
+      return(-1);
+    }
+    queue->fileS = newS;
+  }
+
+  rec = (struct JrnlRec *) (queue->map + tail);
+  memcpy(queue->map + tail + sizeof(struct JrnlRec), msg, msgL);
+  queue->map[tail + sizeof(struct JrnlRec) + msgL] = '\0';
+  rec->len = msgL + 1;
+  rec->seq = queue->hdr->tailSeq;
+  rec->magic = JRNL_RMAGIC;
+
+  queue->hdr->tail = tail + recS;
+  queue->hdr->tailSeq++;
+  __atomic_add_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+  markDirty(queue, tail, tail + recS);
+
+  // Without a group commit interval each message is synced before it's sent
+  if (queueSyncTime() == 0) syncQueue(queue);
+  pthread_mutex_unlock(&queue->lock);
+  return(0);
+}
+
+
+// Claim a queue for sending by this thread, only one thread may have messages in
+// flight so the order is kept, ret 1 if claimed
+int queueClaim(struct OutQueue *queue) {
+  int claimed = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->inFlight == 0 || pthread_equal(queue->owner, pthread_self())) {
+    queue->owner = pthread_self();
+    claimed = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return(claimed);
+}
+
+
+// Get the next unsent message in a queue, qOff is passed to queueSent() once it's been
+// written to a connection, then back to queueAcked()
+// The message points in to the journal, ret 1 if there was a message
+int queueNext(struct OutQueue *queue, char **msg, long int *qOff) {
+  struct JrnlRec *rec;
+  int found = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->sendOff < queue->hdr->tail) {
+    rec = (struct JrnlRec *) (queue->map + queue->sendOff);
+    *msg = queue->map + queue->sendOff + sizeof(struct JrnlRec);
+    *qOff = queue->sendOff + ((sizeof(struct JrnlRec) + rec->len + 7) & ~7UL);
+    found = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return(found);
+}
+
+
+// Mark the message ending at qOff as sent, it's in flight until it's ACKed or rewound
+void queueSent(struct OutQueue *queue, long int qOff) {
+  pthread_mutex_lock(&queue->lock);
+  queue->sendOff = qOff;
+  queue->inFlight++;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Remove ACKed messages, up to the one ending at qOff, from the head of a queue
+void queueAcked(struct OutQueue *queue, long int qOff) {
+  struct JrnlRec *rec;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->hdr->head < (uint64_t) qOff && queue->hdr->head < queue->hdr->tail) {
+    rec = (struct JrnlRec *) (queue->map + queue->hdr->head);
+    queue->hdr->head = queue->hdr->head + ((sizeof(struct JrnlRec) + rec->len + 7) & ~7UL);
+    queue->hdr->headSeq++;
+    __atomic_sub_fetch(&queue->depth, 1, __ATOMIC_RELAXED);
+    if (queue->inFlight > 0) queue->inFlight--;
+  }
+  queue->backoff = 0;
+
+  // Start again from the beginning of the file once everything has been delivered
+  if (queue->hdr->head == queue->hdr->tail && queue->inFlight == 0) {
+    queue->hdr->head = JRNL_HDRS;
+    queue->hdr->tail = JRNL_HDRS;
+    queue->sendOff = JRNL_HDRS;
+  }
+  markDirty(queue, 0, JRNL_HDRS);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Back off exponentially before sending to a queue's server again, called with the
+// queue locked
+static void queueBackoff(struct OutQueue *queue, char *errStr) {
+  queue->backoff = (queue->backoff == 0) ? 1 : queue->backoff * 2;
+  if (queue->backoff > queueRetryMax()) queue->backoff = queueRetryMax();
+  __atomic_store_n(&queue->nextRetry, time(NULL) + queue->backoff, __ATOMIC_RELAXED);
+
+  sprintf(errStr, "Server %s:%s unavailable, %ld messages queued, retry in %d secs",
+          queue->sIP, queue->sPort, queue->depth, queue->backoff);
+}
+
+
+// Resend from the first un-ACKed message after it's connection was closed with
+// messages in flight, backing off first
+void queueRewind(struct OutQueue *queue) {
+  char errStr[330] = "";
+
+  pthread_mutex_lock(&queue->lock);
+  queue->sendOff = queue->hdr->head;
+  queue->inFlight = 0;
+  queueBackoff(queue, errStr);
+  pthread_mutex_unlock(&queue->lock);
+  writeLog(LOG_WARNING, errStr, 1);
+}
+
+
+// Back off after the next message couldn't be sent, none were in flight to rewind
+void queueFailed(struct OutQueue *queue) {
+  char errStr[330] = "";
+
+  pthread_mutex_lock(&queue->lock);
+  queueBackoff(queue, errStr);
+  pthread_mutex_unlock(&queue->lock);
+  writeLog(LOG_WARNING, errStr, 1);
+}
+
+
+// Append the record ending at qOff to the queue's reject file, in --capture format so
+// it can be re-sent with --replay, called with the queue locked, ret 0 on success
+static int parkRecord(struct OutQueue *queue, long int qOff, char *rejFile) {
+  struct JrnlRec *rec = NULL;
+  struct timespec now;
+  uint64_t off = queue->hdr->head, next = 0;
+  FILE *rejFP = NULL;
+  int rv = -1;
+
+  // Find the record, earlier records have normally been ACKed already
+  while (off < queue->hdr->tail) {
+    rec = (struct JrnlRec *) (queue->map + off);
+    next = off + ((sizeof(struct JrnlRec) + rec->len + 7) & ~7UL);
+    if (next == (uint64_t) qOff) break;
+    off = next;
+  }
+  if (off >= queue->hdr->tail) return(-1);
+
+  rejFP = fopen(rejFile, "a");
+  if (rejFP == NULL) return(-1);
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (fprintf(rejFP, "#HHL7 %ld.%09ld %ld\n", (long) now.tv_sec, now.tv_nsec,
+              (long) rec->len - 1) > 0 &&
+      fwrite(queue->map + off + sizeof(struct JrnlRec), 1, rec->len - 1, rejFP) == rec->len - 1 &&
+      fputc('\n', rejFP) != EOF) rv = 0;
+
+  if (fclose(rejFP) != 0) rv = -1;
+  return(rv);
+}
+
+
+// Handle a queued message the server didn't accept (AE, AR, CE or CR). By default it's
+// parked in <host>_<port>.rej and removed from the queue, with queueNak set to retry
+// the queue is rewound and backs off so it's resent. Ret 1 if it's to be retried, the
+// connection must then be dropped (without rewinding again) so any messages after it
+// are also resent, in order
+int queueNak(struct OutQueue *queue, long int qOff, char *aCode) {
+  char rejFile[600] = "", errStr[700] = "";
+  int parked = 0;
+
+  sprintf(rejFile, "%s/%s_%s.rej", queueDir, queue->sIP, queue->sPort);
+
+  pthread_mutex_lock(&queue->lock);
+  if (queueNakRetry() == 1) {
+    queue->sendOff = queue->hdr->head;
+    queue->inFlight = 0;
+    queueBackoff(queue, errStr);
+    pthread_mutex_unlock(&queue->lock);
+    sprintf(errStr, "Queued message not accepted (%s) by %s:%s, retry in %d secs", aCode,
+            queue->sIP, queue->sPort, queue->backoff);
+    writeLog(LOG_WARNING, errStr, 1);
+    return(1);
+  }
+  parked = parkRecord(queue, qOff, rejFile);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (parked == 0) {
+    sprintf(errStr, "Queued message not accepted (%s) by %s:%s, moved to %s", aCode,
+            queue->sIP, queue->sPort, rejFile);
+    writeLog(LOG_WARNING, errStr, 1);
+  } else {
+    sprintf(errStr, "Queued message not accepted (%s) by %s:%s, could not write %s", aCode,
+            queue->sIP, queue->sPort, rejFile);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+  }
+  queueAcked(queue, qOff);
+  return(0);
+}
+
+
+// Check if a queue may be sent to, ret 0 while backing off after a failure. Read
+// without the lock, so the fields it's changed under are read atomically
+int queueReady(struct OutQueue *queue) {
+  return(time(NULL) >= __atomic_load_n(&queue->nextRetry, __ATOMIC_RELAXED));
+}
+
+
+// Get the number of messages in a queue not yet ACKed
+long int queueDepth(struct OutQueue *queue) {
+  return(__atomic_load_n(&queue->depth, __ATOMIC_RELAXED));
+}
+
+
+// Wait until every message pushed to a queue so far is synced to disk, the sync
+// thread is woken to sync them straight away
+void queueWaitSync(struct OutQueue *queue) {
+  uint64_t seq = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  seq = queue->hdr->tailSeq;
+  if (queue->syncedSeq < seq) {
+    pthread_mutex_lock(&syncLock);
+    syncReq = 1;
+    pthread_cond_signal(&syncWake);
+    pthread_mutex_unlock(&syncLock);
+  }
+  while (queue->syncedSeq < seq && queue->fd != -1)
+    pthread_cond_wait(&queue->synced, &queue->lock);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+
+// Sync all queues with writes outstanding, without waiting for the sync thread
+void syncQueues() {
+  struct OutQueue *queue = NULL;
+
+  while ((queue = nextQueue(queue)) != NULL) {
+    pthread_mutex_lock(&queue->lock);
+    syncQueue(queue);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
+
+
+// Sync and close all queues, once every thread sending to them has stopped. The queues
+// themselves aren't freed as the sync thread may still be walking them
+void closeQueues() {
+  struct OutQueue *queue = NULL;
+
+  while ((queue = nextQueue(queue)) != NULL) {
+    pthread_mutex_lock(&queue->lock);
+    syncQueue(queue);
+    munmap(queue->map, JRNL_MAXS);
+    close(queue->fd);
+    queue->fd = -1;
+    pthread_cond_broadcast(&queue->synced);
+    pthread_mutex_unlock(&queue->lock);
+  }
+}
@@ -0,0 +1,32 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>. 
+*/
+
+// Function Prototypes
+int setQueueDir(char *dir);
+int queueEnabled();
+struct OutQueue *getQueue(char *sIP, char *sPort);
+struct OutQueue *nextQueue(struct OutQueue *queue);
+void openQueues();
+void queueTarget(struct OutQueue *queue, char **sIP, char **sPort);
+int queuePush(struct OutQueue *queue, char *msg, long int msgL);
+int queueClaim(struct OutQueue *queue);
+int queueNext(struct OutQueue *queue, char **msg, long int *qOff);
+void queueSent(struct OutQueue *queue, long int qOff);
+void queueAcked(struct OutQueue *queue, long int qOff);
+int queueNak(struct OutQueue *queue, long int qOff, char *aCode);
+void queueRewind(struct OutQueue *queue);
+void queueFailed(struct OutQueue *queue);
+int queueReady(struct OutQueue *queue);
+long int queueDepth(struct OutQueue *queue);
+void queueWaitSync(struct OutQueue *queue);
+void syncQueues();
+void closeQueues();
@@ -0,0 +1,482 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>. 
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "hhl7stats.h"
+
+
+// Per thread send statistics and the merged totals
+static __thread struct SendStats threadStats;
+static struct SendStats totalStats;
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Per thread listener statistics, the merged totals and when the listener started
+static __thread struct RecvStats threadRecv;
+static struct RecvStats totalRecv;
+static struct timespec recvStart;
+static const char ackCodes[7][3] = { "AA", "AE", "AR", "CA", "CE", "CR", "??" };
+static const double histPcts[4] = { 50, 90, 99, 99.9 };
+
+
+// Get the microseconds elapsed since start
+static uint64_t usSince(struct timespec *start) {
+  struct timespec now;
+  int64_t us = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+  if (us < 0) us = 0;
+  return((uint64_t) us);
+}
+
+
+// Find the histogram bucket for a value, exact below 2*HIST_SUBS then log-linear
+static int histIndex(uint64_t val) {
+  int msb = 63 - __builtin_clzll(val | 1), shift = 0, idx = 0;
+
+  if (val < 2 * HIST_SUBS) return((int) val);
+
+  shift = msb - HIST_SUBBITS;
+  idx = 2 * HIST_SUBS + (shift - 1) * HIST_SUBS + (int) ((val >> shift) - HIST_SUBS);
+  if (idx >= HIST_SIZE) idx = HIST_SIZE - 1;
+  return(idx);
+}
+
+
+// Get the mid point value of a histogram bucket
+static uint64_t histValue(int idx) {
+  int shift = 0;
+  uint64_t sub = 0;
+
+  if (idx < 2 * HIST_SUBS) return((uint64_t) idx);
+
+  shift = (idx - 2 * HIST_SUBS) / HIST_SUBS + 1;
+  sub = (idx - 2 * HIST_SUBS) % HIST_SUBS + HIST_SUBS;
+  return((sub << shift) + ((1ULL << shift) >> 1));
+}
+
+
+// Add a value to a histogram
+static void histAdd(struct LatHist *hist, uint64_t val) {
+  hist->buckets[histIndex(val)]++;
+  hist->count++;
+  hist->total = hist->total + val;
+  if (val > hist->max) hist->max = val;
+}
+
+
+// Add one histogram to another
+static void histMerge(struct LatHist *dest, struct LatHist *src) {
+  int b = 0;
+
+  for (b = 0; b < HIST_SIZE; b++) dest->buckets[b] = dest->buckets[b] + src->buckets[b];
+  dest->count = dest->count + src->count;
+  dest->total = dest->total + src->total;
+  if (src->max > dest->max) dest->max = src->max;
+}
+
+
+// Get the value (ms) at a percentile of a histogram
+static double histPercentile(struct LatHist *hist, double pct) {
+  long int target = (long int) (hist->count * pct / 100.0 + 0.5), seen = 0;
+  uint64_t val = 0;
+  int b = 0;
+
+  if (target < 1) target = 1;
+  for (b = 0; b < HIST_SIZE; b++) {
+    seen = seen + hist->buckets[b];
+    if (seen >= target) break;
+  }
+
+  val = histValue(b);
+  if (val > hist->max) val = hist->max;
+  return(val / 1000.0);
+}
+
+
+// Record a message written to a server
+void statsSent(long int bytes) {
+  threadStats.sent++;
+  threadStats.bytes = threadStats.bytes + bytes;
+}
+
+
+// Record the time taken to connect to a server since start
+void statsConnect(struct timespec *start) {
+  histAdd(&threadStats.connHist, usSince(start));
+}
+
+
+// Record the time taken to write a message to a server since start
+void statsWrite(struct timespec *start) {
+  histAdd(&threadStats.writeHist, usSince(start));
+}
+
+
+// Record an ACK received from a server, returns the round trip time (ms) since sent
+double statsACK(char *aCode, struct timespec *sent) {
+  return(statsTargetACK(&threadStats, aCode, sent));
+}
+
+
+// Record messages that failed to send or never received an ACK
+void statsFailed(long int count) {
+  threadStats.failed = threadStats.failed + count;
+}
+
+
+// Record how late a scheduled send was issued (ms), anything over 1ms counts as late
+void statsLag(double lag) {
+  if (lag > 1) threadStats.late++;
+  if (lag > threadStats.lagMax) threadStats.lagMax = lag;
+}
+
+
+// Record a resolved address cache lookup, hit=1 if it was found in the cache
+void statsAddrCache(int hit) {
+  if (hit == 1) {
+    threadStats.addrHits++;
+  } else {
+    threadStats.addrMisses++;
+  }
+}
+
+
+// Record a completed TLS handshake, resumed=1 if a cached session was reused
+void statsTLS(int resumed) {
+  if (resumed == 1) {
+    threadStats.tlsResumed++;
+  } else {
+    threadStats.tlsFull++;
+  }
+}
+
+
+// Record an acknowledged batch of msgs messages, rejected of which weren't accepted
+void statsBatch(long int msgs, long int rejected) {
+  threadStats.batches++;
+  threadStats.batchMsgs = threadStats.batchMsgs + msgs;
+  threadStats.batchRejected = threadStats.batchRejected + rejected;
+}
+
+
+// Record a message written to a server in a separate set of statistics, e.g: per target
+void statsTargetSent(struct SendStats *stats, long int bytes) {
+  stats->sent++;
+  stats->bytes = stats->bytes + bytes;
+}
+
+
+// Record an ACK in a separate set of statistics, returns the round trip time (ms)
+double statsTargetACK(struct SendStats *stats, char *aCode, struct timespec *sent) {
+  uint64_t rtt = usSince(sent);
+  int c = 0;
+
+  for (c = 0; c < 6; c++) {
+    if (strcmp(aCode, ackCodes[c]) == 0) break;
+  }
+
+  stats->codes[c]++;
+  stats->acked++;
+  histAdd(&stats->ackHist, rtt);
+  return(rtt / 1000.0);
+}
+
+
+// Record failed messages in a separate set of statistics
+void statsTargetFailed(struct SendStats *stats, long int count) {
+  stats->failed = stats->failed + count;
+}
+
+
+// Add this threads statistics to dest and reset them
+void mergeStats(struct SendStats *dest) {
+  int c = 0;
+
+  dest->sent = dest->sent + threadStats.sent;
+  dest->bytes = dest->bytes + threadStats.bytes;
+  dest->acked = dest->acked + threadStats.acked;
+  dest->failed = dest->failed + threadStats.failed;
+  for (c = 0; c < 7; c++) dest->codes[c] = dest->codes[c] + threadStats.codes[c];
+  dest->late = dest->late + threadStats.late;
+  if (threadStats.lagMax > dest->lagMax) dest->lagMax = threadStats.lagMax;
+  dest->addrHits = dest->addrHits + threadStats.addrHits;
+  dest->addrMisses = dest->addrMisses + threadStats.addrMisses;
+  dest->tlsFull = dest->tlsFull + threadStats.tlsFull;
+  dest->tlsResumed = dest->tlsResumed + threadStats.tlsResumed;
+  dest->batches = dest->batches + threadStats.batches;
+  dest->batchMsgs = dest->batchMsgs + threadStats.batchMsgs;
+  dest->batchRejected = dest->batchRejected + threadStats.batchRejected;
+  histMerge(&dest->connHist, &threadStats.connHist);
+  histMerge(&dest->writeHist, &threadStats.writeHist);
+  histMerge(&dest->ackHist, &threadStats.ackHist);
+
+  memset(&threadStats, 0, sizeof(threadStats));
+}
+
+
+// Add this threads statistics to the run totals and reset them
+void mergeSendStats() {
+  pthread_mutex_lock(&statsLock);
+  mergeStats(&totalStats);
+  pthread_mutex_unlock(&statsLock);
+}
+
+
+// Print a latency histograms percentiles
+static void printHist(char *name, struct LatHist *hist) {
+  int p = 0;
+
+  if (hist->count == 0) return;
+
+  printf("%-18s", name);
+  for (p = 0; p < 4; p++) printf("p%g %.3f, ", histPcts[p], histPercentile(hist, histPcts[p]));
+  printf("max %.3f ms (%ld)\n", hist->max / 1000.0, hist->count);
+}
+
+
+// Print the end of run report for messages sent over secs seconds, isRated=1 for --rate
+void printSendStats(double secs, int isRated) {
+  int c = 0;
+
+  if (secs <= 0) secs = 0.000001;
+
+  printf("Messages sent:    %ld (%ld failed)\n", totalStats.sent, totalStats.failed);
+  printf("Run time:         %.3f s\n", secs);
+  printf("Message rate:     %.1f msg/s\n", totalStats.sent / secs);
+  printf("Data rate:        %.1f bytes/s (%ld bytes)\n", totalStats.bytes / secs,
+                                                         totalStats.bytes);
+  printf("ACKs received:    %ld\n", totalStats.acked);
+  for (c = 0; c < 7; c++) {
+    if (totalStats.codes[c] > 0) printf("  %s:              %ld\n", ackCodes[c],
+                                        totalStats.codes[c]);
+  }
+  if (totalStats.addrHits + totalStats.addrMisses > 0) {
+    printf("Address cache:    %ld hits, %ld misses\n", totalStats.addrHits,
+           totalStats.addrMisses);
+  }
+  if (totalStats.batches > 0) {
+    printf("Batches ACKed:    %ld (%ld messages, %ld rejected)\n", totalStats.batches,
+           totalStats.batchMsgs, totalStats.batchRejected);
+  }
+  if (totalStats.tlsFull + totalStats.tlsResumed > 0) {
+    printf("TLS handshakes:   %ld (%ld resumed)\n", totalStats.tlsFull + totalStats.tlsResumed,
+           totalStats.tlsResumed);
+  }
+  printHist("Connect latency:", &totalStats.connHist);
+  printHist("Write latency:", &totalStats.writeHist);
+  printHist("ACK latency:", &totalStats.ackHist);
+  if (isRated == 1) {
+    printf("Behind schedule:  %ld sends late (>1 ms), max lag %.3f ms\n",
+           totalStats.late, totalStats.lagMax);
+  }
+}
+
+
+// Print a one line summary for a target, header=1 to print the column headings first
+void printTargetStats(char *name, struct SendStats *stats, int header) {
+  struct LatHist *hist = &stats->ackHist;
+  int c = 0;
+
+  if (header == 1) {
+    printf("%-24s %8s %8s %8s %9s %9s %9s  %s\n", "Target", "Sent", "ACKed", "Failed",
+           "p50 ms", "p99 ms", "max ms", "Codes");
+  }
+
+  printf("%-24.24s %8ld %8ld %8ld %9.3f %9.3f %9.3f ", name, stats->sent, stats->acked,
+         stats->failed, hist->count > 0 ? histPercentile(hist, 50) : 0,
+         hist->count > 0 ? histPercentile(hist, 99) : 0, hist->max / 1000.0);
+  for (c = 0; c < 7; c++) {
+    if (stats->codes[c] > 0) printf(" %s:%ld", ackCodes[c], stats->codes[c]);
+  }
+  printf("\n");
+}
+
+
+// Add a latency histogram to a JSON buffer
+static int histJSON(char *buf, int bufS, char *name, struct LatHist *hist) {
+  int p = 0, l = 0;
+
+  l = snprintf(buf, bufS, "\"%s\":{\"count\":%ld", name, hist->count);
+  for (p = 0; p < 4 && l < bufS; p++) {
+    l += snprintf(buf + l, bufS - l, ",\"p%g\":%.3f", histPcts[p],
+                  hist->count > 0 ? histPercentile(hist, histPcts[p]) : 0);
+  }
+  if (l < bufS) l += snprintf(buf + l, bufS - l, ",\"max\":%.3f}", hist->max / 1000.0);
+  return(l);
+}
+
+
+// Write send statistics as JSON to buf, percentiles in milliseconds
+int sendStatsJSON(struct SendStats *stats, char *buf, int bufS) {
+  int c = 0, l = 0;
+
+  l = snprintf(buf, bufS, "{\"sent\":%ld,\"bytes\":%ld,\"acked\":%ld,\"failed\":%ld,\"codes\":{",
+               stats->sent, stats->bytes, stats->acked, stats->failed);
+  for (c = 0; c < 7 && l < bufS; c++) {
+    l += snprintf(buf + l, bufS - l, "%s\"%s\":%ld", c > 0 ? "," : "", ackCodes[c],
+                  stats->codes[c]);
+  }
+  if (l < bufS) l += snprintf(buf + l, bufS - l, "},\"addrCache\":{\"hits\":%ld,\"misses\":%ld},",
+                              stats->addrHits, stats->addrMisses);
+  if (l < bufS) l += snprintf(buf + l, bufS - l, "\"tls\":{\"full\":%ld,\"resumed\":%ld},",
+                              stats->tlsFull, stats->tlsResumed);
+  if (l < bufS) l += snprintf(buf + l, bufS - l,
+                              "\"batches\":{\"acked\":%ld,\"messages\":%ld,\"rejected\":%ld},",
+                              stats->batches, stats->batchMsgs, stats->batchRejected);
+  if (l < bufS) l += histJSON(buf + l, bufS - l, "connect", &stats->connHist);
+  if (l < bufS) l += snprintf(buf + l, bufS - l, ",");
+  if (l < bufS) l += histJSON(buf + l, bufS - l, "write", &stats->writeHist);
+  if (l < bufS) l += snprintf(buf + l, bufS - l, ",");
+  if (l < bufS) l += histJSON(buf + l, bufS - l, "ack", &stats->ackHist);
+  if (l < bufS) l += snprintf(buf + l, bufS - l, "}");
+  return(l);
+}
+
+
+// Start collecting listener statistics, the report is only printed once started
+void startRecvStats() {
+  clock_gettime(CLOCK_MONOTONIC, &recvStart);
+}
+
+
+// Record a message received by the listener
+void statsRecv(long int bytes) {
+  threadRecv.received++;
+  threadRecv.bytes = threadRecv.bytes + bytes;
+}
+
+
+// Record a connection accepted by the listener
+void statsSession() {
+  threadRecv.sessions++;
+}
+
+
+// Record the ACK code sent for a received message
+void statsACKSent(char *aCode) {
+  int c = 0;
+
+  for (c = 0; c < 6; c++) {
+    if (strcmp(aCode, ackCodes[c]) == 0) break;
+  }
+  threadRecv.codes[c]++;
+  threadRecv.acks++;
+}
+
+
+// Record a message added to (or dropped from) a listener's ingest ring, and the ring's
+// depth once it was added
+void statsIngest(long int depth, int dropped) {
+  if (dropped == 1) {
+    threadRecv.dropped++;
+    return;
+  }
+  threadRecv.ingested++;
+  if (depth > threadRecv.depthMax) threadRecv.depthMax = depth;
+}
+
+
+// Record how long a message waited in an ingest ring before it was processed
+void statsIngestWait(struct timespec *queued) {
+  histAdd(&threadRecv.waitHist, usSince(queued));
+}
+
+
+// Record a duplicate message received, or an entry evicted from the duplicate table
+// as it was full
+void statsDuplicate(int evicted) {
+  if (evicted == 1) {
+    threadRecv.dupEvicted++;
+    return;
+  }
+  threadRecv.duplicates++;
+}
+
+
+// Add this threads listener statistics to the totals and reset them
+void mergeRecvStats() {
+  int c = 0;
+
+  pthread_mutex_lock(&statsLock);
+  totalRecv.received = totalRecv.received + threadRecv.received;
+  totalRecv.bytes = totalRecv.bytes + threadRecv.bytes;
+  totalRecv.sessions = totalRecv.sessions + threadRecv.sessions;
+  totalRecv.acks = totalRecv.acks + threadRecv.acks;
+  for (c = 0; c < 7; c++) totalRecv.codes[c] = totalRecv.codes[c] + threadRecv.codes[c];
+  totalRecv.ingested = totalRecv.ingested + threadRecv.ingested;
+  totalRecv.dropped = totalRecv.dropped + threadRecv.dropped;
+  if (threadRecv.depthMax > totalRecv.depthMax) totalRecv.depthMax = threadRecv.depthMax;
+  totalRecv.duplicates = totalRecv.duplicates + threadRecv.duplicates;
+  totalRecv.dupEvicted = totalRecv.dupEvicted + threadRecv.dupEvicted;
+  histMerge(&totalRecv.waitHist, &threadRecv.waitHist);
+  pthread_mutex_unlock(&statsLock);
+
+  memset(&threadRecv, 0, sizeof(threadRecv));
+}
+
+
+// Print the listener report, other workers statistics are up to a second old
+void printRecvStats() {
+  struct RecvStats tot;
+  struct timespec now;
+  double secs = 0;
+  int c = 0;
+
+  if (recvStart.tv_sec == 0) return;
+
+  pthread_mutex_lock(&statsLock);
+  tot = totalRecv;
+  pthread_mutex_unlock(&statsLock);
+
+  // Include this threads statistics not yet merged
+  tot.received = tot.received + threadRecv.received;
+  tot.bytes = tot.bytes + threadRecv.bytes;
+  tot.sessions = tot.sessions + threadRecv.sessions;
+  tot.acks = tot.acks + threadRecv.acks;
+  for (c = 0; c < 7; c++) tot.codes[c] = tot.codes[c] + threadRecv.codes[c];
+  tot.ingested = tot.ingested + threadRecv.ingested;
+  tot.dropped = tot.dropped + threadRecv.dropped;
+  if (threadRecv.depthMax > tot.depthMax) tot.depthMax = threadRecv.depthMax;
+  tot.duplicates = tot.duplicates + threadRecv.duplicates;
+  tot.dupEvicted = tot.dupEvicted + threadRecv.dupEvicted;
+  histMerge(&tot.waitHist, &threadRecv.waitHist);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - recvStart.tv_sec) + (now.tv_nsec - recvStart.tv_nsec) / 1000000000.0;
+  if (secs <= 0) secs = 0.000001;
+
+  printf("Messages received: %ld\n", tot.received);
+  printf("Connections:       %ld\n", tot.sessions);
+  printf("Run time:          %.3f s\n", secs);
+  printf("Message rate:      %.1f msg/s\n", tot.received / secs);
+  printf("Data rate:         %.1f bytes/s (%ld bytes)\n", tot.bytes / secs, tot.bytes);
+  printf("ACKs sent:         %ld\n", tot.acks);
+  for (c = 0; c < 7; c++) {
+    if (tot.codes[c] > 0) printf("  %s:               %ld\n", ackCodes[c], tot.codes[c]);
+  }
+
+  if (tot.ingested + tot.dropped > 0) {
+    printf("Ingest ring:       %ld queued, %ld dropped, max depth %ld\n", tot.ingested,
+           tot.dropped, tot.depthMax);
+    printHist("Queue wait:", &tot.waitHist);
+  }
+
+  if (tot.duplicates + tot.dupEvicted > 0) {
+    printf("Duplicates:        %ld (%ld evicted from a full table)\n", tot.duplicates,
+           tot.dupEvicted);
+  }
+}
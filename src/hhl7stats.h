@@ -0,0 +1,87 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>. 
+*/
+
+// Log-linear latency histogram (microseconds), 32 linear sub-buckets per power of 2
+#define HIST_SUBBITS 5
+#define HIST_SUBS    (1 << HIST_SUBBITS)
+#define HIST_SIZE    ((40 - HIST_SUBBITS) * HIST_SUBS)
+
+struct LatHist {
+  long int count;
+  double total;
+  uint64_t max;
+  long int buckets[HIST_SIZE];
+};
+
+// Send statistics, one set per thread merged in to a total at the end of a run
+struct SendStats {
+  long int sent;
+  long int bytes;
+  long int acked;
+  long int failed;
+  long int codes[7];
+  long int late;
+  double lagMax;
+  long int addrHits;
+  long int addrMisses;
+  long int tlsFull;
+  long int tlsResumed;
+  long int batches;
+  long int batchMsgs;
+  long int batchRejected;
+  struct LatHist connHist;
+  struct LatHist writeHist;
+  struct LatHist ackHist;
+};
+
+// Listener statistics, one set per listener worker merged in to a total once a second
+struct RecvStats {
+  long int received;
+  long int bytes;
+  long int sessions;
+  long int acks;
+  long int codes[7];
+  long int ingested;
+  long int dropped;
+  long int depthMax;
+  long int duplicates;
+  long int dupEvicted;
+  struct LatHist waitHist;
+};
+
+// Function Prototypes
+void statsSent(long int bytes);
+void statsConnect(struct timespec *start);
+void statsWrite(struct timespec *start);
+double statsACK(char *aCode, struct timespec *sent);
+void statsFailed(long int count);
+void statsLag(double lag);
+void statsAddrCache(int hit);
+void statsTLS(int resumed);
+void statsBatch(long int msgs, long int rejected);
+void statsTargetSent(struct SendStats *stats, long int bytes);
+double statsTargetACK(struct SendStats *stats, char *aCode, struct timespec *sent);
+void statsTargetFailed(struct SendStats *stats, long int count);
+void mergeStats(struct SendStats *dest);
+void mergeSendStats();
+void printSendStats(double secs, int isRated);
+void printTargetStats(char *name, struct SendStats *stats, int header);
+int sendStatsJSON(struct SendStats *stats, char *buf, int bufS);
+void startRecvStats();
+void statsRecv(long int bytes);
+void statsSession();
+void statsACKSent(char *aCode);
+void statsIngest(long int depth, int dropped);
+void statsIngestWait(struct timespec *queued);
+void statsDuplicate(int evicted);
+void mergeRecvStats();
+void printRecvStats();
@@ -0,0 +1,286 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include "hhl7extern.h"
+#include "hhl7tls.h"
+#include "hhl7utils.h"
+
+// Contexts for outbound (client) and inbound (server) MLLP connections, NULL if disabled
+static SSL_CTX *cliCtx = NULL;
+static SSL_CTX *svrCtx = NULL;
+
+// Last session negotiated with each server, reused to skip the full handshake
+struct TLSSession {
+  struct TLSSession *next;
+  char host[256];
+  char port[6];
+  SSL_SESSION *sess;
+};
+
+static struct TLSSession *tlsSessions = NULL;
+static pthread_mutex_t tlsLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Get the certificate verification setting from config, default 1 (verify)
+static int tlsVerify() {
+  if (globalConfig) {
+    if (globalConfig->tlsVerify >= 0) return(globalConfig->tlsVerify);
+  }
+  return(1);
+}
+
+
+// Log a TLS error with the reason from OpenSSL's error queue
+void tlsError(char *msg, SSL *ssl) {
+  char errStr[512] = "", reason[256] = "";
+  unsigned long err = ERR_get_error();
+  long vErr = X509_V_OK;
+
+  if (ssl != NULL) vErr = SSL_get_verify_result(ssl);
+
+  if (vErr != X509_V_OK) {
+    snprintf(reason, sizeof(reason), "%s", X509_verify_cert_error_string(vErr));
+  } else if (err != 0) {
+    ERR_error_string_n(err, reason, sizeof(reason));
+  } else {
+    sprintf(reason, "%s", "connection closed");
+  }
+  ERR_clear_error();
+
+  snprintf(errStr, sizeof(errStr), "%s: %s", msg, reason);
+  handleError(LOG_ERR, errStr, -1, 0, 1);
+}
+
+
+// Keep a new session from a server for the next connection, called by OpenSSL once
+// the session (or with TLS 1.3 it's ticket) arrives
+static int saveSession(SSL *ssl, SSL_SESSION *sess) {
+  struct TLSSession *entry = SSL_get_app_data(ssl);
+
+  if (entry == NULL) return(0);
+
+  pthread_mutex_lock(&tlsLock);
+  if (entry->sess != NULL) SSL_SESSION_free(entry->sess);
+  entry->sess = sess;
+  pthread_mutex_unlock(&tlsLock);
+
+  // Returning 1 keeps our reference to the session
+  return(1);
+}
+
+
+// Find (or add) the cached session entry for a server
+static struct TLSSession *findSession(char *host, char *port) {
+  struct TLSSession *entry = NULL;
+
+  pthread_mutex_lock(&tlsLock);
+  for (entry = tlsSessions; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) break;
+  }
+
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(struct TLSSession));
+    if (entry != NULL) {
+      snprintf(entry->host, sizeof(entry->host), "%s", host);
+      snprintf(entry->port, sizeof(entry->port), "%s", port);
+      entry->next = tlsSessions;
+      tlsSessions = entry;
+    }
+  }
+  pthread_mutex_unlock(&tlsLock);
+
+  return(entry);
+}
+
+
+// Create the client context used to connect to servers
+static int initClient() {
+  char errStr[300] = "";
+
+  cliCtx = SSL_CTX_new(TLS_client_method());
+  if (cliCtx == NULL) {
+    tlsError("Could not create TLS client context", NULL);
+    return(-1);
+  }
+  SSL_CTX_set_min_proto_version(cliCtx, TLS1_2_VERSION);
+
+  // Verify servers against the configured CA file, or the system CAs
+  if (tlsVerify() == 1) {
+    SSL_CTX_set_verify(cliCtx, SSL_VERIFY_PEER, NULL);
+    if (globalConfig && strlen(globalConfig->tlsCA) > 0) {
+      if (SSL_CTX_load_verify_locations(cliCtx, globalConfig->tlsCA, NULL) != 1) {
+        sprintf(errStr, "Could not load TLS CA file: %s", globalConfig->tlsCA);
+        tlsError(errStr, NULL);
+        return(-1);
+      }
+    } else {
+      SSL_CTX_set_default_verify_paths(cliCtx);
+    }
+
+  } else {
+    SSL_CTX_set_verify(cliCtx, SSL_VERIFY_NONE, NULL);
+    writeLog(LOG_WARNING, "TLS server certificates will not be verified (tlsVerify is 0)", 1);
+  }
+
+  // Sessions are kept per server by saveSession() rather than OpenSSL's internal cache
+  SSL_CTX_set_session_cache_mode(cliCtx, SSL_SESS_CACHE_CLIENT |
+                                         SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(cliCtx, saveSession);
+  return(0);
+}
+
+
+// Create the server context used when listening, from the TLS or web cert files
+static int initServer() {
+  char tKey[256] = "", tCrt[256] = "", errStr[300] = "";
+
+  if (globalConfig && strlen(globalConfig->tlsKey) > 0 && strlen(globalConfig->tlsCrt) > 0) {
+    sprintf(tKey, "%s", globalConfig->tlsKey);
+    sprintf(tCrt, "%s", globalConfig->tlsCrt);
+
+  } else if (globalConfig && strlen(globalConfig->wKey) > 0 && strlen(globalConfig->wCrt) > 0) {
+    sprintf(tKey, "%s", globalConfig->wKey);
+    sprintf(tCrt, "%s", globalConfig->wCrt);
+
+  } else if (isDaemon == 1) {
+    sprintf(tKey, "%s", "/usr/local/hhl7/certs/server.key");
+    sprintf(tCrt, "%s", "/usr/local/hhl7/certs/server.pem");
+
+  } else {
+    sprintf(tKey, "%s", "./certs/server.key");
+    sprintf(tCrt, "%s", "./certs/server.pem");
+  }
+
+  svrCtx = SSL_CTX_new(TLS_server_method());
+  if (svrCtx == NULL) {
+    tlsError("Could not create TLS server context", NULL);
+    return(-1);
+  }
+  SSL_CTX_set_min_proto_version(svrCtx, TLS1_2_VERSION);
+
+  if (SSL_CTX_use_certificate_chain_file(svrCtx, tCrt) != 1 ||
+      SSL_CTX_use_PrivateKey_file(svrCtx, tKey, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(svrCtx) != 1) {
+    sprintf(errStr, "Could not load TLS key/cert files (%s, %s)", tKey, tCrt);
+    tlsError(errStr, NULL);
+    return(-1);
+  }
+
+  // Allow clients to resume sessions, by ticket or by ID from the server cache
+  SSL_CTX_set_session_id_context(svrCtx, (unsigned char *) "hhl7", 4);
+  SSL_CTX_set_session_cache_mode(svrCtx, SSL_SESS_CACHE_SERVER);
+  return(0);
+}
+
+
+// Enable TLS for outbound (client=1) and/or inbound (server=1) connections
+int setTLS(int client, int server) {
+  // Writes to a connection the server has closed must fail, not kill the process
+  signal(SIGPIPE, SIG_IGN);
+
+  if (client == 1 && cliCtx == NULL && initClient() != 0) return(-1);
+  if (server == 1 && svrCtx == NULL && initServer() != 0) return(-1);
+
+  writeLog(LOG_INFO, "MLLP over TLS enabled", 1);
+  return(0);
+}
+
+
+// Check if outbound connections use TLS (ret 1 if they do)
+int tlsClientEnabled() {
+  return(cliCtx != NULL);
+}
+
+
+// Check if inbound connections use TLS (ret 1 if they do)
+int tlsServerEnabled() {
+  return(svrCtx != NULL);
+}
+
+
+// Create a client connection on a connected socket, ready for SSL_connect(), with the
+// servers name set for verification and it's last session set for resumption
+SSL *tlsClient(int sockfd, char *host, char *port) {
+  struct TLSSession *entry = findSession(host, port);
+  unsigned char ipBuf[16];
+  SSL *ssl = SSL_new(cliCtx);
+
+  if (ssl == NULL || SSL_set_fd(ssl, sockfd) != 1) {
+    tlsError("Could not create TLS connection", NULL);
+    SSL_free(ssl);
+    return(NULL);
+  }
+
+  // Check the certificate is for the host we're connecting to, IPs match IP SANs
+  if (inet_pton(AF_INET, host, ipBuf) == 1) {
+    if (tlsVerify() == 1) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+  } else {
+    SSL_set_tlsext_host_name(ssl, host);
+    if (tlsVerify() == 1) SSL_set1_host(ssl, host);
+  }
+
+  SSL_set_app_data(ssl, entry);
+  if (entry != NULL) {
+    pthread_mutex_lock(&tlsLock);
+    if (entry->sess != NULL) SSL_set_session(ssl, entry->sess);
+    pthread_mutex_unlock(&tlsLock);
+  }
+
+  return(ssl);
+}
+
+
+// Forget a servers session after a failed handshake, the next connection starts afresh
+void tlsClientFailed(SSL *ssl) {
+  struct TLSSession *entry = SSL_get_app_data(ssl);
+
+  if (entry == NULL) return;
+
+  pthread_mutex_lock(&tlsLock);
+  if (entry->sess != NULL) SSL_SESSION_free(entry->sess);
+  entry->sess = NULL;
+  pthread_mutex_unlock(&tlsLock);
+}
+
+
+// Create a server connection on an accepted socket, ready for SSL_accept()
+SSL *tlsServer(int sockfd) {
+  SSL *ssl = SSL_new(svrCtx);
+
+  if (ssl == NULL || SSL_set_fd(ssl, sockfd) != 1) {
+    tlsError("Could not create TLS connection", NULL);
+    SSL_free(ssl);
+    return(NULL);
+  }
+  return(ssl);
+}
+
+
+// Send a close notify (without waiting for the reply) and free a connection,
+// the socket is left for the caller to close
+void tlsClose(SSL *ssl) {
+  if (ssl == NULL) return;
+  if (SSL_is_init_finished(ssl) && (SSL_get_shutdown(ssl) & SSL_SENT_SHUTDOWN) == 0)
+    SSL_shutdown(ssl);
+  ERR_clear_error();
+  SSL_free(ssl);
+}
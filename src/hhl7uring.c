@@ -0,0 +1,323 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "hhl7uring.h"
+#include "hhl7utils.h"
+
+// Use io_uring for listening and stop & wait sends, set once at startup
+static int useURing = 0;
+
+// Multishot recv with provided buffer rings needs Linux 6.0 headers, older builds only
+// have the epoll backend
+#ifdef IORING_RECV_MULTISHOT
+
+
+// Check the running kernel supports everything the io_uring backend uses, by receiving
+// a byte over a socket pair with a multishot recv in to a provided buffer. Linux 5.19
+// has provided buffer rings but rejects a multishot recv with -EINVAL
+static int uringProbe() {
+  struct URing ring;
+  struct io_uring_sqe *sqe = NULL;
+  struct io_uring_cqe *cqe = NULL;
+  int fds[2] = { -1, -1 }, rv = -1;
+
+  if (uringInit(&ring, 8) != 0) return(-1);
+
+  if (uringBufs(&ring, 8, 4096) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0 &&
+      write(fds[1], "x", 1) == 1 && (sqe = uringSQE(&ring)) != NULL) {
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fds[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+
+    // A multishot recv that's still armed is flagged as having more completions to come
+    if (uringSubmit(&ring, 1, 1000) > 0 && (cqe = uringCQE(&ring)) != NULL) {
+      if (cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE) != 0) rv = 0;
+      uringSeen(&ring);
+    }
+  }
+
+  if (fds[0] != -1) close(fds[0]);
+  if (fds[1] != -1) close(fds[1]);
+  uringClose(&ring);
+  return(rv);
+}
+
+
+// Map a new ring with entries submission slots, ret 0 or -1 on error
+int uringInit(struct URing *ring, unsigned int entries) {
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(struct URing));
+  memset(&p, 0, sizeof(p));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) return(-1);
+
+  // Completions that don't fit in the CQ are held by the kernel rather than dropped
+  if ((p.features & IORING_FEAT_NODROP) == 0) {
+    close(ring->fd);
+    return(-1);
+  }
+
+  ring->sqMapL = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cqMapL = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqMapL > ring->sqMapL) ring->sqMapL = ring->cqMapL;
+    ring->cqMapL = ring->sqMapL;
+  }
+
+  ring->sqMap = mmap(NULL, ring->sqMapL, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqMap == MAP_FAILED) {
+    close(ring->fd);
+    return(-1);
+  }
+
+  ring->cqMap = ring->sqMap;
+  if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    ring->cqMap = mmap(NULL, ring->cqMapL, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqMap == MAP_FAILED) {
+      munmap(ring->sqMap, ring->sqMapL);
+      close(ring->fd);
+      return(-1);
+    }
+  }
+
+  ring->sqesL = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesL, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapL);
+    munmap(ring->sqMap, ring->sqMapL);
+    close(ring->fd);
+    return(-1);
+  }
+
+  ring->sqHead = (unsigned int *) ((char *) ring->sqMap + p.sq_off.head);
+  ring->sqTail = (unsigned int *) ((char *) ring->sqMap + p.sq_off.tail);
+  ring->sqMask = (unsigned int *) ((char *) ring->sqMap + p.sq_off.ring_mask);
+  ring->sqArray = (unsigned int *) ((char *) ring->sqMap + p.sq_off.array);
+  ring->cqHead = (unsigned int *) ((char *) ring->cqMap + p.cq_off.head);
+  ring->cqTail = (unsigned int *) ((char *) ring->cqMap + p.cq_off.tail);
+  ring->cqMask = (unsigned int *) ((char *) ring->cqMap + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqMap + p.cq_off.cqes);
+  return(0);
+}
+
+
+// Register count receive buffers of size bytes as buffer group 0, ret 0 or -1 on error
+int uringBufs(struct URing *ring, int count, int size) {
+  struct io_uring_buf_reg reg;
+  int b = 0;
+
+  // The ring holds a power of 2 entries, the kernel reads it directly
+  ring->bufRingL = count * sizeof(struct io_uring_buf);
+  ring->bufRing = mmap(NULL, ring->bufRingL, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->bufRing == MAP_FAILED) {
+    ring->bufRing = NULL;
+    return(-1);
+  }
+
+  ring->bufs = malloc((size_t) count * size);
+  if (ring->bufs == NULL) {
+    munmap(ring->bufRing, ring->bufRingL);
+    ring->bufRing = NULL;
+    return(-1);
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) ring->bufRing;
+  reg.ring_entries = count;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    free(ring->bufs);
+    munmap(ring->bufRing, ring->bufRingL);
+    ring->bufs = NULL;
+    ring->bufRing = NULL;
+    return(-1);
+  }
+
+  ring->bufCount = count;
+  ring->bufSize = size;
+  for (b = 0; b < count; b++) uringBufReturn(ring, b);
+  return(0);
+}
+
+
+// Unmap a ring and free it's buffers, anything still in flight is cancelled
+void uringClose(struct URing *ring) {
+  if (ring->fd <= 0) return;
+
+  close(ring->fd);
+  munmap(ring->sqes, ring->sqesL);
+  if (ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapL);
+  munmap(ring->sqMap, ring->sqMapL);
+  if (ring->bufRing != NULL) munmap(ring->bufRing, ring->bufRingL);
+  free(ring->bufs);
+  memset(ring, 0, sizeof(struct URing));
+}
+
+
+// Get an empty submission entry, submitting those already queued if the ring is full
+struct io_uring_sqe *uringSQE(struct URing *ring) {
+  unsigned int tail = *ring->sqTail, head = 0, idx = 0;
+  struct io_uring_sqe *sqe = NULL;
+
+  head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (tail - head > *ring->sqMask) {
+    if (uringSubmit(ring, 0, 0) < 0) return(NULL);
+    head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head > *ring->sqMask) return(NULL);
+  }
+
+  // The kernel only reads new entries in io_uring_enter(), so the tail can move first
+  idx = tail & *ring->sqMask;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqArray[idx] = idx;
+
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ring->sqPend++;
+  return(sqe);
+}
+
+
+// Submit queued entries and wait for at least waitNr completions, for up to waitMs
+// (-1 waits forever). Ret the number submitted or -1 on error, a timeout isn't an error
+int uringSubmit(struct URing *ring, unsigned int waitNr, int waitMs) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned int flags = 0;
+  int rv = 0;
+
+  memset(&arg, 0, sizeof(arg));
+  if (waitNr > 0) {
+    flags = IORING_ENTER_GETEVENTS;
+    if (waitMs >= 0) {
+      ts.tv_sec = waitMs / 1000;
+      ts.tv_nsec = (waitMs % 1000) * 1000000L;
+      arg.ts = (unsigned long) &ts;
+      flags = flags | IORING_ENTER_EXT_ARG;
+    }
+  }
+
+  rv = syscall(__NR_io_uring_enter, ring->fd, ring->sqPend, waitNr, flags,
+               (flags & IORING_ENTER_EXT_ARG) ? (void *) &arg : NULL,
+               (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+
+  if (rv >= 0) {
+    ring->sqPend = ring->sqPend - rv;
+  } else if (errno == ETIME || errno == EINTR) {
+    rv = 0;
+  }
+  return(rv);
+}
+
+
+// Get the next completion without waiting, NULL if there are none, uringSeen() must be
+// called once it's been used
+struct io_uring_cqe *uringCQE(struct URing *ring) {
+  unsigned int head = *ring->cqHead;
+
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return(NULL);
+  return(&ring->cqes[head & *ring->cqMask]);
+}
+
+
+// Release the completion returned by uringCQE()
+void uringSeen(struct URing *ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+
+// Get the provided buffer a recv completed in to
+char *uringBuf(struct URing *ring, int bid) {
+  return(ring->bufs + (size_t) bid * ring->bufSize);
+}
+
+
+// Give a provided buffer back to the kernel once it's contents have been used
+void uringBufReturn(struct URing *ring, int bid) {
+  unsigned short tail = ring->bufRing->tail;
+  struct io_uring_buf *buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+  buf->addr = (unsigned long) uringBuf(ring, bid);
+  buf->len = ring->bufSize;
+  buf->bid = bid;
+  __atomic_store_n(&ring->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+
+#else
+
+
+static int uringProbe() { return(-1); }
+int uringInit(struct URing *ring, unsigned int entries) { return(-1); }
+int uringBufs(struct URing *ring, int count, int size) { return(-1); }
+void uringClose(struct URing *ring) { }
+struct io_uring_sqe *uringSQE(struct URing *ring) { return(NULL); }
+int uringSubmit(struct URing *ring, unsigned int waitNr, int waitMs) { return(-1); }
+struct io_uring_cqe *uringCQE(struct URing *ring) { return(NULL); }
+void uringSeen(struct URing *ring) { }
+char *uringBuf(struct URing *ring, int bid) { return(NULL); }
+void uringBufReturn(struct URing *ring, int bid) { }
+
+
+#endif
+
+
+// Select the socket I/O backend, epoll or uring, falling back to epoll if the kernel
+// doesn't support io_uring. Ret 0 or -1 if the backend isn't known
+int setIOBackend(char *backend) {
+  char errStr[100] = "";
+
+  if (strcmp(backend, "epoll") == 0) {
+    useURing = 0;
+    return(0);
+  }
+
+  if (strcmp(backend, "uring") != 0) {
+    sprintf(errStr, "Unknown I/O backend: %.40s (epoll or uring)", backend);
+    handleError(LOG_ERR, errStr, -1, 0, 1);
+    return(-1);
+  }
+
+  if (uringProbe() != 0) {
+    writeLog(LOG_WARNING, "io_uring is not available (needs Linux 6.0), using epoll", 1);
+    useURing = 0;
+  } else {
+    writeLog(LOG_INFO, "Using the io_uring I/O backend", 1);
+    useURing = 1;
+  }
+  return(0);
+}
+
+
+// Check if io_uring is being used (ret 1 if it is)
+int uringEnabled() {
+  return(useURing);
+}
@@ -0,0 +1,51 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// io_uring rings are mapped and driven with the raw syscalls, one ring per thread use
+struct URing {
+  int fd;
+  unsigned int *sqHead;
+  unsigned int *sqTail;
+  unsigned int *sqMask;
+  unsigned int *sqArray;
+  struct io_uring_sqe *sqes;
+  unsigned int sqPend;
+  unsigned int *cqHead;
+  unsigned int *cqTail;
+  unsigned int *cqMask;
+  struct io_uring_cqe *cqes;
+  void *sqMap;
+  size_t sqMapL;
+  void *cqMap;
+  size_t cqMapL;
+  size_t sqesL;
+
+  // Provided receive buffers (buffer group 0), the kernel picks one for each recv
+  struct io_uring_buf_ring *bufRing;
+  size_t bufRingL;
+  char *bufs;
+  int bufCount;
+  int bufSize;
+};
+
+// Function Prototypes
+int setIOBackend(char *backend);
+int uringEnabled();
+int uringInit(struct URing *ring, unsigned int entries);
+int uringBufs(struct URing *ring, int count, int size);
+void uringClose(struct URing *ring);
+struct io_uring_sqe *uringSQE(struct URing *ring);
+int uringSubmit(struct URing *ring, unsigned int waitNr, int waitMs);
+struct io_uring_cqe *uringCQE(struct URing *ring);
+void uringSeen(struct URing *ring);
+char *uringBuf(struct URing *ring, int bid);
+void uringBufReturn(struct URing *ring, int bid);
@@ -12,11 +12,13 @@ You should have received a copy of the GNU General Public License along with hhl
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <syslog.h>
 #include <math.h>
@@ -82,6 +84,22 @@ void handleError(int logLvl, char *logStr, int exitCode, int exitWeb, int stdErr
 }
 
 
+// Set by the SIGINT/SIGTERM handler, the main loops see it and shut down in order
+static volatile sig_atomic_t stopSig = 0;
+
+
+// Ask the main loops to stop, only sets a flag so it's safe to call from a signal handler
+void requestStop() {
+  stopSig = 1;
+}
+
+
+// Ret 1 once a stop has been requested
+int stopRequested() {
+  return(__atomic_load_n(&stopSig, __ATOMIC_RELAXED));
+}
+
+
 // Check if file exists (F_OK=0) and is writable (W_OK=2), readable (R_OK=4)
 // or exectuable (X_OK=1)
 int checkFile(char *fileName, int perms) {
@@ -131,10 +149,32 @@ void file2buf(char *buf, FILE *fp, long int fsize) {
 }
 
 
+// Per thread random number state so template generation is independent in each thread,
+// threads that don't call seedRand() are seeded on first use
+static __thread unsigned int randSeed = 0;
+static __thread int randSeeded = 0;
+
+
+// Seed the random number generator for the calling thread
+void seedRand(unsigned int seed) {
+  randSeed = seed;
+  randSeeded = 1;
+}
+
+
 // Return a random number between 2 values to the same number of decimal places as input
 void getRand(int lower, int upper, int dp, char *res, int *resInt, float *resF) {
+  struct timespec ts;
   float tmpF;
-  
+
+  // Mix the time with the address of this threads state, unique to the thread, so
+  // threads started together get different sequences
+  if (randSeeded == 0) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    seedRand((unsigned int) ts.tv_nsec ^ (unsigned int) ts.tv_sec ^
+             (unsigned int) (uintptr_t) &randSeed);
+  }
+
   // Add 0s to the upper/lower values to allow decimal places
   lower = lower * pow(10, dp);
   if (dp == 0) {
@@ -144,7 +184,7 @@ void getRand(int lower, int upper, int dp, char *res, int *resInt, float *resF)
   }
 
   // Create the random number and remove 0s to add decimal places
-  tmpF = (float) (rand() % (upper - lower) + lower);
+  tmpF = (float) (rand_r(&randSeed) % (upper - lower) + lower);
   tmpF = tmpF / pow(10, dp);
 
   // Return the final result to the correct DPs
@@ -162,42 +202,32 @@ void getRand(int lower, int upper, int dp, char *res, int *resInt, float *resF)
 // Get the current time on yyymmddhhmmss.ms+tz format
 void timeNow(char *dt, int aMins) {
   time_t t = time(NULL) + (aMins * 60);
-  struct tm *tm = localtime(&t);
+  struct tm tm;
 
-  strftime(dt, 26, "%Y%m%d%H%M%S", tm);
+  localtime_r(&t, &tm);
+  strftime(dt, 26, "%Y%m%d%H%M%S", &tm);
 }
 
 
-// Strip MLLP parts of packet
+// Strip MLLP parts of packet, the leading 0x0B and trailing 0x1C (0x0D), in place as
+// the packet may be a large unterminated frame left when the sender closed
 void stripMLLP(char *hl7msg) {
-  int msgLen = strlen(hl7msg);
-  int m = 0, s = 0;
-  char tmpBuf[strlen(hl7msg)];
+  size_t msgLen = strlen(hl7msg);
+  char *start = hl7msg;
 
-  for (m = 0; m < msgLen; m++) {
-    if (hl7msg[m] == (char) 11 || hl7msg[m] == (char) 28) {
-      s++;
-
-    } else {
-      tmpBuf[m - s] = hl7msg[m];
-    }
+  if (msgLen > 0 && *start == (char) 11) {
+    start++;
+    msgLen--;
   }
-  tmpBuf[m - s] = '\0';
-  strcpy(hl7msg, tmpBuf);
-}
-
-
-// Add MLLP wrapper to packet
-// NOTE: No need to realloc hl7msg, the +4b is handled in dblBuf()'s +10b safety
-void wrapMLLP(char *hl7msg) {
-  if (hl7msg != NULL) {
-    char tmpBuf[strlen(hl7msg) + 4];
-
-    // Wrap hl7msg in an ASCII 11 (SOB) & 28 (EOB) and null terminate
-    sprintf(tmpBuf, "%c%s%c%c", 11, hl7msg, 28, 13);
 
-    strcpy(hl7msg, tmpBuf);
+  if (msgLen >= 2 && start[msgLen - 2] == (char) 28 && start[msgLen - 1] == '\r') {
+    msgLen = msgLen - 2;
+  } else if (msgLen >= 1 && start[msgLen - 1] == (char) 28) {
+    msgLen--;
   }
+
+  memmove(hl7msg, start, msgLen);
+  hl7msg[msgLen] = '\0';
 }
 
 
@@ -297,46 +327,46 @@ void findLine(char *buf, long int dataSize, int lineNum, int *start, int *lineLe
 }
 
 
-// Convert a HL7 message to a unix format (i.e: /r -> /n)
+// Convert a HL7 message to a unix format (i.e: /r -> /n), in place or printed as it's
+// converted, messages may be too large to copy on the stack
 void hl72unix(char *msg, int onlyPrint) {
-  long unsigned int c, ignore = 0;
-  char msgUnix[strlen(msg) + 1];
-  for (c = 0; c < strlen(msg); c++) {
-    if (c == 0 && msg[c] == 13) {
-      ignore++;
-    } else if (msg[c] == 13) {
-      msgUnix[c - ignore] = '\n';
-    } else if (msg[c] == 10 || msg[c] == 11 || msg[c] == 28) {
-      ignore++;
+  size_t c = 0, u = 0, msgL = strlen(msg);
+  char ch;
+
+  if (onlyPrint == 1) flockfile(stdout);
+  for (c = 0; c < msgL; c++) {
+    ch = msg[c];
+    if (ch == 13 && c == 0) continue;
+    if (ch == 10 || ch == 11 || ch == 28) continue;
+    if (ch == 13) ch = '\n';
+
+    if (onlyPrint == 1) {
+      putchar_unlocked(ch);
     } else {
-      msgUnix[c - ignore] = msg[c];
+      msg[u++] = ch;
     }
   }
-  msgUnix[c - ignore] = '\0';
 
   if (onlyPrint == 1) {
-    printf("%s", msgUnix);
+    funlockfile(stdout);
   } else {
-    strcpy(msg, msgUnix);
+    msg[u] = '\0';
   }
 }
 
 
-// Convert a unix HL7 message to a hl7 format (i.e: /n -> /r)
+// Convert a unix HL7 message to a hl7 format (i.e: /n -> /r), in place
 void unix2hl7(char *msg) {
-  long unsigned int c, ignore = 0;
-  char msgUnix[strlen(msg) + 1];
-  for (c = 0; c < strlen(msg); c++) {
+  size_t c = 0, u = 0, msgL = strlen(msg);
+
+  for (c = 0; c < msgL; c++) {
     if (msg[c] == 10) {
-      msgUnix[c - ignore] = '\r';
-    } else if (msg[c] == 13 || msg[c] == 11 || msg[c] == 28) {
-      ignore++;
-    } else {
-      msgUnix[c - ignore] = msg[c];
+      msg[u++] = '\r';
+    } else if (msg[c] != 13 && msg[c] != 11 && msg[c] != 28) {
+      msg[u++] = msg[c];
     }
   }
-  msgUnix[c - ignore] = '\0';
-  strcpy(msg, msgUnix);
+  msg[u] = '\0';
 }
 
 
@@ -16,14 +16,16 @@ void openLog();
 void closeLog();
 void writeLog(int logLvl, char *logStr, int stdErr);
 void handleError(int logLvl, char *logStr, int exitCode, int exitWeb, int stdErr);
+void requestStop();
+int stopRequested();
 int checkFile(char *fileName, int perms);
 FILE *openFile(char *fileName, char *mode);
 long int getFileSize(char *fileName);
 void file2buf(char *buf, FILE *fp, int fsize);
+void seedRand(unsigned int seed);
 void getRand(int lower, int upper, int dp, char *res, int *resI, float *resF);
 void timeNow(char *dt, int aMins);
 void stripMLLP(char *hl7msg);
-void wrapMLLP(char *hl7msg);
 int getHL7Field(char *hl7msg, char *seg, int field, char *res);
 long unsigned int numLines(const char *buf);
 void findLine(char *buf, long int dataSize, int lineNum, int *start, int *end);
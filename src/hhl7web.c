@@ -22,8 +22,8 @@ You should have received a copy of the GNU General Public License along with hhl
 #include <syslog.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
-#include <sys/prctl.h>
 #include <time.h>
+#include <stdint.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <microhttpd.h>
@@ -31,10 +31,13 @@ You should have received a copy of the GNU General Public License along with hhl
 #include <dirent.h>
 #include "hhl7extern.h"
 #include "hhl7net.h"
+#include "hhl7queue.h"
+#include "hhl7stats.h"
 #include "hhl7utils.h"
 #include "hhl7webpages.h"
 #include "hhl7auth.h"
 #include "hhl7json.h"
+#include "hhl7webring.h"
 #include <errno.h>
 
 #define REALM           "\"Maintenance\""
@@ -81,9 +84,10 @@ struct Session {
   int ackTimeout;
   int webTimeout;
   int isListening;
-  int readFD; // File descriptor for listen named pipe
-  int respFD; // File descriptor for listen named pipe
-  pid_t lpid; // Per user/session PID of web listener
+  struct WebRing *lsnRing; // Messages and responses from the web listener
+  struct WebRing *respRing; // Responder template lists to the web listener
+  int lsnID; // Per user/session web listener engine ID
+  struct SendStats *sendStats; // Latency and ACK stats for messages sent by this session
 };
 
 
@@ -856,74 +860,78 @@ static enum MHD_Result getTempForm(struct Session *session,
 }
 
 
-// Send a HL7 message from the Listener to the web client
+// Send the HL7 messages waiting in the listeners ring to the web client, followed by
+// the rings depth and drop count
 static enum MHD_Result sendHL72Web(struct Session *session,
-                                   struct MHD_Connection *connection, int fd,
+                                   struct MHD_Connection *connection, struct WebRing *ring,
                                    const char *url, char *retCode) {
 
   (void) url;           /* Unused. Silence compiler warning. */
 
   enum MHD_Result ret;
   struct MHD_Response *response;
-  int fBufS = 2048, rBufS = 512, mBufS = 0;
+  long int fBufS = 2048, rBufS = 512, mBufS = 0, readSize = 0, drained = 0;
   char *fBuf = malloc(fBufS);
   char *rBuf = malloc(rBufS);
   char *fBufNew = NULL, *rBufNew = NULL;
-  char readSizeBuf[11];
-  int p = 0, pLen = 1, maxPkts = 250, readSize = 0;
+  char ringStats[192] = "";
+  int p = 0, statsL = 0;
   char errStr[65] = "";
 
   strcpy(fBuf, "event: rcvHL7\ndata: ");
 
-  if (strlen(retCode) == 0) {
-    while (pLen > 0 && p < maxPkts) {
-      mBufS = 0;
-      if ((pLen = read(fd, readSizeBuf, 11)) > 0) {
-        readSize = atoi(readSizeBuf);
+  if (ring != NULL) {
+    statsL = sprintf(ringStats, "%s", "event: ringStats\ndata: ");
+    statsL += webRingJSON(ring, ringStats + statsL, sizeof(ringStats) - statsL - 3);
+    strcat(ringStats, "\n\n");
+    statsL += 2;
+  }
+
+  if (strlen(retCode) == 0 && ring != NULL) {
+    // Drain at most a rings worth, so a busy listener can't hold this request forever
+    while (drained < (long int) ring->hdr->size &&
+           (readSize = webRingGet(ring, &rBuf, &rBufS)) >= 0) {
+      drained += readSize + 4;
 
       mBufS = (2 * readSize) + 1;
-        if (mBufS > rBufS) {
-          rBufNew = realloc(rBuf, mBufS);
-          if (rBufNew == NULL) {
-            sprintf(errStr, "[S: %03d] Can't realloc memory sendHL72Web, rBuf",
-                            session->shortID);
-            handleError(LOG_ERR, errStr, 1, 0, 1);
+      if (mBufS > rBufS) {
+        rBufNew = realloc(rBuf, mBufS);
+        if (rBufNew == NULL) {
+          sprintf(errStr, "[S: %03d] Can't realloc memory sendHL72Web, rBuf",
+                          session->shortID);
+          handleError(LOG_ERR, errStr, 1, 0, 1);
+          continue;
 
-          } else {
-            rBuf = rBufNew;
+        } else {
+          rBuf = rBufNew;
+          rBufS = mBufS;
 
-          }
         }
+      }
+      hl72web(rBuf, mBufS);
 
-        if ((pLen = read(fd, rBuf, readSize)) > 0) {
-         rBuf[readSize] = '\0';
-          hl72web(rBuf, mBufS);
-
-          mBufS = strlen(rBuf) + strlen(fBuf) + 50;
-          if (mBufS > fBufS) {
-            fBufNew = realloc(fBuf, mBufS);
-            if (fBufNew == NULL) {
-              sprintf(errStr, "[S: %03d] Can't realloc memory sendHL72Web, fBuf",
-                              session->shortID);
-              handleError(LOG_ERR, errStr, 1, 0, 1);
-
-            } else {
-              fBuf = fBufNew;
-              fBufS = mBufS;
-
-            }
-          }
-
+      mBufS = strlen(rBuf) + strlen(fBuf) + statsL + 50;
+      if (mBufS > fBufS) {
+        fBufNew = realloc(fBuf, mBufS * 2);
+        if (fBufNew == NULL) {
+          sprintf(errStr, "[S: %03d] Can't realloc memory sendHL72Web, fBuf",
+                          session->shortID);
+          handleError(LOG_ERR, errStr, 1, 0, 1);
+          continue;
 
-          strcat(fBuf, rBuf);
-          rBuf[0] = '\0';
-          p++;
+        } else {
+          fBuf = fBufNew;
+          fBufS = mBufS * 2;
 
         }
       }
+
+      strcat(fBuf, rBuf);
+      rBuf[0] = '\0';
+      p++;
     }
 
-  } else {
+  } else if (strlen(retCode) > 0) {
     strcat(fBuf, retCode);
     p = 1;
   }
@@ -933,6 +941,8 @@ static enum MHD_Result sendHL72Web(struct Session *session,
   if (p == 0) {
     strcpy(fBuf, "event: rcvHL7\ndata: HB\nretry:500\n\n");
   }
+  strcat(fBuf, ringStats);
+
   response = MHD_create_response_from_buffer(strlen(fBuf), (void *) fBuf,
              MHD_RESPMEM_MUST_COPY);
 
@@ -962,30 +972,17 @@ static enum MHD_Result sendHL72Web(struct Session *session,
 }
 
 
-// Remove the named pipe and kill the listening child process if required
+// Stop the session's listener if required and free the rings shared with it
 static void cleanSession(struct Session *session) {
-  // Remove the listeners named pipe if it exists
-  if (session->readFD > 0) {
-    char hhl7fifo[21];
-    sprintf(hhl7fifo, "%s%d", "/tmp/hhl7fifo.", session->lpid);
-    close(session->readFD);
-    session->readFD = -1;
-    unlink(hhl7fifo);
+  if (session->lsnID > 0) {
+    stopWebListener(session->lsnID);
+    session->lsnID = 0;
   }
 
-  if (session->respFD > 0) {
-    char hhl7rfifo[21];
-    sprintf(hhl7rfifo, "%s%d", "/tmp/hhl7rfifo.", session->lpid);
-    close(session->respFD);
-    session->respFD = -1;
-    unlink(hhl7rfifo);
-  }
-
-  // Stop the listening child process if running
-  if (session->lpid > 0) {
-    kill(session->lpid, SIGTERM);
-    session->lpid = 0;
-  }
+  webRingFree(session->lsnRing);
+  session->lsnRing = NULL;
+  webRingFree(session->respRing);
+  session->respRing = NULL;
 }
 
 
@@ -1004,7 +1001,7 @@ void cleanAllSessions() {
 }
 
 
-// Get a list of responses via a fifo
+// Get the latest list of responses from the listeners ring
 static enum MHD_Result getRespQueue(struct Session *session,
                                     struct MHD_Connection *connection, const char *url) {
 
@@ -1012,40 +1009,24 @@ static enum MHD_Result getRespQueue(struct Session *session,
 
   enum MHD_Result ret;
   struct MHD_Response *response;
-  int rBufS = 512;
+  long int rBufS = 512, tBufS = 512;
   char *rBuf = malloc(rBufS);
-  rBuf[0] = '\0';
-  int pLen = 1, readSize = 0;
-  int fd = session->readFD;
-  char readSizeBuf[11];
+  char *tBuf = malloc(tBufS);
+  char *swapBuf = NULL;
+  long int swapS = 0;
   char errStr[50] = "";
 
-  while (pLen > 0) {
-    if ((pLen = read(fd, readSizeBuf, 11)) > 0) {
-      readSize = atoi(readSizeBuf);
-
-    }
-
-    if (readSize > rBufS) {
-      char *rBufNew = realloc(rBuf, readSize + 1);
-      if (rBufNew == NULL) {
-        sprintf(errStr, "[S: %03d] Can't realloc memory getRespQueue, rBuf",
-                        session->shortID);
-        handleError(LOG_ERR, errStr, 1, 0, 1);
-
-      } else {
-        rBuf = rBufNew;
-        rBufS = readSize;
-
-      }
-    }
-
-    if (readSize > 0) {
-      if ((pLen = read(fd, rBuf, readSize)) > 0) {
-        rBuf[readSize] = '\0';
-      }
-    }
+  // Only the last record waiting is current
+  rBuf[0] = '\0';
+  while (session->lsnRing != NULL && webRingGet(session->lsnRing, &tBuf, &tBufS) >= 0) {
+    swapBuf = rBuf;
+    swapS = rBufS;
+    rBuf = tBuf;
+    rBufS = tBufS;
+    tBuf = swapBuf;
+    tBufS = swapS;
   }
+  free(tBuf);
 
   response = MHD_create_response_from_buffer(strlen(rBuf), (void *) rBuf,
              MHD_RESPMEM_MUST_COPY);
@@ -1067,6 +1048,35 @@ static enum MHD_Result getRespQueue(struct Session *session,
 }
 
 
+// Get the send latency & ACK statistics for this session
+static enum MHD_Result getSendStats(struct Session *session,
+                                    struct MHD_Connection *connection, const char *url) {
+
+  enum MHD_Result ret;
+  struct MHD_Response *response;
+  char statsStr[1024] = "{}";
+  char errStr[300] = "";
+
+  if (session->sendStats != NULL)
+    sendStatsJSON(session->sendStats, statsStr, sizeof(statsStr));
+
+  response = MHD_create_response_from_buffer(strlen(statsStr), (void *) statsStr,
+             MHD_RESPMEM_MUST_COPY);
+
+  if (!response) return(MHD_NO);
+
+  MHD_add_response_header(response, "Content-Type", "text/plain");
+  MHD_add_response_header(response, "Cache-Control", "no-cache");
+
+  ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  sprintf(errStr, "[S: %03d][200] GET: %s", session->shortID, url);
+  writeLog(LOG_DEBUG, errStr, 0);
+
+  MHD_destroy_response(response);
+  return(ret);
+}
+
+
 // Stop the backend listening for packets from hl7 server
 static enum MHD_Result stopListenWeb(struct Session *session,
                                      struct MHD_Connection *connection, const char *url) {
@@ -1095,92 +1105,47 @@ static enum MHD_Result stopListenWeb(struct Session *session,
 }
 
 
-// Start a HL7 Listener in a forked child process
+// Start a HL7 Listener for this session on the web listener engine
 static int startListenWeb(struct Session *session, struct MHD_Connection *connection,
                            const char *url, int argc, char *argv[]) {
 
-  int rc = -1, rLen = 0, rTries = 0, maxTries = 10;
-  char rBuf[3] = "", errStr[41] = "";
-
-  // Make children ignore waiting for parent process before closing
-  signal(SIGCHLD, SIG_IGN);
+  char errStr[41] = "";
 
   // Ensure we've stopped the previous listener before starting another
   if (session->isListening == 1) {
     stopListenWeb(session, connection, url);
   }
 
-  pid_t pidBefore = getpid();
-  session->lpid = fork();
-
-  if (session->lpid == 0) {
-    // Make the child exit if the  parent exits
-    int r = prctl(PR_SET_PDEATHSIG, SIGTERM);
-    if (r == -1 || getppid() != pidBefore) {
-      exit(0);
-    }
-
-    rc = startMsgListener(globalConfig->lIP, session->lPort, session->sIP, session->sPort,
-                          argc, 0, argv, 0, NULL, session->ackTimeout);
-    if (rc < 0) {
-      stopListenWeb(session, connection, url);
-      sprintf(errStr, "Failed to start listener on port: %s", session->lPort);
-      handleError(LOG_ERR, errStr, 1, 1, 1);
-    }
-
-    _exit(0);
-
-  }
-
-  // Create a named pipe to read from
-  char hhl7fifo[21]; 
-  sprintf(hhl7fifo, "%s%d", "/tmp/hhl7fifo.", session->lpid);
-  mkfifo(hhl7fifo, 0666);
-  session->readFD = open(hhl7fifo, O_RDONLY | O_NONBLOCK);
-
-  // Read message from pipe, should return FS if child listener started OK.
-  while (rLen < 1 && rTries < maxTries) {
-    rLen = read(session->readFD, rBuf, 2);
-    usleep(100000);
-    rTries++;
+  session->lsnRing = webRingCreate(WEBRING_SIZE);
+  session->respRing = webRingCreate(WEBRING_RSIZE);
+  if (session->lsnRing != NULL && session->respRing != NULL) {
+    session->lsnID = startWebListener(globalConfig->lIP, session->lPort, session->sIP,
+                                      session->sPort, session->ackTimeout, argc, argv,
+                                      session->lsnRing, session->respRing);
   }
 
-  if (strcmp(rBuf, "FS") == 0) {
-    char hhl7rfifo[22];
-    sprintf(hhl7rfifo, "%s%d", "/tmp/hhl7rfifo.", session->lpid);
-    mkfifo(hhl7rfifo, 0666);
-    // Do not combine these two lines to "O_WRONLY | O_NONBLOCK" or open fails
-    session->respFD = open(hhl7rfifo, O_WRONLY);
-    fcntl(session->respFD, F_SETFL, O_NONBLOCK);
-    //fcntl(session->respFD, F_SETPIPE_SZ, 1048576); // Change pipe size, default seems OK
-
+  if (session->lsnID > 0) {
     session->isListening = 1;
     return(0);
 
   } else {
-    //stopListenWeb(session, connection, url);
+    cleanSession(session);
+    session->lsnID = 0;
     session->isListening = 1;
     sprintf(errStr, "Failed to start listener on port: %s", session->lPort);
     handleError(LOG_ERR, errStr, 1, 0, 1);
     return(1);
   }
-  return(1);
 }
 
 
 // Update the list of response templates to listen to
 static void sendRespList(struct Session *session, struct json_object *rootObj) {
   const char *tempStr = json_object_to_json_string_ext(rootObj, JSON_C_TO_STRING_PLAIN);
-  char writeSize[11] = "";
-
-  sprintf(writeSize, "%d", (int) strlen(tempStr));
-
-  if (write(session->respFD, writeSize, 11) == -1) {
-    handleError(LOG_ERR, "Failed to write to named pipe", 1, 0, 0);
-  }
 
-  if (write(session->respFD, tempStr, strlen(tempStr)) == -1) {
-    handleError(LOG_ERR, "Failed to write to named pipe", 1, 0, 0);
+  if (session->respRing == NULL) return;
+  if (webRingPut(session->respRing, (char *) tempStr, strlen(tempStr)) == -1) {
+    handleError(LOG_ERR, "Web listener ring full, responder list not sent", -1, 0, 0);
   }
 }
 
@@ -1816,6 +1781,11 @@ static enum MHD_Result answerToConnection(void *cls, struct MHD_Connection *conn
       if (session->aStatus != 1) return(requestLogin(session, connection, url));
       return(getRespQueue(session, connection, url));
 
+    } else if (strcmp(url, "/getSendStats") == 0) {
+      // Request login if not logged in
+      if (session->aStatus != 1) return(requestLogin(session, connection, url));
+      return(getSendStats(session, connection, url));
+
     } else if (strcmp(url, "/getServers") == 0) {
       // Request login if not logged in
       if (session->aStatus != 1) return(requestLogin(session, connection, url));
@@ -1841,12 +1811,12 @@ static enum MHD_Result answerToConnection(void *cls, struct MHD_Connection *conn
         rc = startListenWeb(con_info->session, con_info->connection, url, -1, NULL);
         if (rc != 0) {
           sprintf(retCode, "%s", "FX");
-          return(sendHL72Web(session, connection, session->readFD, url, retCode));
+          return(sendHL72Web(session, connection, session->lsnRing, url, retCode));
         }
       }
 
       if (session->isListening == 1) {
-        return(sendHL72Web(session, connection, session->readFD, url, retCode));
+        return(sendHL72Web(session, connection, session->lsnRing, url, retCode));
 
       } else {
         session->isListening = 1;
@@ -1880,6 +1850,11 @@ static enum MHD_Result answerToConnection(void *cls, struct MHD_Connection *conn
                            con_info->poststring, resStr, &resList, 0, 0,
                            con_info->session->ackTimeout, 0);
 
+          // Keep the send latency statistics with the session that sent the message
+          if (session->sendStats == NULL)
+            session->sendStats = calloc(1, sizeof(struct SendStats));
+          if (session->sendStats != NULL) mergeStats(session->sendStats);
+
           if (rc >= 0) {
             sprintf(errStr, "[S: %03d][%s] Sent %ld byte packet to: %s:%s",
                             con_info->session->shortID, resStr,
@@ -1980,6 +1955,7 @@ static int expireSessions(struct MHD_Daemon *daemon, int expireAfter) {
       } else {
         prev->next = next;
       }
+      free(pos->sendStats);
       free(pos);
 
     } else {
@@ -2071,6 +2047,8 @@ int listenWeb(int daemonSock) {
 
   struct timeval tv, *tvp;
   //struct timeval *tvp;
+  struct timespec pts;
+  sigset_t sigs, oldSigs;
   fd_set rs;
   fd_set ws;
   fd_set es;
@@ -2115,8 +2093,14 @@ int listenWeb(int daemonSock) {
     webRunning = 1;
   }
 
+  // Signals are only let through while waiting in pselect(), so a stop request can't be
+  // missed between checking for it and waiting
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigprocmask(SIG_BLOCK, &sigs, &oldSigs);
 
-  while (1) {
+  while (stopRequested() == 0) {
     writeLog(LOG_DEBUG, "Main loop running...", 0);
     // Expire any old sessions and get the time of the last session expiry
     now = time(NULL);
@@ -2125,6 +2109,10 @@ int listenWeb(int daemonSock) {
       last = time(NULL);
     }
 
+    // Process ACKs for queued sends, close pooled connections that have been idle too long
+    pollConnPool(0);
+    if (queueEnabled() == 1) drainQueues(0, 0);
+
     max = 0;
     FD_ZERO(&rs);
     FD_ZERO(&ws);
@@ -2150,7 +2138,9 @@ int listenWeb(int daemonSock) {
     }
 
     // watch until FDs are active or timeout reached
-    if (select(max + 1, &rs, &ws, &es, tvp) == -1) {
+    pts.tv_sec = tvp->tv_sec;
+    pts.tv_nsec = tvp->tv_usec * 1000;
+    if (pselect(max + 1, &rs, &ws, &es, &pts, &oldSigs) == -1) {
       if (errno != EINTR) {
         handleError(LOG_ERR, "listenWeb() Failed during select() routine", 1, 1, 1);
       }
@@ -2160,6 +2150,7 @@ int listenWeb(int daemonSock) {
     MHD_run(daemon);
   }
 
+  sigprocmask(SIG_SETMASK, &oldSigs, NULL);
   MHD_stop_daemon(daemon);
   return(0);
 }
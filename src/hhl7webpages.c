@@ -2016,6 +2016,27 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
           errHandler(\"ERROR: The hhl7 backend is not running.\");\n\
         }\n\
       }\n\
+\n\
+      async function popSendStats() {\n\
+        try {\n\
+          const response = await fetch(\"/getSendStats\");\n\
+          const htmlData = await response.text();\n\
+\n\
+          if (response.ok) {\n\
+            sObj = JSON.parse(htmlData);\n\
+            if (sObj.ack && sObj.ack.count > 0) {\n\
+              document.getElementById(\"ackLatency\").innerHTML = sObj.ack.p50 + \" / \" + sObj.ack.p99;\n\
+              document.getElementById(\"ackLatencyMax\").innerHTML = sObj.ack[\"p99.9\"] + \" / \" + sObj.ack.max;\n\
+            }\n\
+            if (sObj.connect && sObj.connect.count > 0) {\n\
+              document.getElementById(\"connLatency\").innerHTML = sObj.connect.p99;\n\
+            }\n\
+          }\n\
+\n\
+        } catch(error) {\n\
+          console.log(error);\n\
+        }\n\
+      }\n\
 \n\
       async function popSettings() {\n\
         try {\n\
@@ -2073,6 +2094,8 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
             webTimeout = jObj.webT;\n\
 \n\
           }\n\
+\n\
+          popSendStats();\n\
 \n\
         } catch(error) {\n\
           console.log(error);\n\
@@ -2149,6 +2172,13 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
           hl7Log.scrollTo(0, hl7Log.scrollHeight);\n\
         }\n\
       }\n\
+\n\
+      function updateRingStats(event) {\n\
+        rObj = JSON.parse(event.data);\n\
+        var ringText = \"(queued \" + Math.round(rObj.depth / 1024) + \"/\" + Math.round(rObj.size / 1024) + \" KB\";\n\
+        if (rObj.dropped > 0) ringText += \", \" + rObj.dropped + \" dropped\";\n\
+        document.getElementById(\"ringStats\").innerHTML = ringText + \")\";\n\
+      }\n\
 \n\
       function startHL7Listener() {\n\
         if (!checkLPort()) return false;\n\
@@ -2158,6 +2188,7 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
             if (!isConnectionOpen) {\n\
               evtSource = new EventSource(\"/listenHL7\");\n\
               evtSource.addEventListener(\"rcvHL7\", updateHL7Log);\n\
+              evtSource.addEventListener(\"ringStats\", updateRingStats);\n\
               isConnectionOpen = true;\n\
             }\n\
           } else {\n\
@@ -2229,7 +2260,7 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
     </form>\n\
 \n\
     <div id=\"listPane\">\n\
-      <div class=\"titleBar\">Listening...</div>\n\
+      <div class=\"titleBar\">Listening... <span id=\"ringStats\"></span></div>\n\
       <div id=\"hl7Log\" class=\"hl7Message\"></div>\n\
     </div>\n\
 \n\
@@ -2354,6 +2385,20 @@ const char *mainPage = "<!DOCTYPE HTML>\n\
         </div>\n\
         <button id=\"saveACKSets\" class=\"menuItemButtonInactive\">Save Timeout Settings</button>\n\
         <div class=\"menuSpacer\"></div>\n\
+        <div class=\"menuHeader\">Send Latency (ms)</div>\n\
+        <div class=\"menuItem\">\n\
+          <div class=\"menuSubHeader\">ACK p50/p99:</div>\n\
+          <div id=\"ackLatency\" class=\"menuDataItem\">--</div>\n\
+        </div>\n\
+        <div class=\"menuItem\">\n\
+          <div class=\"menuSubHeader\">ACK p99.9/max:</div>\n\
+          <div id=\"ackLatencyMax\" class=\"menuDataItem\">--</div>\n\
+        </div>\n\
+        <div class=\"menuItem\">\n\
+          <div class=\"menuSubHeader\">Connect p99:</div>\n\
+          <div id=\"connLatency\" class=\"menuDataItem\">--</div>\n\
+        </div>\n\
+        <div class=\"menuSpacer\"></div>\n\
         <div class=\"menuHeader\">Reset Password</div>\n\
         <div class=\"menuItem\">\n\
           <div class=\"menuSubHeader\">Old Pwd:</div>\n\
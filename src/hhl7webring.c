@@ -0,0 +1,197 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "hhl7webring.h"
+#include "hhl7utils.h"
+
+// Each web session's listener shares two rings with the web interface, one mapping each:
+//   4096 byte header page (struct WebRingHdr) then the ring, size bytes
+// Records are a 4 byte length then the data, wrapping around the end of the ring.
+// Each ring has one writer and one reader, so head and tail are all they share and no
+// lock is taken. The writer signals the eventfd when it adds to an empty ring, the
+// reader clears it once it finds the ring empty. A record that doesn't fit is dropped
+// and counted, the writer (the listener engine) never waits for the web interface.
+#define WEBRING_HDRS 4096
+
+
+// Create a ring of size bytes (a power of 2), ret the ring or NULL on error
+struct WebRing *webRingCreate(unsigned long size) {
+  struct WebRing *ring = calloc(1, sizeof(struct WebRing));
+  char *map = MAP_FAILED;
+
+  if (ring == NULL) {
+    handleError(LOG_ERR, "Could not allocate memory for a web listener ring", -1, 0, 1);
+    return(NULL);
+  }
+
+  ring->mapS = WEBRING_HDRS + size;
+  ring->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  map = mmap(NULL, ring->mapS, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (map == MAP_FAILED || ring->evfd == -1) {
+    handleError(LOG_ERR, "Could not create a web listener ring", -1, 0, 1);
+    if (map != MAP_FAILED) munmap(map, ring->mapS);
+    if (ring->evfd != -1) close(ring->evfd);
+    free(ring);
+    return(NULL);
+  }
+
+  ring->hdr = (struct WebRingHdr *) map;
+  ring->data = map + WEBRING_HDRS;
+  ring->hdr->size = size;
+  ring->mask = size - 1;
+  return(ring);
+}
+
+
+// Unmap and close a ring
+void webRingFree(struct WebRing *ring) {
+  if (ring == NULL) return;
+
+  munmap(ring->hdr, ring->mapS);
+  close(ring->evfd);
+  free(ring);
+}
+
+
+// Get the eventfd signalled when records are added, for epoll or poll
+int webRingFD(struct WebRing *ring) {
+  return(ring->evfd);
+}
+
+
+// Copy len bytes in to the ring at pos, wrapping around the end
+static void ringCopyIn(struct WebRing *ring, unsigned long pos, char *src, long int len) {
+  unsigned long off = pos & ring->mask;
+  long int first = ring->hdr->size - off;
+
+  if (first > len) first = len;
+  memcpy(ring->data + off, src, first);
+  memcpy(ring->data, src + first, len - first);
+}
+
+
+// Copy len bytes out of the ring from pos, wrapping around the end
+static void ringCopyOut(struct WebRing *ring, unsigned long pos, char *dst, long int len) {
+  unsigned long off = pos & ring->mask;
+  long int first = ring->hdr->size - off;
+
+  if (first > len) first = len;
+  memcpy(dst, ring->data + off, first);
+  memcpy(dst + first, ring->data, len - first);
+}
+
+
+// Add a record to the ring, ret 0 or -1 if it was dropped as the ring is full
+int webRingPut(struct WebRing *ring, char *rec, long int recL) {
+  struct WebRingHdr *hdr = ring->hdr;
+  unsigned long head = 0, tail = 0, depth = 0;
+  uint32_t len = recL;
+  uint64_t one = 1;
+
+  tail = hdr->tail;
+  head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  depth = tail - head + 4 + recL;
+
+  if (depth > hdr->size) {
+    __atomic_add_fetch(&hdr->dropped, 1, __ATOMIC_RELAXED);
+    return(-1);
+  }
+
+  ringCopyIn(ring, tail, (char *) &len, 4);
+  ringCopyIn(ring, tail + 4, rec, recL);
+  __atomic_store_n(&hdr->tail, tail + 4 + recL, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&hdr->written, 1, __ATOMIC_RELAXED);
+  if (depth > hdr->depthMax) hdr->depthMax = depth;
+
+  // Wake the reader if it may have seen the ring empty, it clears the eventfd then
+  // checks again so either it sees this record or we see it's head
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == tail) {
+    if (write(ring->evfd, &one, 8) == -1) {}
+  }
+  return(0);
+}
+
+
+// Take the next record from the ring in to buf, growing it if needed, ret the records
+// length (buf is \0 terminated) or -1 if the ring is empty
+long int webRingGet(struct WebRing *ring, char **buf, long int *bufS) {
+  struct WebRingHdr *hdr = ring->hdr;
+  unsigned long head = 0, tail = 0;
+  uint32_t len = 0;
+  uint64_t count = 0;
+  char *newBuf = NULL;
+
+  head = hdr->head;
+  tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+
+  if (head == tail) {
+    if (read(ring->evfd, &count, 8) == -1) {}
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) return(-1);
+  }
+
+  ringCopyOut(ring, head, (char *) &len, 4);
+  if ((long int) len + 1 > *bufS) {
+    newBuf = realloc(*buf, len + 1);
+    if (newBuf == NULL) {
+      // Skip the record rather than leave it blocking the ring
+      __atomic_store_n(&hdr->head, head + 4 + len, __ATOMIC_RELEASE);
+      handleError(LOG_ERR, "Could not allocate memory for a web listener record", -1, 0, 1);
+      return(-1);
+    }
+    *buf = newBuf;
+    *bufS = len + 1;
+  }
+
+  ringCopyOut(ring, head + 4, *buf, len);
+  (*buf)[len] = '\0';
+  __atomic_store_n(&hdr->head, head + 4 + len, __ATOMIC_RELEASE);
+  return(len);
+}
+
+
+// Wait up to waitMs for a record to be added to an empty ring, ret 1 if one was
+int webRingWait(struct WebRing *ring, int waitMs) {
+  struct pollfd pfd = { ring->evfd, POLLIN, 0 };
+
+  if (__atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE) != ring->hdr->head) return(1);
+  return(poll(&pfd, 1, waitMs) == 1);
+}
+
+
+// Write the rings depth, size and counters to buf as JSON, ret the length
+int webRingJSON(struct WebRing *ring, char *buf, int bufS) {
+  struct WebRingHdr *hdr = ring->hdr;
+  unsigned long tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+  unsigned long head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+  return(snprintf(buf, bufS,
+                  "{\"depth\": %lu, \"size\": %lu, \"max\": %lu, \"written\": %lu, \"dropped\": %lu}",
+                  tail - head, hdr->size, hdr->depthMax,
+                  __atomic_load_n(&hdr->written, __ATOMIC_RELAXED),
+                  __atomic_load_n(&hdr->dropped, __ATOMIC_RELAXED)));
+}
+
@@ -0,0 +1,48 @@
+/*
+Copyright 2023 Haydn Haines.
+
+This file is part of hhl7.
+
+hhl7 is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+hhl7 is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with hhl7. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Size of the ring a web listener passes messages to the web interface through, and
+// the ring responder template lists are passed back through (bytes, a power of 2)
+#define WEBRING_SIZE  4194304
+#define WEBRING_RSIZE 65536
+
+// Head is only moved by the reader (the web interface for messages, the listener engine
+// for templates) and tail by the writer
+struct WebRingHdr {
+  unsigned long head __attribute__((aligned(64)));
+  unsigned long tail __attribute__((aligned(64)));
+  unsigned long written;
+  unsigned long dropped;
+  unsigned long depthMax;
+  unsigned long size;
+};
+
+// A ring and the eventfd it's reader waits on
+struct WebRing {
+  struct WebRingHdr *hdr;
+  char *data;
+  unsigned long mask;
+  long int mapS;
+  int evfd;
+};
+
+// Function Prototypes
+struct WebRing *webRingCreate(unsigned long size);
+void webRingFree(struct WebRing *ring);
+int webRingFD(struct WebRing *ring);
+int webRingPut(struct WebRing *ring, char *rec, long int recL);
+long int webRingGet(struct WebRing *ring, char **buf, long int *bufS);
+int webRingWait(struct WebRing *ring, int waitMs);
+int webRingJSON(struct WebRing *ring, char *buf, int bufS);
+int startWebListener(char *lIP, char *lPort, char *sIP, char *sPort, int aTimeout,
+                     int argc, char *argv[], struct WebRing *out, struct WebRing *in);
+void stopWebListener(int id);